@@ -113,4 +113,29 @@ protected:
 
 VARIANT_ENUM_CAST(VoxelTool::Mode)
 
+// Combines the SDF of a shape with existing SDF, according to the edition mode
+inline float sdf_blend(float src_value, float dst_value, VoxelTool::Mode mode) {
+	float res;
+	switch (mode) {
+		case VoxelTool::MODE_ADD:
+			// Union
+			res = min(src_value, dst_value);
+			break;
+
+		case VoxelTool::MODE_REMOVE:
+			// Relative complement (or difference)
+			res = max(1.f - src_value, dst_value);
+			break;
+
+		case VoxelTool::MODE_SET:
+			res = src_value;
+			break;
+
+		default:
+			res = 0;
+			break;
+	}
+	return res;
+}
+
 #endif // VOXEL_TOOL_H
@@ -1,5 +1,7 @@
 #include "voxel_tool_buffer.h"
 #include "../storage/voxel_buffer.h"
+#include "../util/macros.h"
+#include "../util/profiling.h"
 
 VoxelToolBuffer::VoxelToolBuffer(Ref<VoxelBuffer> vb) {
 	ERR_FAIL_COND(vb.is_null());
@@ -36,6 +38,60 @@ void VoxelToolBuffer::_post_edit(const Rect3i &box) {
 	// Nothing special to do
 }
 
+// Edits go through the bulk accessors of VoxelBuffer, which avoids per-voxel checks and depth dispatch
+
+void VoxelToolBuffer::do_sphere(Vector3 center, float radius) {
+	VOXEL_PROFILE_SCOPE();
+	ERR_FAIL_COND(_buffer.is_null());
+
+	const Rect3i box(Vector3i(center) - Vector3i(Math::floor(radius)), Vector3i(Math::ceil(radius) * 2));
+
+	if (!is_area_editable(box)) {
+		PRINT_VERBOSE("Area not editable");
+		return;
+	}
+
+	if (_channel == VoxelBuffer::CHANNEL_SDF) {
+		const Mode mode = _mode;
+		_buffer->write_box_f(box, _channel, [center, radius, mode](Vector3i pos, real_t v) {
+			const float d = pos.to_vec3().distance_to(center) - radius;
+			return sdf_blend(d, v, mode);
+		});
+
+	} else {
+		const uint64_t value = _mode == MODE_REMOVE ? _eraser_value : _value;
+		_buffer->write_box(box, _channel, [center, radius, value](Vector3i pos, uint64_t v) {
+			return pos.to_vec3().distance_to(center) <= radius ? value : v;
+		});
+	}
+}
+
+void VoxelToolBuffer::do_box(Vector3i begin, Vector3i end) {
+	VOXEL_PROFILE_SCOPE();
+	ERR_FAIL_COND(_buffer.is_null());
+
+	Vector3i::sort_min_max(begin, end);
+	const Rect3i box = Rect3i::from_min_max(begin, end + Vector3i(1, 1, 1));
+
+	if (!is_area_editable(box)) {
+		PRINT_VERBOSE("Area not editable");
+		return;
+	}
+
+	if (_channel == VoxelBuffer::CHANNEL_SDF) {
+		const Mode mode = _mode;
+		_buffer->write_box_f(box, _channel, [mode](Vector3i pos, real_t v) {
+			return sdf_blend(-1.0, v, mode);
+		});
+
+	} else {
+		const uint64_t value = _mode == MODE_REMOVE ? _eraser_value : _value;
+		_buffer->write_box(box, _channel, [value](Vector3i pos, uint64_t v) {
+			return value;
+		});
+	}
+}
+
 void VoxelToolBuffer::set_voxel_metadata(Vector3i pos, Variant meta) {
 	ERR_FAIL_COND(_buffer.is_null());
 	_buffer->set_voxel_metadata(pos, meta);
@@ -203,6 +203,10 @@ int VoxelGeneratorGraph::get_used_channels_mask() const {
 	return 1 << _channel;
 }
 
+bool VoxelGeneratorGraph::is_cloneable() const {
+	return true;
+}
+
 void VoxelGeneratorGraph::generate_block(VoxelBlockRequest &input) {
 	if (!_runtime.has_output()) {
 		return;
@@ -86,6 +86,8 @@ public:
 	int get_used_channels_mask() const override;
 
 	void generate_block(VoxelBlockRequest &input) override;
+	// The runtime uses internal memory when generating, so each thread needs its own copy of the graph
+	bool is_cloneable() const override;
 	float generate_single(const Vector3i &position);
 
 	enum BoundsType {
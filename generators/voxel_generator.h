@@ -16,8 +16,8 @@ public:
 	virtual void generate_block(VoxelBlockRequest &input);
 	// TODO Single sample
 
-	//	virtual bool is_thread_safe() const;
-	//	virtual bool is_cloneable() const;
+	bool is_thread_safe() const override;
+	bool is_cloneable() const override;
 
 private:
 	void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
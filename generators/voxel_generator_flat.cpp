@@ -31,6 +31,10 @@ void VoxelGeneratorFlat::set_height(float h) {
 	_height = h;
 }
 
+bool VoxelGeneratorFlat::is_thread_safe() const {
+	return true;
+}
+
 void VoxelGeneratorFlat::generate_block(VoxelBlockRequest &input) {
 	ERR_FAIL_COND(input.voxel_buffer.is_null());
 
@@ -14,6 +14,7 @@ public:
 	int get_used_channels_mask() const override;
 
 	void generate_block(VoxelBlockRequest &input) override;
+	bool is_thread_safe() const override;
 
 	void set_voxel_type(int t);
 	int get_voxel_type() const;
@@ -87,6 +87,11 @@ static inline float get_shaped_noise(OpenSimplexNoise &noise, float x, float y,
 	return sum / max;
 }
 
+bool VoxelGeneratorNoise::is_thread_safe() const {
+	// Noise is only read
+	return true;
+}
+
 void VoxelGeneratorNoise::generate_block(VoxelBlockRequest &input) {
 	ERR_FAIL_COND(input.voxel_buffer.is_null());
 	ERR_FAIL_COND(_noise.is_null());
@@ -24,6 +24,7 @@ public:
 	real_t get_height_range() const;
 
 	void generate_block(VoxelBlockRequest &input) override;
+	bool is_thread_safe() const override;
 
 protected:
 	static void _bind_methods();
@@ -26,6 +26,11 @@ Ref<Curve> VoxelGeneratorNoise2D::get_curve() const {
 	return _curve;
 }
 
+bool VoxelGeneratorNoise2D::is_thread_safe() const {
+	// Curves bake themselves on first use, so they are not safe to share
+	return _curve.is_null();
+}
+
 void VoxelGeneratorNoise2D::generate_block(VoxelBlockRequest &input) {
 
 	ERR_FAIL_COND(_noise.is_null());
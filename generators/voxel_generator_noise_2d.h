@@ -17,6 +17,7 @@ public:
 	Ref<Curve> get_curve() const;
 
 	void generate_block(VoxelBlockRequest &input) override;
+	bool is_thread_safe() const override;
 
 private:
 	static void _bind_methods();
@@ -7,6 +7,10 @@ VoxelGeneratorWaves::VoxelGeneratorWaves() {
 	set_height_range(30);
 }
 
+bool VoxelGeneratorWaves::is_thread_safe() const {
+	return true;
+}
+
 void VoxelGeneratorWaves::generate_block(VoxelBlockRequest &input) {
 
 	VoxelBuffer &out_buffer = **input.voxel_buffer;
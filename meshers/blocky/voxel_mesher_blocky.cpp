@@ -406,6 +406,12 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelMesher::In
 		return;
 	}
 
+	if (voxels.get_layout() != VoxelBuffer::LAYOUT_LINEAR) {
+		// Columns are read directly from memory
+		ERR_PRINT("VoxelMesherBlocky received unsupported voxel layout");
+		return;
+	}
+
 	ArraySlice<uint8_t> raw_channel;
 	if (!voxels.get_channel_raw(channel, raw_channel)) {
 		/*       _
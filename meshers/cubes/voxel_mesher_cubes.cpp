@@ -422,6 +422,12 @@ void VoxelMesherCubes::build(VoxelMesher::Output &output, const VoxelMesher::Inp
 		return;
 	}
 
+	if (voxels.get_layout() != VoxelBuffer::LAYOUT_LINEAR) {
+		// Columns are read directly from memory
+		ERR_PRINT("VoxelMesherCubes received unsupported voxel layout");
+		return;
+	}
+
 	ArraySlice<uint8_t> raw_channel;
 	if (!voxels.get_channel_raw(channel, raw_channel)) {
 		// Case supposedly handled before...
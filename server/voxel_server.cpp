@@ -1,9 +1,13 @@
 #include "voxel_server.h"
 #include "../meshers/transvoxel/voxel_mesher_transvoxel.h"
+#include "../storage/voxel_memory_pool.h"
+#include "../streams/voxel_stream_file.h"
 #include "../util/macros.h"
 #include "../util/profiling.h"
 #include "../voxel_constants.h"
 #include <core/os/memory.h>
+#include <core/os/os.h>
+#include <core/project_settings.h>
 #include <scene/main/viewport.h>
 
 namespace {
@@ -21,6 +25,26 @@ inline Dst_T *must_be_cast(IVoxelTask *src) {
 #endif
 }
 
+// Locks a mutex only if the resource it protects needs it
+class OptionalMutexLock {
+public:
+	OptionalMutexLock(Mutex *mutex, bool enabled) :
+			_mutex(enabled ? mutex : nullptr) {
+		if (_mutex != nullptr) {
+			_mutex->lock();
+		}
+	}
+
+	~OptionalMutexLock() {
+		if (_mutex != nullptr) {
+			_mutex->unlock();
+		}
+	}
+
+private:
+	Mutex *_mutex;
+};
+
 template <typename T>
 inline std::shared_ptr<T> gd_make_shared() {
 	// std::make_shared() apparently wont allow us to specify custom new and delete
@@ -44,31 +68,46 @@ void VoxelServer::destroy_singleton() {
 }
 
 VoxelServer::VoxelServer() {
-	// TODO Can't set more than 1 thread yet, streams aren't well made for it... unless we can separate file ones
+	const int streaming_thread_count = GLOBAL_DEF("voxel/threads/streaming_thread_count", 1);
+	ProjectSettings::get_singleton()->set_custom_property_info("voxel/threads/streaming_thread_count",
+			PropertyInfo(Variant::INT, "voxel/threads/streaming_thread_count", PROPERTY_HINT_RANGE, "1,64"));
+
+	const int meshing_thread_count = GLOBAL_DEF("voxel/threads/meshing_thread_count", 2);
+	ProjectSettings::get_singleton()->set_custom_property_info("voxel/threads/meshing_thread_count",
+			PropertyInfo(Variant::INT, "voxel/threads/meshing_thread_count", PROPERTY_HINT_RANGE, "1,64"));
+
+	const int generation_thread_count = GLOBAL_DEF("voxel/threads/generation_thread_count", 1);
+	ProjectSettings::get_singleton()->set_custom_property_info("voxel/threads/generation_thread_count",
+			PropertyInfo(Variant::INT, "voxel/threads/generation_thread_count", PROPERTY_HINT_RANGE, "1,64"));
+
+	const int memory_cache_budget_mb = GLOBAL_DEF("voxel/memory/cache_budget_mb", 64);
+	ProjectSettings::get_singleton()->set_custom_property_info("voxel/memory/cache_budget_mb",
+			PropertyInfo(Variant::INT, "voxel/memory/cache_budget_mb", PROPERTY_HINT_RANGE, "0,4096"));
+	VoxelMemoryPool::get_singleton()->set_cache_budget(static_cast<uint64_t>(max(memory_cache_budget_mb, 0)) << 20);
+
+	_max_thread_count = max(OS::get_singleton()->get_processor_count(),
+			max(streaming_thread_count, max(meshing_thread_count, generation_thread_count)));
+	_blocky_meshers.resize(_max_thread_count);
+	_smooth_meshers.resize(_max_thread_count);
+	_meshing_buffers.resize(_max_thread_count);
+
 	// This pool can work on larger periods, it doesn't require low latency
-	_streaming_thread_pool.set_thread_count(1);
 	_streaming_thread_pool.set_priority_update_period(300);
 	_streaming_thread_pool.set_batch_count(16);
+	set_streaming_thread_count(streaming_thread_count);
 
-	// TODO Try more threads, it should be possible
 	// This pool works on visuals so it must have low latency
-	_meshing_thread_pool.set_thread_count(2);
 	_meshing_thread_pool.set_priority_update_period(64);
 	_meshing_thread_pool.set_batch_count(1);
+	// Meshing tasks are short and numerous, threads would otherwise spend a lot of time contending on the queue
+	_meshing_thread_pool.set_work_stealing_enabled(true);
+	set_meshing_thread_count(meshing_thread_count);
 
-	for (size_t i = 0; i < _meshing_thread_pool.get_thread_count(); ++i) {
-		Ref<VoxelMesherBlocky> mesher;
-		mesher.instance();
-		mesher->set_occlusion_enabled(true);
-		mesher->set_occlusion_darkness(0.8f);
-		_blocky_meshers[i] = mesher;
-	}
-
-	for (size_t i = 0; i < _meshing_thread_pool.get_thread_count(); ++i) {
-		Ref<VoxelMesherTransvoxel> mesher;
-		mesher.instance();
-		_smooth_meshers[i] = mesher;
-	}
+	// Generated blocks are awaited like loaded ones, but tasks are heavier so they are not batched
+	_generation_thread_pool.set_priority_update_period(100);
+	_generation_thread_pool.set_batch_count(1);
+	_generation_thread_pool.set_work_stealing_enabled(true);
+	set_generation_thread_count(generation_thread_count);
 
 	if (Engine::get_singleton()->is_editor_hint()) {
 		// Default viewer
@@ -95,6 +134,7 @@ VoxelServer::~VoxelServer() {
 
 void VoxelServer::wait_and_clear_all_tasks(bool warn) {
 	_streaming_thread_pool.wait_for_all_tasks();
+	_generation_thread_pool.wait_for_all_tasks();
 	_meshing_thread_pool.wait_for_all_tasks();
 
 	_streaming_thread_pool.dequeue_completed_tasks([warn](IVoxelTask *task) {
@@ -105,6 +145,14 @@ void VoxelServer::wait_and_clear_all_tasks(bool warn) {
 		memdelete(task);
 	});
 
+	_generation_thread_pool.dequeue_completed_tasks([warn](IVoxelTask *task) {
+		if (warn) {
+			WARN_PRINT("Generation tasks remain on module cleanup, "
+					   "this could become a problem if they reference scripts");
+		}
+		memdelete(task);
+	});
+
 	_meshing_thread_pool.dequeue_completed_tasks([](IVoxelTask *task) {
 		memdelete(task);
 	});
@@ -159,8 +207,52 @@ void VoxelServer::set_volume_block_size(uint32_t volume_id, uint32_t block_size)
 	volume.block_size = block_size;
 }
 
+VoxelServer::StreamingDependency::StreamingDependency() {
+	streams_mutex = Mutex::create();
+	generators_mutex = Mutex::create();
+}
+
+VoxelServer::StreamingDependency::~StreamingDependency() {
+	memdelete(streams_mutex);
+	memdelete(generators_mutex);
+}
+
+// Fills per-thread slots with instances of a stream, depending on how it can be shared.
+// Threads never use the given instance, so it can still be edited while they run.
+// Returns true if the instance can only be used by one thread.
+static bool fill_per_thread_streams(std::vector<Ref<VoxelStream>> &slots, Ref<VoxelStream> stream, bool thread_safe) {
+	if (thread_safe) {
+		// One instance shared by all threads
+		Ref<VoxelStream> stream_copy = stream->duplicate();
+		for (size_t i = 0; i < slots.size(); ++i) {
+			slots[i] = stream_copy;
+		}
+
+	} else if (stream->is_cloneable()) {
+		for (size_t i = 0; i < slots.size(); ++i) {
+			slots[i] = stream->duplicate();
+		}
+
+	} else {
+		// One instance, which only one thread will use
+		Ref<VoxelStream> stream_copy = stream->duplicate();
+		for (size_t i = 0; i < slots.size(); ++i) {
+			slots[i] = stream_copy;
+		}
+		return true;
+	}
+
+	return false;
+}
+
 void VoxelServer::set_volume_stream(uint32_t volume_id, Ref<VoxelStream> stream) {
 	Volume &volume = _world.volumes.get(volume_id);
+
+	// Pending saves were requested for the previous stream
+	flush_pending_saves(volume, volume_id);
+	// Loads are not, and the volume will request them again
+	volume.pending_loads.clear();
+
 	volume.stream = stream;
 
 	// Commit a new stream to process requests with
@@ -170,8 +262,30 @@ void VoxelServer::set_volume_stream(uint32_t volume_id, Ref<VoxelStream> stream)
 
 	if (stream.is_valid()) {
 		volume.stream_dependency = gd_make_shared<StreamingDependency>();
-		for (size_t i = 0; i < _streaming_thread_pool.get_thread_count(); ++i) {
-			volume.stream_dependency->streams[i] = stream->duplicate();
+		StreamingDependency &dep = *volume.stream_dependency;
+		// Slots are filled for all potential threads, because the thread count can change after
+		// requests have been made with this dependency
+		dep.streams.resize(_max_thread_count);
+
+		VoxelStreamFile *file_stream = Object::cast_to<VoxelStreamFile>(*stream);
+		Ref<VoxelStream> fallback_stream;
+		if (file_stream != nullptr) {
+			fallback_stream = file_stream->get_fallback_stream();
+		}
+
+		if (fallback_stream.is_valid()) {
+			// Blocks missing from files are generated in a separate stage,
+			// so reading files doesn't have to wait for generation
+			dep.single_thread = fill_per_thread_streams(
+					dep.streams, stream, file_stream->is_thread_safe_without_fallback());
+
+			dep.generators.resize(_max_thread_count);
+			dep.generators_single_thread = fill_per_thread_streams(
+					dep.generators, fallback_stream, fallback_stream->is_thread_safe());
+			dep.save_generator_output = file_stream->get_save_fallback_output();
+
+		} else {
+			dep.single_thread = fill_per_thread_streams(dep.streams, stream, stream->is_thread_safe());
 		}
 	} else {
 		volume.stream_dependency = nullptr;
@@ -239,7 +353,12 @@ void VoxelServer::request_block_mesh(uint32_t volume_id, BlockMeshInput &input)
 
 	BlockMeshRequest *r = memnew(BlockMeshRequest);
 	r->volume_id = volume_id;
-	r->blocks = input.blocks;
+	// Blocks can be modified while the request is pending, so it gets its own cheap copies
+	for (unsigned int i = 0; i < input.blocks.size(); ++i) {
+		if (input.blocks[i].is_valid()) {
+			r->blocks[i] = input.blocks[i]->snapshot(false);
+		}
+	}
 	r->position = input.position;
 	r->lod = input.lod;
 
@@ -255,50 +374,207 @@ void VoxelServer::request_block_mesh(uint32_t volume_id, BlockMeshInput &input)
 	_meshing_thread_pool.enqueue(r);
 }
 
+int VoxelServer::get_block_data_affinity(const Volume &volume, uint32_t volume_id, Vector3i block_pos, int lod) {
+	if (volume.stream_dependency->single_thread) {
+		// Different volumes can still go to different threads
+		return volume_id & 0x7fffffff;
+	}
+	const Vector3i origin_in_voxels = (block_pos << lod) * volume.block_size;
+	return volume.stream->get_block_affinity(origin_in_voxels, lod);
+}
+
+int VoxelServer::get_block_generate_affinity(const StreamingDependency &dep, uint32_t volume_id) {
+	if (dep.generators_single_thread) {
+		return volume_id & 0x7fffffff;
+	}
+	return -1;
+}
+
 void VoxelServer::request_block_load(uint32_t volume_id, Vector3i block_pos, int lod) {
-	const Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _world.volumes.get(volume_id);
 	ERR_FAIL_COND(volume.stream.is_null());
 	CRASH_COND(volume.stream_dependency == nullptr);
 
-	BlockDataRequest r;
-	r.volume_id = volume_id;
-	r.position = block_pos;
-	r.lod = lod;
-	r.type = BlockDataRequest::TYPE_LOAD;
-	r.block_size = volume.block_size;
-
-	r.stream_dependency = volume.stream_dependency;
-
-	init_priority_dependency(r.priority_dependency, block_pos, lod, volume);
+	BlockLocation location;
+	location.position = block_pos;
+	location.lod = lod;
+
+	const unsigned int *pending_save_index = volume.pending_saves_index.getptr(location);
+	if (pending_save_index != nullptr) {
+		// The block was not saved yet, so the stream would return older data. The latest data is right here.
+		BlockDataOutput o;
+		o.voxels = volume.pending_saves[*pending_save_index].voxels->snapshot(true);
+		o.position = block_pos;
+		o.lod = lod;
+		o.dropped = false;
+		o.type = BlockDataOutput::TYPE_LOAD;
+		volume.reception_buffers->data_output.push_back(o);
+		return;
+	}
 
-	BlockDataRequest *rp = memnew(BlockDataRequest(r));
-	_streaming_thread_pool.enqueue(rp);
+	BlockToLoad b;
+	b.position = block_pos;
+	b.lod = lod;
+	init_priority_dependency(b.priority_dependency, block_pos, lod, volume);
+	volume.pending_loads.push_back(b);
 }
 
 void VoxelServer::request_block_save(uint32_t volume_id, Ref<VoxelBuffer> voxels, Vector3i block_pos, int lod) {
-	const Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _world.volumes.get(volume_id);
 	ERR_FAIL_COND(volume.stream.is_null());
+	ERR_FAIL_COND(voxels.is_null());
+	CRASH_COND(volume.stream_dependency == nullptr);
+
+	// The volume can keep modifying its blocks, so we work on a cheap copy
+	voxels = voxels->snapshot(true);
+
+	BlockLocation location;
+	location.position = block_pos;
+	location.lod = lod;
+
+	const unsigned int *index = volume.pending_saves_index.getptr(location);
+	if (index != nullptr) {
+		// Only the latest data needs to be written
+		volume.pending_saves[*index].voxels = voxels;
+		return;
+	}
+
+	BlockToSave b;
+	b.voxels = voxels;
+	b.position = block_pos;
+	b.lod = lod;
+	volume.pending_saves_index.set(location, volume.pending_saves.size());
+	volume.pending_saves.push_back(b);
+}
+
+void VoxelServer::request_block_compression(uint32_t volume_id, Ref<VoxelBuffer> voxels) {
+	Volume &volume = _world.volumes.get(volume_id);
+	ERR_FAIL_COND(voxels.is_null());
+
+	BlockDataRequest *r = memnew(BlockDataRequest);
+	r->compression_target = voxels;
+	// The source keeps the original data alive, so it can be told apart from data modified in the meantime
+	r->compression_source = voxels->snapshot(false);
+	r->voxels = r->compression_source->snapshot(false);
+	r->volume_id = volume_id;
+	r->block_size = volume.block_size;
+	r->type = BlockDataRequest::TYPE_COMPRESS;
+
+	_streaming_thread_pool.enqueue(r);
+}
+
+void VoxelServer::flush_pending_saves(Volume &volume, uint32_t volume_id) {
+	if (volume.pending_saves.size() == 0) {
+		return;
+	}
+	VOXEL_PROFILE_SCOPE();
 	CRASH_COND(volume.stream_dependency == nullptr);
 
-	BlockDataRequest r;
-	r.voxels = voxels;
-	r.volume_id = volume_id;
-	r.position = block_pos;
-	r.lod = lod;
-	r.type = BlockDataRequest::TYPE_SAVE;
-	r.block_size = volume.block_size;
+	// Blocks are grouped by the thread which will save them, so streams can batch file access.
+	// With region files, this means one batch per region.
+	std::vector<BlockDataRequest *> batches;
+
+	for (size_t i = 0; i < volume.pending_saves.size(); ++i) {
+		const BlockToSave &b = volume.pending_saves[i];
+
+		int affinity = get_block_data_affinity(volume, volume_id, b.position, b.lod);
+		if (affinity < 0) {
+			// Saves of the same block must not run concurrently, and must run in order
+			affinity = volume_id & 0x7fffffff;
+		}
+
+		BlockDataRequest *batch = nullptr;
+		for (size_t j = 0; j < batches.size(); ++j) {
+			if (batches[j]->thread_affinity == affinity) {
+				batch = batches[j];
+				break;
+			}
+		}
+
+		if (batch == nullptr) {
+			batch = memnew(BlockDataRequest);
+			batch->volume_id = volume_id;
+			batch->position = b.position;
+			batch->lod = b.lod;
+			batch->type = BlockDataRequest::TYPE_SAVE;
+			batch->block_size = volume.block_size;
+			batch->stream_dependency = volume.stream_dependency;
+			batch->thread_affinity = affinity;
+			batch->save_order = _next_save_order;
+			batches.push_back(batch);
+		}
+
+		batch->blocks_to_save.push_back(b);
+	}
 
-	r.stream_dependency = volume.stream_dependency;
+	++_next_save_order;
 
-	// No priority data, saving doesnt need sorting
+	for (size_t i = 0; i < batches.size(); ++i) {
+		_streaming_thread_pool.enqueue(batches[i]);
+	}
 
-	BlockDataRequest *rp = memnew(BlockDataRequest(r));
-	_streaming_thread_pool.enqueue(rp);
+	volume.pending_saves.clear();
+	volume.pending_saves_index.clear();
+}
+
+void VoxelServer::flush_pending_loads(Volume &volume, uint32_t volume_id) {
+	if (volume.pending_loads.size() == 0) {
+		return;
+	}
+	VOXEL_PROFILE_SCOPE();
+	CRASH_COND(volume.stream_dependency == nullptr);
+
+	// Like saves, blocks going to the same thread are grouped so streams can batch file access.
+	// Batches are kept small enough for priorities and cancellation to remain relevant.
+	const size_t max_batch_size = 64;
+
+	std::vector<BlockDataRequest *> batches;
+
+	for (size_t i = 0; i < volume.pending_loads.size(); ++i) {
+		const BlockToLoad &b = volume.pending_loads[i];
+
+		const int affinity = get_block_data_affinity(volume, volume_id, b.position, b.lod);
+
+		BlockDataRequest *batch = nullptr;
+		if (affinity >= 0) {
+			// Any thread can take blocks without affinity, so those don't need to be grouped
+			for (size_t j = 0; j < batches.size(); ++j) {
+				BlockDataRequest *candidate = batches[j];
+				if (candidate->thread_affinity == affinity && candidate->blocks_to_load.size() < max_batch_size) {
+					batch = candidate;
+					break;
+				}
+			}
+		}
+
+		if (batch == nullptr) {
+			batch = memnew(BlockDataRequest);
+			batch->volume_id = volume_id;
+			batch->position = b.position;
+			batch->lod = b.lod;
+			batch->type = BlockDataRequest::TYPE_LOAD;
+			batch->block_size = volume.block_size;
+			batch->stream_dependency = volume.stream_dependency;
+			batch->thread_affinity = affinity;
+			batch->priority_dependency = b.priority_dependency;
+			batches.push_back(batch);
+		}
+
+		batch->blocks_to_load.push_back(b);
+	}
+
+	for (size_t i = 0; i < batches.size(); ++i) {
+		_streaming_thread_pool.enqueue(batches[i]);
+	}
+
+	volume.pending_loads.clear();
 }
 
 void VoxelServer::remove_volume(uint32_t volume_id) {
 	{
 		Volume &volume = _world.volumes.get(volume_id);
+		// Volumes usually save their blocks just before being removed
+		flush_pending_saves(volume, volume_id);
 		if (volume.stream_dependency != nullptr) {
 			volume.stream_dependency->valid = false;
 		}
@@ -317,6 +593,16 @@ void VoxelServer::remove_volume(uint32_t volume_id) {
 	}
 }
 
+bool VoxelServer::is_stream_used_by_volumes(const VoxelStream *stream) const {
+	bool used = false;
+	_world.volumes.for_each([&used, stream](const Volume &volume) {
+		if (volume.stream.ptr() == stream) {
+			used = true;
+		}
+	});
+	return used;
+}
+
 uint32_t VoxelServer::add_viewer() {
 	if (Engine::get_singleton()->is_editor_hint()) {
 		// Remove default viewer if any
@@ -392,41 +678,19 @@ void VoxelServer::process() {
 	// Receive data updates
 	_streaming_thread_pool.dequeue_completed_tasks([this](IVoxelTask *task) {
 		BlockDataRequest *r = must_be_cast<BlockDataRequest>(task);
-		Volume *volume = _world.volumes.try_get(r->volume_id);
-
-		if (volume != nullptr) {
-			// TODO Comparing pointer may not be guaranteed
-			// The request response must match the dependency it would have been requested with.
-			// If it doesn't match, we are no longer interested in the result.
-			if (r->stream_dependency == volume->stream_dependency) {
-				BlockDataOutput o;
-				o.voxels = r->voxels;
-				o.position = r->position;
-				o.lod = r->lod;
-				o.dropped = !r->has_run;
-
-				switch (r->type) {
-					case BlockDataRequest::TYPE_SAVE:
-						o.type = BlockDataOutput::TYPE_SAVE;
-						break;
-
-					case BlockDataRequest::TYPE_LOAD:
-						o.type = BlockDataOutput::TYPE_LOAD;
-						break;
-
-					default:
-						CRASH_NOW_MSG("Unexpected data request response type");
-				}
-
-				volume->reception_buffers->data_output.push_back(o);
-			}
+		receive_block_data_request(r);
+	});
 
-		} else {
-			// This can happen if the user removes the volume while requests are still about to return
-			PRINT_VERBOSE("Data request response came back but volume wasn't found");
-		}
+	_generation_thread_pool.dequeue_completed_tasks([this](IVoxelTask *task) {
+		BlockDataRequest *r = must_be_cast<BlockDataRequest>(task);
+		receive_block_data_request(r);
+	});
 
-		memdelete(r);
+	// Send saves requested since last time, including those of generated blocks.
+	// Loads are sent after, so they can't be handed older data than what is being saved.
+	_world.volumes.for_each_with_id([this](Volume &volume, uint32_t volume_id) {
+		flush_pending_saves(volume, volume_id);
+		flush_pending_loads(volume, volume_id);
 	});
 
 	// Receive mesh updates
@@ -434,6 +698,10 @@ void VoxelServer::process() {
 		BlockMeshRequest *r = must_be_cast<BlockMeshRequest>(task);
 		Volume *volume = _world.volumes.try_get(r->volume_id);
 
+		if (!r->has_run && r->too_far) {
+			++_meshing_stats.dropped_too_far;
+		}
+
 		if (volume != nullptr) {
 			// TODO Comparing pointer may not be guaranteed
 			// The request response must match the dependency it would have been requested with.
@@ -487,6 +755,132 @@ void VoxelServer::process() {
 		// - Hysteresis is needed to reduce ping-pong
 		_world.shared_priority_dependency->highest_view_distance = max_distance * 2;
 	}
+
+	const uint64_t now_usec = OS::get_singleton()->get_ticks_usec();
+	const uint64_t elapsed_usec = now_usec - _last_throughput_time_usec;
+	if (elapsed_usec >= 1000000) {
+		update_throughput(_streaming_thread_pool, _streaming_stats, elapsed_usec);
+		update_throughput(_generation_thread_pool, _generation_stats, elapsed_usec);
+		update_throughput(_meshing_thread_pool, _meshing_stats, elapsed_usec);
+		_last_throughput_time_usec = now_usec;
+
+		// Give memory that is no longer needed back to the system, while threads have nothing to do
+		if (_streaming_thread_pool.get_debug_remaining_tasks() == 0 &&
+				_generation_thread_pool.get_debug_remaining_tasks() == 0 &&
+				_meshing_thread_pool.get_debug_remaining_tasks() == 0) {
+			VoxelMemoryPool::get_singleton()->trim();
+		}
+	}
+}
+
+void VoxelServer::update_throughput(const VoxelThreadPool &pool, TaskStats &stats, uint64_t elapsed_usec) {
+	VoxelThreadPool::Stats pool_stats;
+	pool.get_stats(pool_stats);
+	stats.update_throughput(pool_stats.run_time.total, elapsed_usec);
+}
+
+void VoxelServer::receive_block_data_request(BlockDataRequest *r) {
+	if (r->type == BlockDataRequest::TYPE_COMPRESS) {
+		// Doesn't depend on the volume, the target is the buffer itself
+		r->compression_target->take_compressed_channels(**r->compression_source, **r->voxels);
+		memdelete(r);
+		return;
+	}
+
+	Volume *volume = _world.volumes.try_get(r->volume_id);
+
+	if (r->type == BlockDataRequest::TYPE_LOAD) {
+		// Blocks of a batch can be dropped individually
+		for (size_t i = 0; i < r->blocks_to_load.size(); ++i) {
+			const BlockToLoad &b = r->blocks_to_load[i];
+			if ((!r->has_run || b.voxels.is_null()) && b.too_far) {
+				++_streaming_stats.dropped_too_far;
+			}
+		}
+
+	} else if (!r->has_run && r->too_far) {
+		if (r->type == BlockDataRequest::TYPE_GENERATE) {
+			++_generation_stats.dropped_too_far;
+		} else {
+			++_streaming_stats.dropped_too_far;
+		}
+	}
+
+	if (volume != nullptr) {
+		// TODO Comparing pointer may not be guaranteed
+		// The request response must match the dependency it would have been requested with.
+		// If it doesn't match, we are no longer interested in the result.
+		if (r->stream_dependency == volume->stream_dependency) {
+			switch (r->type) {
+				case BlockDataRequest::TYPE_SAVE:
+					// One confirmation per block of the batch
+					for (size_t i = 0; i < r->blocks_to_save.size(); ++i) {
+						const BlockToSave &b = r->blocks_to_save[i];
+						BlockDataOutput o;
+						o.position = b.position;
+						o.lod = b.lod;
+						o.dropped = !r->has_run;
+						o.type = BlockDataOutput::TYPE_SAVE;
+						volume->reception_buffers->data_output.push_back(o);
+					}
+					break;
+
+				case BlockDataRequest::TYPE_LOAD:
+					for (size_t i = 0; i < r->blocks_to_load.size(); ++i) {
+						BlockToLoad &b = r->blocks_to_load[i];
+
+						if (r->has_run && b.requires_generation) {
+							// The block was not found in files, forward it to the generation stage.
+							// The terrain doesn't see the difference.
+							BlockDataRequest *g = memnew(BlockDataRequest);
+							g->volume_id = r->volume_id;
+							g->position = b.position;
+							g->lod = b.lod;
+							g->type = BlockDataRequest::TYPE_GENERATE;
+							g->block_size = r->block_size;
+							g->stream_dependency = r->stream_dependency;
+							g->priority_dependency = b.priority_dependency;
+							g->thread_affinity = get_block_generate_affinity(*r->stream_dependency, r->volume_id);
+							_generation_thread_pool.enqueue(g);
+							continue;
+						}
+
+						BlockDataOutput o;
+						o.voxels = b.voxels;
+						o.position = b.position;
+						o.lod = b.lod;
+						o.dropped = !r->has_run || b.voxels.is_null();
+						o.type = BlockDataOutput::TYPE_LOAD;
+						volume->reception_buffers->data_output.push_back(o);
+					}
+					break;
+
+				case BlockDataRequest::TYPE_GENERATE: {
+					BlockDataOutput o;
+					o.voxels = r->voxels;
+					o.position = r->position;
+					o.lod = r->lod;
+					o.dropped = !r->has_run;
+					o.type = BlockDataOutput::TYPE_LOAD;
+					volume->reception_buffers->data_output.push_back(o);
+				} break;
+
+				default:
+					CRASH_NOW_MSG("Unexpected data request response type");
+			}
+
+			if (r->type == BlockDataRequest::TYPE_GENERATE && r->has_run &&
+					r->stream_dependency->save_generator_output) {
+				request_block_save(r->volume_id, r->voxels, r->position, r->lod);
+			}
+		}
+
+	} else {
+		// This can happen if the user removes the volume while requests are still about to return
+		PRINT_VERBOSE("Data request response came back but volume wasn't found");
+	}
+
+	memdelete(r);
 }
 
 void VoxelServer::get_min_max_block_padding(
@@ -512,6 +906,64 @@ void VoxelServer::get_min_max_block_padding(
 	}
 }
 
+// Requests with thread affinity queued before the change can run on a different thread than those queued after,
+// for a short time. Single-thread streams are protected by a lock in that case.
+void VoxelServer::set_streaming_thread_count(uint32_t count) {
+	ERR_FAIL_COND_MSG(count == 0, "At least one streaming thread is required");
+	ERR_FAIL_COND_MSG(count > _max_thread_count,
+			String("Thread count can't be higher than {0}").format(varray(_max_thread_count)));
+	_streaming_thread_pool.set_thread_count(count);
+}
+
+uint32_t VoxelServer::get_streaming_thread_count() const {
+	return _streaming_thread_pool.get_thread_count();
+}
+
+void VoxelServer::set_meshing_thread_count(uint32_t count) {
+	ERR_FAIL_COND_MSG(count == 0, "At least one meshing thread is required");
+	ERR_FAIL_COND_MSG(count > _max_thread_count,
+			String("Thread count can't be higher than {0}").format(varray(_max_thread_count)));
+
+	// Meshers and buffers must exist before threads that will use them start
+	for (size_t i = _meshing_thread_pool.get_thread_count(); i < count; ++i) {
+		if (_blocky_meshers[i].is_null()) {
+			Ref<VoxelMesherBlocky> mesher;
+			mesher.instance();
+			mesher->set_occlusion_enabled(true);
+			mesher->set_occlusion_darkness(0.8f);
+			_blocky_meshers[i] = mesher;
+		}
+		if (_smooth_meshers[i].is_null()) {
+			Ref<VoxelMesherTransvoxel> mesher;
+			mesher.instance();
+			_smooth_meshers[i] = mesher;
+		}
+		if (_meshing_buffers[i].is_null()) {
+			Ref<VoxelBuffer> buffer;
+			buffer.instance();
+			_meshing_buffers[i] = buffer;
+		}
+	}
+
+	_meshing_thread_pool.set_thread_count(count);
+}
+
+uint32_t VoxelServer::get_meshing_thread_count() const {
+	return _meshing_thread_pool.get_thread_count();
+}
+
+// Same as streaming, single-thread generators are protected by a lock while requests move to other threads
+void VoxelServer::set_generation_thread_count(uint32_t count) {
+	ERR_FAIL_COND_MSG(count == 0, "At least one generation thread is required");
+	ERR_FAIL_COND_MSG(count > _max_thread_count,
+			String("Thread count can't be higher than {0}").format(varray(_max_thread_count)));
+	_generation_thread_pool.set_thread_count(count);
+}
+
+uint32_t VoxelServer::get_generation_thread_count() const {
+	return _generation_thread_pool.get_thread_count();
+}
+
 static unsigned int debug_get_active_thread_count(const VoxelThreadPool &pool) {
 	unsigned int active_count = 0;
 	for (unsigned int i = 0; i < pool.get_thread_count(); ++i) {
@@ -523,23 +975,95 @@ static unsigned int debug_get_active_thread_count(const VoxelThreadPool &pool) {
 	return active_count;
 }
 
-static Dictionary debug_get_pool_stats(const VoxelThreadPool &pool) {
+static Dictionary get_latency_stats(const LatencyHistogram::Counts &counts) {
+	Dictionary d;
+	d["p50"] = counts.get_percentile_usec(0.5f);
+	d["p95"] = counts.get_percentile_usec(0.95f);
+	d["p99"] = counts.get_percentile_usec(0.99f);
+	return d;
+}
+
+Dictionary VoxelServer::debug_get_pool_stats(const VoxelThreadPool &pool, const TaskStats &task_stats) {
+	VoxelThreadPool::Stats pool_stats;
+	pool.get_stats(pool_stats);
+
 	Dictionary d;
 	d["tasks"] = pool.get_debug_remaining_tasks();
 	d["active_threads"] = debug_get_active_thread_count(pool);
 	d["thread_count"] = pool.get_thread_count();
+	d["wait_time_usec"] = get_latency_stats(pool_stats.wait_time);
+	d["run_time_usec"] = get_latency_stats(pool_stats.run_time);
+	d["run_tasks"] = pool_stats.run_time.total;
+	d["cancelled_tasks"] = pool_stats.cancelled_tasks;
+	d["dropped_too_far"] = task_stats.dropped_too_far;
+	d["tasks_per_second"] = task_stats.tasks_per_second;
 	return d;
 }
 
 Dictionary VoxelServer::_b_get_stats() {
 	Dictionary d;
-	d["streaming"] = debug_get_pool_stats(_streaming_thread_pool);
-	d["meshing"] = debug_get_pool_stats(_meshing_thread_pool);
+	d["streaming"] = debug_get_pool_stats(_streaming_thread_pool, _streaming_stats);
+	d["meshing"] = debug_get_pool_stats(_meshing_thread_pool, _meshing_stats);
+	d["generation"] = debug_get_pool_stats(_generation_thread_pool, _generation_stats);
+
+	std::vector<VoxelMemoryPool::SizeClassStats> memory_stats;
+	VoxelMemoryPool::get_singleton()->debug_get_stats(memory_stats);
+	Array memory_pools;
+	for (unsigned int i = 0; i < memory_stats.size(); ++i) {
+		const VoxelMemoryPool::SizeClassStats &s = memory_stats[i];
+		Dictionary pd;
+		pd["size"] = s.size;
+		pd["live"] = s.live;
+		pd["cached"] = s.cached;
+		pd["high_water_mark"] = s.high_water_mark;
+		pd["trimmed"] = s.trimmed;
+		memory_pools.append(pd);
+	}
+	d["memory_pools"] = memory_pools;
+
+	// Volumes use their own instances of streams, so their statistics can only be found here
+	Array volume_streams;
+	_world.volumes.for_each_with_id([&volume_streams](const Volume &volume, uint32_t volume_id) {
+		if (volume.stream_dependency == nullptr) {
+			return;
+		}
+		VoxelStream::Stats total;
+		const std::vector<Ref<VoxelStream>> &streams = volume.stream_dependency->streams;
+		for (size_t i = 0; i < streams.size(); ++i) {
+			const Ref<VoxelStream> &stream = streams[i];
+			// Shared instances appear in consecutive slots, they must be counted once
+			if (stream.is_null() || (i > 0 && streams[i - 1] == stream)) {
+				continue;
+			}
+			const VoxelStream::Stats stats = stream->get_statistics();
+			total.file_openings += stats.file_openings;
+			total.time_spent_opening_files += stats.time_spent_opening_files;
+			total.cache_hits += stats.cache_hits;
+			total.cache_misses += stats.cache_misses;
+		}
+		Dictionary sd;
+		sd["volume_id"] = volume_id;
+		sd["file_openings"] = total.file_openings;
+		sd["time_spent_opening_files_usec"] = total.time_spent_opening_files;
+		sd["cache_hits"] = total.cache_hits;
+		sd["cache_misses"] = total.cache_misses;
+		volume_streams.append(sd);
+	});
+	d["volume_streams"] = volume_streams;
+
 	return d;
 }
 
 void VoxelServer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_stats"), &VoxelServer::_b_get_stats);
+
+	ClassDB::bind_method(D_METHOD("set_streaming_thread_count", "count"), &VoxelServer::set_streaming_thread_count);
+	ClassDB::bind_method(D_METHOD("get_streaming_thread_count"), &VoxelServer::get_streaming_thread_count);
+	ClassDB::bind_method(D_METHOD("set_meshing_thread_count", "count"), &VoxelServer::set_meshing_thread_count);
+	ClassDB::bind_method(D_METHOD("get_meshing_thread_count"), &VoxelServer::get_meshing_thread_count);
+	ClassDB::bind_method(D_METHOD("set_generation_thread_count", "count"), &VoxelServer::set_generation_thread_count);
+	ClassDB::bind_method(D_METHOD("get_generation_thread_count"), &VoxelServer::get_generation_thread_count);
+	ClassDB::bind_method(D_METHOD("get_max_thread_count"), &VoxelServer::get_max_thread_count);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -547,27 +1071,83 @@ void VoxelServer::_bind_methods() {
 void VoxelServer::BlockDataRequest::run(VoxelTaskContext ctx) {
 	VOXEL_PROFILE_SCOPE();
 
+	if (type == TYPE_COMPRESS) {
+		voxels->compress_channels();
+		has_run = true;
+		return;
+	}
+
 	CRASH_COND(stream_dependency == nullptr);
-	Ref<VoxelStream> stream = stream_dependency->streams[ctx.thread_index];
-	CRASH_COND(stream.is_null());
 
 	const Vector3i origin_in_voxels = (position << lod) * block_size;
 
+	if (type == TYPE_GENERATE) {
+		Ref<VoxelStream> generator = stream_dependency->generators[ctx.thread_index];
+		CRASH_COND(generator.is_null());
+		voxels.instance();
+		voxels->create(block_size, block_size, block_size);
+		OptionalMutexLock lock(stream_dependency->generators_mutex, stream_dependency->generators_single_thread);
+		generator->emerge_block(voxels, origin_in_voxels, lod);
+		has_run = true;
+		return;
+	}
+
+	Ref<VoxelStream> stream = stream_dependency->streams[ctx.thread_index];
+	CRASH_COND(stream.is_null());
+	OptionalMutexLock lock(stream_dependency->streams_mutex, stream_dependency->single_thread);
+
 	switch (type) {
-		case TYPE_LOAD:
-			voxels.instance();
-			voxels->create(block_size, block_size, block_size);
-			stream->emerge_block(voxels, origin_in_voxels, lod);
-			break;
+		case TYPE_LOAD: {
+			// Blocks which became too far while the batch was waiting are dropped
+			std::vector<unsigned int> loaded_indices;
+			Vector<VoxelBlockRequest> requests;
+			for (size_t i = 0; i < blocks_to_load.size(); ++i) {
+				BlockToLoad &b = blocks_to_load[i];
+				if (b.too_far) {
+					continue;
+				}
+				b.voxels.instance();
+				b.voxels->create(block_size, block_size, block_size);
+				VoxelBlockRequest br;
+				br.voxel_buffer = b.voxels;
+				br.origin_in_voxels = (b.position << b.lod) * block_size;
+				br.lod = b.lod;
+				requests.push_back(br);
+				loaded_indices.push_back(i);
+			}
+
+			if (stream_dependency->generators.size() > 0) {
+				// Only read files here, missing blocks get generated in another pool
+				VoxelStreamFile *file_stream = Object::cast_to<VoxelStreamFile>(*stream);
+				CRASH_COND(file_stream == nullptr);
+				std::vector<VoxelStreamFile::EmergeResult> results;
+				file_stream->emerge_blocks_without_fallback(requests, results);
+				CRASH_COND(results.size() != loaded_indices.size());
+				for (size_t i = 0; i < results.size(); ++i) {
+					BlockToLoad &b = blocks_to_load[loaded_indices[i]];
+					if (results[i] == VoxelStreamFile::EMERGE_OK_FALLBACK) {
+						b.requires_generation = true;
+						b.voxels.unref();
+					}
+				}
+			} else {
+				stream->emerge_blocks(requests);
+			}
+		} break;
 
 		case TYPE_SAVE: {
-			Ref<VoxelBuffer> voxels_copy;
-			{
-				RWLockRead lock(voxels->get_lock());
-				voxels_copy = voxels->duplicate(true);
+			Vector<VoxelBlockRequest> requests;
+			requests.resize(blocks_to_save.size());
+			for (size_t i = 0; i < blocks_to_save.size(); ++i) {
+				BlockToSave &b = blocks_to_save[i];
+				VoxelBlockRequest &br = requests.write[i];
+				// Voxels are snapshots, nothing else modifies them
+				br.voxel_buffer = b.voxels;
+				b.voxels.unref();
+				br.origin_in_voxels = (b.position << b.lod) * block_size;
+				br.lod = b.lod;
 			}
-			voxels.unref();
-			stream->immerge_block(voxels_copy, origin_in_voxels, lod);
+			stream->immerge_blocks(requests);
 		} break;
 
 		default:
@@ -578,8 +1158,31 @@ void VoxelServer::BlockDataRequest::run(VoxelTaskContext ctx) {
 }
 
 int VoxelServer::BlockDataRequest::get_priority() {
+	if (type == TYPE_COMPRESS) {
+		// Saves memory, but nothing waits for it
+		return 0x3fffffff;
+	}
 	if (type == TYPE_SAVE) {
-		return 0;
+		// Saves come before loads, in the order they were flushed.
+		// The order wraps around after about a billion flushes, which may only reorder a few saves once.
+		return -0x40000000 + static_cast<int>(save_order & 0x3fffffff);
+	}
+	if (type == TYPE_LOAD) {
+		// A batch is as urgent as its most urgent block, and is cancelled only if all its blocks are too far
+		int p = 0x7fffffff;
+		bool all_too_far = true;
+		for (size_t i = 0; i < blocks_to_load.size(); ++i) {
+			BlockToLoad &b = blocks_to_load[i];
+			float closest_viewer_distance_sq;
+			const int bp = VoxelServer::get_priority(b.priority_dependency, b.lod, &closest_viewer_distance_sq);
+			b.too_far = closest_viewer_distance_sq > b.priority_dependency.drop_distance_squared;
+			all_too_far &= b.too_far;
+			if (bp < p) {
+				p = bp;
+			}
+		}
+		too_far = all_too_far;
+		return p;
 	}
 	float closest_viewer_distance_sq;
 	const int p = VoxelServer::get_priority(priority_dependency, lod, &closest_viewer_distance_sq);
@@ -588,29 +1191,93 @@ int VoxelServer::BlockDataRequest::get_priority() {
 }
 
 bool VoxelServer::BlockDataRequest::is_cancelled() {
-	return type == TYPE_LOAD && (!stream_dependency->valid || too_far);
+	return type != TYPE_SAVE && type != TYPE_COMPRESS && (!stream_dependency->valid || too_far);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
+// Values given to areas where neighbors are missing, same as in a new buffer
+static inline uint64_t get_padding_default_value(unsigned int channel_index) {
+	return channel_index == VoxelBuffer::CHANNEL_SDF ? 255 : 0;
+}
+
+// Tells if the block and its neighbors all have the same value in the given channel, without looking at voxels.
+// Missing neighbors count as the default value.
+static bool get_moore_area_uniform_value(const FixedArray<Ref<VoxelBuffer>, Cube::MOORE_AREA_3D_COUNT> &moore_blocks,
+		unsigned int channel_index, uint64_t &out_value) {
+
+	const uint64_t default_value = get_padding_default_value(channel_index);
+	bool has_value = false;
+	uint64_t value = 0;
+
+	for (unsigned int i = 0; i < Cube::MOORE_AREA_3D_COUNT; ++i) {
+		const Ref<VoxelBuffer> &src = moore_blocks[i];
+		uint64_t v;
+		if (src.is_null()) {
+			v = default_value;
+		} else if (src->get_channel_compression(channel_index) == VoxelBuffer::COMPRESSION_UNIFORM) {
+			v = src->get_voxel(0, 0, 0, channel_index);
+		} else {
+			return false;
+		}
+		if (has_value && v != value) {
+			return false;
+		}
+		value = v;
+		has_value = true;
+	}
+
+	out_value = value;
+	return true;
+}
+
+// Gathers the block and its neighbors into a padded buffer, which may be reused from a previous call.
+// Only channels in the mask are copied, others are left as they were.
 static void copy_block_and_neighbors(const FixedArray<Ref<VoxelBuffer>, Cube::MOORE_AREA_3D_COUNT> &moore_blocks,
-		VoxelBuffer &dst, int min_padding, int max_padding) {
+		VoxelBuffer &dst, int min_padding, int max_padding, uint32_t channels_mask, VoxelBuffer::Layout layout) {
 
 	VOXEL_PROFILE_SCOPE();
 
 	FixedArray<unsigned int, 2> channels;
-	channels[0] = VoxelBuffer::CHANNEL_TYPE;
-	channels[1] = VoxelBuffer::CHANNEL_SDF;
+	unsigned int channel_count = 0;
+	if (channels_mask & (1 << VoxelBuffer::CHANNEL_TYPE)) {
+		channels[channel_count++] = VoxelBuffer::CHANNEL_TYPE;
+	}
+	if (channels_mask & (1 << VoxelBuffer::CHANNEL_SDF)) {
+		channels[channel_count++] = VoxelBuffer::CHANNEL_SDF;
+	}
 
 	Ref<VoxelBuffer> central_buffer = moore_blocks[Cube::MOORE_AREA_3D_CENTRAL_INDEX];
 	CRASH_COND_MSG(central_buffer.is_null(), "Central buffer must be valid");
 	const int block_size = central_buffer->get_size().x;
 	const unsigned int padded_block_size = block_size + min_padding + max_padding;
 
+	if (dst.get_layout() != layout) {
+		// Previous contents are not needed, don't convert them
+		dst.clear();
+		dst.set_layout(layout);
+	}
+
+	// Channels read by meshers are allocated together, so they are close in memory
+	dst.set_slab_channels(channels_mask);
+
+	// Does not reallocate if the size is the same as last time
 	dst.create(padded_block_size, padded_block_size, padded_block_size);
 
-	for (unsigned int ci = 0; ci < channels.size(); ++ci) {
+	for (unsigned int i = 0; i < channel_count; ++i) {
+		const unsigned int ci = channels[i];
 		dst.set_channel_depth(ci, central_buffer->get_channel_depth(ci));
+
+		uint64_t uniform_value;
+		if (get_moore_area_uniform_value(moore_blocks, ci, uniform_value)) {
+			// Keep the channel uniform, meshers can skip those. Copies below will have nothing to do.
+			dst.clear_channel(ci, uniform_value);
+		} else {
+			// Areas where neighbors are missing must have the same values as a new buffer,
+			// not those left by the previous use.
+			// Uniform neighbors are then copied with fills, other neighbors row by row.
+			dst.fill(get_padding_default_value(ci), ci);
+		}
 	}
 
 	const Vector3i min_pos = -Vector3i(min_padding);
@@ -628,11 +1295,9 @@ static void copy_block_and_neighbors(const FixedArray<Ref<VoxelBuffer>, Cube::MO
 		const Vector3i src_max = max_pos - offset;
 		const Vector3i dst_min = offset - min_pos;
 
-		{
-			RWLockRead read(src->get_lock());
-			for (unsigned int ci = 0; ci < channels.size(); ++ci) {
-				dst.copy_from(**src, src_min, src_max, dst_min, ci);
-			}
+		// Blocks are snapshots, so they don't need locking
+		for (unsigned int ci = 0; ci < channel_count; ++ci) {
+			dst.copy_from(**src, src_min, src_max, dst_min, channels[ci]);
 		}
 	}
 }
@@ -645,10 +1310,37 @@ void VoxelServer::BlockMeshRequest::run(VoxelTaskContext ctx) {
 	unsigned int max_padding;
 	VoxelServer::get_singleton()->get_min_max_block_padding(blocky_enabled, smooth_enabled, min_padding, max_padding);
 
-	// TODO Cache?
-	Ref<VoxelBuffer> voxels;
-	voxels.instance();
-	copy_block_and_neighbors(blocks, **voxels, min_padding, max_padding);
+	// Blocky meshers only read types, smooth meshers only read SDF
+	uint32_t channels_mask = 0;
+	if (blocky_enabled) {
+		channels_mask |= (1 << VoxelBuffer::CHANNEL_TYPE);
+	}
+	if (smooth_enabled) {
+		channels_mask |= (1 << VoxelBuffer::CHANNEL_SDF);
+	}
+
+	// Uniform channels produce no geometry. If all channels the meshers read are uniform across the block and its
+	// neighbors, there is no need to gather them.
+	bool all_uniform = true;
+	for (unsigned int ci = 0; ci < VoxelBuffer::MAX_CHANNELS && all_uniform; ++ci) {
+		uint64_t uniform_value;
+		if ((channels_mask & (1 << ci)) != 0 && !get_moore_area_uniform_value(blocks, ci, uniform_value)) {
+			all_uniform = false;
+		}
+	}
+	if (all_uniform) {
+		// Outputs are left empty
+		has_run = true;
+		return;
+	}
+
+	// Reused by every task running on this thread
+	Ref<VoxelBuffer> voxels = VoxelServer::get_singleton()->_meshing_buffers[ctx.thread_index];
+	CRASH_COND(voxels.is_null());
+	// Smooth meshers sample cells and gradients, which mostly stay within tiles.
+	// Blocky meshers read columns of raw voxels, so they need the linear layout.
+	const VoxelBuffer::Layout layout = blocky_enabled ? VoxelBuffer::LAYOUT_LINEAR : VoxelBuffer::LAYOUT_TILED;
+	copy_block_and_neighbors(blocks, **voxels, min_padding, max_padding, channels_mask, layout);
 
 	VoxelMesher::Input input = { **voxels, lod };
 
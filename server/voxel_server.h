@@ -5,6 +5,7 @@
 #include "../streams/voxel_stream.h"
 #include "struct_db.h"
 #include "voxel_thread_pool.h"
+#include <core/hash_map.h>
 #include <scene/main/node.h>
 
 #include <memory>
@@ -89,7 +90,13 @@ public:
 	void request_block_mesh(uint32_t volume_id, BlockMeshInput &input);
 	void request_block_load(uint32_t volume_id, Vector3i block_pos, int lod);
 	void request_block_save(uint32_t volume_id, Ref<VoxelBuffer> voxels, Vector3i block_pos, int lod);
+	// Compresses voxels in the background. They can keep being used meanwhile,
+	// channels modified before the result comes back are left as they are.
+	void request_block_compression(uint32_t volume_id, Ref<VoxelBuffer> voxels);
 	void remove_volume(uint32_t volume_id);
+	// Volumes don't use the given stream directly but copies of it, which can't be accessed from outside.
+	// This tells if any volume streams from copies of the given instance.
+	bool is_stream_used_by_volumes(const VoxelStream *stream) const;
 
 	// TODO Rename functions to C convention
 	uint32_t add_viewer();
@@ -116,6 +123,15 @@ public:
 	void process();
 	void wait_and_clear_all_tasks(bool warn);
 
+	// Thread counts can be changed at runtime, up to the maximum determined on startup
+	void set_streaming_thread_count(uint32_t count);
+	uint32_t get_streaming_thread_count() const;
+	void set_meshing_thread_count(uint32_t count);
+	uint32_t get_meshing_thread_count() const;
+	void set_generation_thread_count(uint32_t count);
+	uint32_t get_generation_thread_count() const;
+	uint32_t get_max_thread_count() const { return _max_thread_count; }
+
 	static inline int get_octree_lod_block_region_extent(float split_scale) {
 		// This is a bounding radius of blocks around a viewer within which we may load them.
 		// It depends on the LOD split scale, which tells how close to a block we need to be for it to subdivide.
@@ -142,8 +158,25 @@ private:
 
 	// Data common to all requests about a particular volume
 	struct StreamingDependency {
-		FixedArray<Ref<VoxelStream>, VoxelThreadPool::MAX_THREADS> streams;
+		StreamingDependency();
+		~StreamingDependency();
+
+		// One per thread, up to the maximum thread count.
+		// Thread-safe streams are shared, so they may be the same instance in every slot.
+		std::vector<Ref<VoxelStream>> streams;
+		// If the stream can only be used by one thread at a time, requests are all routed to the same thread
+		bool single_thread = false;
+		// When the stream loads from files and has a fallback stream, blocks missing from files are generated
+		// in a separate pool, using these instances of the fallback. Otherwise, this is empty.
+		std::vector<Ref<VoxelStream>> generators;
+		bool generators_single_thread = false;
+		// If true, generated blocks are sent back to the stream to be saved
+		bool save_generator_output = false;
 		bool valid = true;
+		// Held while using single-thread streams and generators. Their requests go to the same thread,
+		// but after the thread count changes, requests queued before and after can run on different threads.
+		Mutex *streams_mutex = nullptr;
+		Mutex *generators_mutex = nullptr;
 	};
 
 	// Data common to all requests about a particular volume
@@ -152,6 +185,54 @@ private:
 		bool valid = true;
 	};
 
+	struct BlockToSave {
+		Ref<VoxelBuffer> voxels;
+		Vector3i position;
+		uint8_t lod;
+	};
+
+	struct PriorityDependencyShared {
+		// These positions are written by the main thread and read by block processing threads.
+		// Order doesn't matter.
+		// It's only used to adjust task priority so using a lock isn't worth it. In worst case scenario,
+		// a task will run much sooner or later than expected, but it will run in any case.
+		std::vector<Vector3> viewers;
+		float highest_view_distance = 999999;
+	};
+
+	struct PriorityDependency {
+		std::shared_ptr<PriorityDependencyShared> shared;
+		Vector3 world_position; // TODO Won't update while in queue. Can it be bad?
+		// If the closest viewer is further away than this distance, the request can be cancelled as not worth it
+		float drop_distance_squared;
+	};
+
+	struct BlockToLoad {
+		// Null until loaded. Stays null if the block was dropped.
+		Ref<VoxelBuffer> voxels;
+		Vector3i position;
+		uint8_t lod;
+		PriorityDependency priority_dependency;
+		bool too_far = false;
+		// Set when the block was not found by the load, so it must be generated
+		bool requires_generation = false;
+	};
+
+	struct BlockLocation {
+		Vector3i position;
+		uint8_t lod;
+
+		inline bool operator==(const BlockLocation &other) const {
+			return position == other.position && lod == other.lod;
+		}
+	};
+
+	struct BlockLocationHasher {
+		static inline uint32_t hash(const BlockLocation &location) {
+			return hash_djb2_one_32(location.lod, Vector3iHasher::hash(location.position));
+		}
+	};
+
 	struct Volume {
 		VolumeType type;
 		ReceptionBuffers *reception_buffers = nullptr;
@@ -162,15 +243,12 @@ private:
 		float octree_split_scale = 0;
 		std::shared_ptr<StreamingDependency> stream_dependency;
 		std::shared_ptr<MeshingDependency> meshing_dependency;
-	};
-
-	struct PriorityDependencyShared {
-		// These positions are written by the main thread and read by block processing threads.
-		// Order doesn't matter.
-		// It's only used to adjust task priority so using a lock isn't worth it. In worst case scenario,
-		// a task will run much sooner or later than expected, but it will run in any case.
-		std::vector<Vector3> viewers;
-		float highest_view_distance = 999999;
+		// Saves are gathered until the next flush, so repeated saves of the same block are written only once,
+		// with the latest data. Order is the one of the first request.
+		std::vector<BlockToSave> pending_saves;
+		HashMap<BlockLocation, unsigned int, BlockLocationHasher> pending_saves_index;
+		// Loads are gathered until the next flush too, so those of the same region can be sent in one batch
+		std::vector<BlockToLoad> pending_loads;
 	};
 
 	struct World {
@@ -181,26 +259,28 @@ private:
 		std::shared_ptr<PriorityDependencyShared> shared_priority_dependency;
 	};
 
-	struct PriorityDependency {
-		std::shared_ptr<PriorityDependencyShared> shared;
-		Vector3 world_position; // TODO Won't update while in queue. Can it be bad?
-		// If the closest viewer is further away than this distance, the request can be cancelled as not worth it
-		float drop_distance_squared;
-	};
-
 	void init_priority_dependency(PriorityDependency &dep, Vector3i block_position, uint8_t lod, const Volume &volume);
+	static int get_block_data_affinity(const Volume &volume, uint32_t volume_id, Vector3i block_pos, int lod);
+	static int get_block_generate_affinity(const StreamingDependency &dep, uint32_t volume_id);
+	void flush_pending_saves(Volume &volume, uint32_t volume_id);
+	void flush_pending_loads(Volume &volume, uint32_t volume_id);
 	static int get_priority(const PriorityDependency &dep, uint8_t lod, float *out_closest_distance_sq);
 
 	class BlockDataRequest : public IVoxelTask {
 	public:
 		enum Type {
 			TYPE_LOAD = 0,
-			TYPE_SAVE
+			TYPE_SAVE,
+			// Loads from generators, when the stream has a separate generation stage
+			TYPE_GENERATE,
+			// Compresses voxels of a loaded block, doesn't use the stream
+			TYPE_COMPRESS
 		};
 
 		void run(VoxelTaskContext ctx) override;
 		int get_priority() override;
 		bool is_cancelled() override;
+		int get_thread_affinity() const override { return thread_affinity; }
 
 		Ref<VoxelBuffer> voxels;
 		Vector3i position;
@@ -210,9 +290,19 @@ private:
 		uint8_t type;
 		bool has_run = false;
 		bool too_far = false;
+		int thread_affinity = -1;
+		// Saves don't need sorting, they run in the order they were flushed
+		uint32_t save_order = 0;
 		PriorityDependency priority_dependency;
 		std::shared_ptr<StreamingDependency> stream_dependency;
-		// TODO Find a way to separate save, it doesnt need sorting
+		// Only used by saves, which are sent in batches
+		std::vector<BlockToSave> blocks_to_save;
+		// Only used by loads, which are sent in batches. A batch is too far only if all its blocks are.
+		std::vector<BlockToLoad> blocks_to_load;
+		// Only used by compression. `voxels` is what gets compressed, and the result is given to the target
+		// as long as its data is still the same as the source. They are only accessed from the main thread.
+		Ref<VoxelBuffer> compression_source;
+		Ref<VoxelBuffer> compression_target;
 	};
 
 	class BlockMeshRequest : public IVoxelTask {
@@ -235,19 +325,54 @@ private:
 		VoxelMesher::Output smooth_surfaces_output;
 	};
 
+	void receive_block_data_request(BlockDataRequest *r);
+
 	// TODO multi-world support in the future
 	World _world;
 
 	VoxelThreadPool _streaming_thread_pool;
 	VoxelThreadPool _meshing_thread_pool;
+	// Generation is CPU-bound, so it runs separately from file access
+	VoxelThreadPool _generation_thread_pool;
+
+	uint32_t _next_save_order = 0;
+
+	// Counters reported by `get_stats`, in addition to those of thread pools. Only accessed from the main thread.
+	struct TaskStats {
+		// Tasks cancelled because no viewer was close enough anymore
+		uint64_t dropped_too_far = 0;
+		uint64_t last_run_count = 0;
+		float tasks_per_second = 0.f;
+
+		void update_throughput(uint64_t run_count, uint64_t elapsed_usec) {
+			tasks_per_second = static_cast<float>(run_count - last_run_count) * 1000000.f / elapsed_usec;
+			last_run_count = run_count;
+		}
+	};
+
+	TaskStats _streaming_stats;
+	TaskStats _generation_stats;
+	TaskStats _meshing_stats;
+	// Throughput is measured over periods of about one second
+	uint64_t _last_throughput_time_usec = 0;
+
+	static void update_throughput(const VoxelThreadPool &pool, TaskStats &stats, uint64_t elapsed_usec);
+	static Dictionary debug_get_pool_stats(const VoxelThreadPool &pool, const TaskStats &task_stats);
+
+	// Per-thread arrays are sized once to this count, so they never get reallocated while threads use them.
+	// Pools can't have more threads than this.
+	uint32_t _max_thread_count = 1;
 
 	// TODO I do this because meshers have memory caches. But perhaps we could put them in thread locals?
 	// Used by tasks from threads.
 	// Meshers have internal state because they use memory caches,
 	// so we instanciate one per thread to be sure it's safe without having to lock.
 	// Options such as library etc can change per task.
-	FixedArray<Ref<VoxelMesherBlocky>, VoxelThreadPool::MAX_THREADS> _blocky_meshers;
-	FixedArray<Ref<VoxelMesher>, VoxelThreadPool::MAX_THREADS> _smooth_meshers;
+	// Instances are only created for threads that exist.
+	std::vector<Ref<VoxelMesherBlocky>> _blocky_meshers;
+	std::vector<Ref<VoxelMesher>> _smooth_meshers;
+	// Padded copies of blocks and their neighbors given to meshers, reused between tasks to avoid reallocating them
+	std::vector<Ref<VoxelBuffer>> _meshing_buffers;
 };
 
 // TODO Hack to make VoxelServer update... need ways to integrate callbacks from main loop!
@@ -2,6 +2,7 @@
 #include "../util/profiling.h"
 
 #include <core/os/os.h>
+#include <core/os/rw_lock.h>
 #include <core/os/semaphore.h>
 #include <core/os/thread.h>
 
@@ -15,64 +16,189 @@
 // 	return false;
 // }
 
+namespace {
+
+// How many queued tasks a thread may re-prioritize each time it picks tasks.
+// This bounds the time spent holding the tasks mutex, regardless of how many tasks are queued.
+const size_t MAX_SWEPT_TASKS_PER_PICK = 128;
+
+// Binary min-heap functions, ordering items by cached priority (lower value comes first).
+// Unlike `std::push_heap` and `std::pop_heap`, they allow to update or remove any item in place,
+// which is needed to re-prioritize or cancel tasks without rebuilding the whole heap.
+
+template <typename T>
+void heap_sift_up(std::vector<T> &heap, size_t i) {
+	const T item = heap[i];
+	while (i > 0) {
+		const size_t parent = (i - 1) / 2;
+		if (heap[parent].cached_priority <= item.cached_priority) {
+			break;
+		}
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = item;
+}
+
+template <typename T>
+void heap_sift_down(std::vector<T> &heap, size_t i) {
+	const size_t count = heap.size();
+	const T item = heap[i];
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= count) {
+			break;
+		}
+		if (child + 1 < count && heap[child + 1].cached_priority < heap[child].cached_priority) {
+			++child;
+		}
+		if (item.cached_priority <= heap[child].cached_priority) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = item;
+}
+
+// Restores heap order after the priority of the item at the given index changed
+template <typename T>
+void heap_update(std::vector<T> &heap, size_t i) {
+	if (i > 0 && heap[i].cached_priority < heap[(i - 1) / 2].cached_priority) {
+		heap_sift_up(heap, i);
+	} else {
+		heap_sift_down(heap, i);
+	}
+}
+
+template <typename T>
+void heap_push(std::vector<T> &heap, const T &item) {
+	heap.push_back(item);
+	heap_sift_up(heap, heap.size() - 1);
+}
+
+template <typename T>
+void heap_remove(std::vector<T> &heap, size_t i) {
+	CRASH_COND(i >= heap.size());
+	const size_t last = heap.size() - 1;
+	if (i != last) {
+		heap[i] = heap[last];
+		heap.pop_back();
+		heap_update(heap, i);
+	} else {
+		heap.pop_back();
+	}
+}
+
+template <typename T>
+T heap_pop(std::vector<T> &heap) {
+	CRASH_COND(heap.size() == 0);
+	const T top = heap[0];
+	heap_remove(heap, 0);
+	return top;
+}
+
+} // namespace
+
 VoxelThreadPool::VoxelThreadPool() {
-	_tasks_mutex = Mutex::create();
-	_tasks_semaphore = Semaphore::create();
-	_completed_tasks_mutex = Mutex::create();
+	_tasks.mutex = Mutex::create();
+	_threads_lock = RWLock::create();
 }
 
 VoxelThreadPool::~VoxelThreadPool() {
-	destroy_all_threads();
+	destroy_threads(_threads.size());
 
 	if (_completed_tasks.size() != 0) {
 		// We don't have ownership over tasks, so it's an error to destroy the pool without handling them
 		ERR_PRINT("There are unhandled completed tasks remaining!");
 	}
+	if (_tasks.items.size() != 0) {
+		ERR_PRINT("There are unhandled queued tasks remaining!");
+	}
 
-	memdelete(_tasks_mutex);
-	memdelete(_tasks_semaphore);
-	memdelete(_completed_tasks_mutex);
+	memdelete(_tasks.mutex);
+	memdelete(_threads_lock);
 }
 
-void VoxelThreadPool::create_thread(ThreadData &d, uint32_t i) {
-	d.pool = this;
-	d.stop = false;
-	d.waiting = false;
-	d.index = i;
-	d.thread = Thread::create(thread_func_static, &d);
+void VoxelThreadPool::create_threads(uint32_t count) {
+	for (uint32_t i = 0; i < count; ++i) {
+		ThreadData *d = memnew(ThreadData);
+		d->pool = this;
+		d->index = _threads.size();
+		d->local_tasks.mutex = Mutex::create();
+		d->pinned_tasks.mutex = Mutex::create();
+		d->completed_tasks_mutex = Mutex::create();
+		d->semaphore = Semaphore::create();
+		d->wake_pending.store(false);
+		d->cancelled_tasks.store(0, std::memory_order_relaxed);
+		{
+			// The thread must be in the list before it starts, so others can steal from it
+			RWLockWrite lock(_threads_lock);
+			_threads.push_back(d);
+		}
+		d->thread = Thread::create(thread_func_static, d);
+	}
 }
 
-void VoxelThreadPool::destroy_all_threads() {
-	// We have only one semaphore to signal threads to resume, and one `post()` lets only one pass.
-	// We cannot tell one single thread to stop, because when we post and other threads are waiting, we can't guarantee
-	// the one to pass will be the one we want.
-	// So we can only choose to stop ALL threads, and then start them again if we want to adjust their count.
-	// Also, it shouldn't drop tasks. Any tasks the thread was working on should still complete normally.
-	for (size_t i = 0; i < _thread_count; ++i) {
-		ThreadData &d = _threads[i];
+// Stops and removes the given amount of threads, starting from the last one
+void VoxelThreadPool::destroy_threads(uint32_t count) {
+	CRASH_COND(count > _threads.size());
+	const size_t first = _threads.size() - count;
+
+	// Threads finish the tasks they were working on, and exit the next time they look for tasks
+	for (size_t i = first; i < _threads.size(); ++i) {
+		ThreadData &d = *_threads[i];
 		d.stop = true;
+		wake_thread(d);
 	}
-	for (size_t i = 0; i < _thread_count; ++i) {
-		_tasks_semaphore->post();
+
+	std::vector<ThreadData *> removed_threads;
+	{
+		RWLockWrite lock(_threads_lock);
+		removed_threads.assign(_threads.begin() + first, _threads.end());
+		_threads.resize(first);
 	}
-	for (size_t i = 0; i < _thread_count; ++i) {
-		ThreadData &d = _threads[i];
-		Thread::wait_to_finish(d.thread);
-		memdelete(d.thread);
-		d = ThreadData();
+
+	size_t given_back_task_count = 0;
+
+	for (size_t i = 0; i < removed_threads.size(); ++i) {
+		ThreadData *d = removed_threads[i];
+		Thread::wait_to_finish(d->thread);
+		memdelete(d->thread);
+
+		// Tasks queued on that thread are given to remaining ones
+		for (size_t j = 0; j < d->local_tasks.items.size(); ++j) {
+			push_task(d->local_tasks.items[j]);
+		}
+		// Pinned tasks wake up their new thread when pushed
+		for (size_t j = 0; j < d->pinned_tasks.items.size(); ++j) {
+			push_task(d->pinned_tasks.items[j]);
+		}
+		given_back_task_count += d->local_tasks.items.size();
+
+		_completed_tasks.insert(_completed_tasks.end(), d->completed_tasks.begin(), d->completed_tasks.end());
+		_debug_completed_tasks += d->debug_completed_tasks;
+		d->wait_time.get_counts(_removed_threads_stats.wait_time);
+		d->run_time.get_counts(_removed_threads_stats.run_time);
+		_removed_threads_stats.cancelled_tasks += d->cancelled_tasks.load(std::memory_order_relaxed);
+
+		memdelete(d->local_tasks.mutex);
+		memdelete(d->pinned_tasks.mutex);
+		memdelete(d->completed_tasks_mutex);
+		memdelete(d->semaphore);
+		memdelete(d);
 	}
+
+	// Remaining threads may be waiting, they must know about the tasks they were given
+	post_for_tasks(given_back_task_count);
 }
 
 void VoxelThreadPool::set_thread_count(uint32_t count) {
-	if (count > MAX_THREADS) {
-		count = MAX_THREADS;
+	if (count > _threads.size()) {
+		create_threads(count - _threads.size());
+	} else if (count < _threads.size()) {
+		destroy_threads(_threads.size() - count);
 	}
-	destroy_all_threads();
-	for (uint32_t i = _thread_count; i < count; ++i) {
-		ThreadData &d = _threads[i];
-		create_thread(d, i);
-	}
-	_thread_count = count;
 }
 
 void VoxelThreadPool::set_batch_count(uint32_t count) {
@@ -83,33 +209,112 @@ void VoxelThreadPool::set_priority_update_period(uint32_t milliseconds) {
 	_priority_update_period = milliseconds;
 }
 
+void VoxelThreadPool::set_work_stealing_enabled(bool enabled) {
+	_work_stealing_enabled = enabled;
+}
+
+// Must be called from the main thread.
+void VoxelThreadPool::push_task(const TaskItem &item) {
+	if (item.affinity >= 0 && _threads.size() > 0) {
+		ThreadData &d = *_threads[item.affinity % _threads.size()];
+		{
+			MutexLock lock(d.pinned_tasks.mutex);
+			heap_push(d.pinned_tasks.items, item);
+		}
+		// Only that thread can run the task
+		wake_thread(d);
+
+	} else if (_work_stealing_enabled && _threads.size() > 0) {
+		ThreadData &d = *_threads[_next_thread_index % _threads.size()];
+		++_next_thread_index;
+		MutexLock lock(d.local_tasks.mutex);
+		heap_push(d.local_tasks.items, item);
+	} else {
+		MutexLock lock(_tasks.mutex);
+		heap_push(_tasks.items, item);
+	}
+}
+
 void VoxelThreadPool::enqueue(IVoxelTask *task) {
 	CRASH_COND(task == nullptr);
-	{
-		MutexLock lock(_tasks_mutex);
-		TaskItem t;
-		t.task = task;
-		_tasks.push_back(t);
-		++_debug_received_tasks;
+	// Priority is evaluated before locking so the task can be inserted at the right place in the heap
+	TaskItem t;
+	t.task = task;
+	t.cached_priority = task->get_priority();
+	t.last_priority_update_time = OS::get_singleton()->get_ticks_msec();
+	t.affinity = task->get_thread_affinity();
+	t.enqueue_time_usec = OS::get_singleton()->get_ticks_usec();
+	push_task(t);
+	++_debug_received_tasks;
+	if (t.affinity < 0) {
+		post_for_tasks(1);
 	}
-	// TODO Do I need to post a certain amount of times?
-	_tasks_semaphore->post();
 }
 
 void VoxelThreadPool::enqueue(ArraySlice<IVoxelTask *> tasks) {
-	{
-		MutexLock lock(_tasks_mutex);
-		for (size_t i = 0; i < tasks.size(); ++i) {
-			TaskItem t;
-			t.task = tasks[i];
-			CRASH_COND(t.task == nullptr);
-			_tasks.push_back(t);
-			++_debug_received_tasks;
+	// Priorities are evaluated outside of the lock, these calls can add up if there are many tasks
+	std::vector<TaskItem> items;
+	items.resize(tasks.size());
+	size_t pinned_task_count = 0;
+	const uint32_t now = OS::get_singleton()->get_ticks_msec();
+	const uint64_t now_usec = OS::get_singleton()->get_ticks_usec();
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		TaskItem &t = items[i];
+		t.task = tasks[i];
+		CRASH_COND(t.task == nullptr);
+		t.cached_priority = t.task->get_priority();
+		t.last_priority_update_time = now;
+		t.affinity = t.task->get_thread_affinity();
+		t.enqueue_time_usec = now_usec;
+		if (t.affinity >= 0) {
+			++pinned_task_count;
 		}
 	}
-	// TODO Do I need to post a certain amount of times?
-	for (size_t i = 0; i < tasks.size(); ++i) {
-		_tasks_semaphore->post();
+	if ((_work_stealing_enabled || pinned_task_count > 0) && _threads.size() > 0) {
+		// Spread tasks over threads. Each queue is only locked briefly, so threads can start working right away
+		for (size_t i = 0; i < items.size(); ++i) {
+			push_task(items[i]);
+		}
+	} else {
+		MutexLock lock(_tasks.mutex);
+		for (size_t i = 0; i < items.size(); ++i) {
+			heap_push(_tasks.items, items[i]);
+		}
+	}
+	_debug_received_tasks += items.size();
+	// Pinned tasks already woke up their thread
+	post_for_tasks(items.size() - pinned_task_count);
+}
+
+// Wakes up threads for tasks that any of them can run
+void VoxelThreadPool::post_for_tasks(size_t task_count) {
+	// A thread picks tasks until it runs out, so there is no need to wake up more threads than tasks
+	size_t remaining_count = MIN(task_count, _threads.size());
+
+	// Waiting threads come first
+	for (size_t i = 0; i < _threads.size() && remaining_count > 0; ++i) {
+		ThreadData &d = *_threads[i];
+		if (d.waiting) {
+			wake_thread(d);
+			--remaining_count;
+		}
+	}
+
+	// Other threads are busy and will look for tasks when they are done, but one of them could be just about to wait.
+	// Posting them makes sure the tasks don't stay in the queue. At worst, they look for tasks once more for nothing.
+	for (size_t i = 0; i < _threads.size() && remaining_count > 0; ++i) {
+		ThreadData &d = *_threads[i];
+		if (!d.waiting) {
+			wake_thread(d);
+			--remaining_count;
+		}
+	}
+}
+
+void VoxelThreadPool::wake_thread(ThreadData &d) {
+	// The thread clears the flag before looking for tasks, so tasks queued before this call will be seen
+	if (!d.wake_pending.exchange(true)) {
+		d.semaphore->post();
 	}
 }
 
@@ -130,57 +335,28 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 			VOXEL_PROFILE_SCOPE();
 
 			data.debug_state = STATE_PICKING;
-			const uint32_t now = OS::get_singleton()->get_ticks_msec();
-
-			MutexLock lock(_tasks_mutex);
-
-			// Pick best tasks
-			for (uint32_t bi = 0; bi < _batch_count && _tasks.size() != 0; ++bi) {
-				size_t best_index = 0; // Take first by default, this is a valid index
-				int best_priority = 999999;
-
-				// TODO This takes a lot of time when there are many queued tasks. Use a better container?
-				for (size_t i = 0; i < _tasks.size(); ++i) {
-					TaskItem &item = _tasks[i];
-					CRASH_COND(item.task == nullptr);
-
-					if (now - item.last_priority_update_time > _priority_update_period) {
-						// Calling `get_priority()` first since it can update cancellation
-						// (not clear API tho, might review that in the future)
-						item.cached_priority = item.task->get_priority();
-
-						if (item.task->is_cancelled()) {
-							cancelled_tasks.push_back(item.task);
-							_tasks[i] = _tasks.back();
-							_tasks.pop_back();
-							--i;
-							continue;
-						}
-
-						item.last_priority_update_time = now;
-					}
 
-					if (item.cached_priority < best_priority) {
-						best_priority = item.cached_priority;
-						best_index = i;
-					}
-				}
+			// Other threads can't take pinned tasks, so they come first
+			pick_tasks_from_queue(data.pinned_tasks, tasks, cancelled_tasks);
 
-				// If not all tasks were cancelled
-				if (_tasks.size() != 0) {
-					tasks.push_back(_tasks[best_index]);
-					CRASH_COND(best_index >= _tasks.size());
-					_tasks[best_index] = _tasks.back();
-					_tasks.pop_back();
+			if (tasks.size() < _batch_count) {
+				if (_work_stealing_enabled) {
+					pick_tasks_from_queue(data.local_tasks, tasks, cancelled_tasks);
+					if (tasks.empty()) {
+						steal_tasks(data, tasks, cancelled_tasks);
+					}
+				} else {
+					pick_tasks_from_queue(_tasks, tasks, cancelled_tasks);
 				}
 			}
 		}
 
 		if (cancelled_tasks.size() > 0) {
-			MutexLock lock(_completed_tasks_mutex);
+			data.cancelled_tasks.fetch_add(cancelled_tasks.size(), std::memory_order_relaxed);
+			MutexLock lock(data.completed_tasks_mutex);
 			for (size_t i = 0; i < cancelled_tasks.size(); ++i) {
-				_completed_tasks.push_back(cancelled_tasks[i]);
-				++_debug_completed_tasks;
+				data.completed_tasks.push_back(cancelled_tasks[i]);
+				++data.debug_completed_tasks;
 			}
 		}
 		cancelled_tasks.clear();
@@ -192,26 +368,38 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 
 			// Wait for more tasks
 			data.waiting = true;
-			_tasks_semaphore->wait();
+			data.semaphore->wait();
 			data.waiting = false;
+			data.wake_pending.store(false);
 
 		} else {
 			data.debug_state = STATE_RUNNING;
 
+			uint64_t time_usec = OS::get_singleton()->get_ticks_usec();
+			for (size_t i = 0; i < tasks.size(); ++i) {
+				const TaskItem &item = tasks[i];
+				data.wait_time.record(time_usec - item.enqueue_time_usec);
+			}
+
 			for (size_t i = 0; i < tasks.size(); ++i) {
 				TaskItem &item = tasks[i];
-				if (!item.task->is_cancelled()) {
+				if (item.task->is_cancelled()) {
+					data.cancelled_tasks.fetch_add(1, std::memory_order_relaxed);
+				} else {
 					VoxelTaskContext ctx;
 					ctx.thread_index = data.index;
 					item.task->run(ctx);
+					const uint64_t end_time_usec = OS::get_singleton()->get_ticks_usec();
+					data.run_time.record(end_time_usec - time_usec);
+					time_usec = end_time_usec;
 				}
 			}
 			{
-				MutexLock lock(_completed_tasks_mutex);
+				MutexLock lock(data.completed_tasks_mutex);
 				for (size_t i = 0; i < tasks.size(); ++i) {
 					TaskItem &item = tasks[i];
-					_completed_tasks.push_back(item.task);
-					++_debug_completed_tasks;
+					data.completed_tasks.push_back(item.task);
+					++data.debug_completed_tasks;
 				}
 			}
 
@@ -222,6 +410,123 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 	data.debug_state = STATE_STOPPED;
 }
 
+void VoxelThreadPool::pick_tasks_from_queue(TaskQueue &queue, std::vector<TaskItem> &out_tasks,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+
+	MutexLock lock(queue.mutex);
+	const uint32_t now = OS::get_singleton()->get_ticks_msec();
+	sweep_tasks(queue, now, cancelled_tasks);
+	pick_tasks(queue, now, out_tasks, cancelled_tasks);
+}
+
+void VoxelThreadPool::steal_tasks(const ThreadData &thief, std::vector<TaskItem> &out_tasks,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+
+	// Visit other threads starting from the next one, so idle threads don't all rush on the same victim.
+	// Taking from the front of their queue means stealing their most important tasks,
+	// which is what the victim would have done next anyways.
+	{
+		RWLockRead lock(_threads_lock);
+		const size_t thread_count = _threads.size();
+		for (size_t i = 1; i < thread_count && out_tasks.empty(); ++i) {
+			ThreadData &victim = *_threads[(thief.index + i) % thread_count];
+			pick_tasks_from_queue(victim.local_tasks, out_tasks, cancelled_tasks);
+		}
+	}
+	if (out_tasks.empty()) {
+		// Tasks enqueued while no thread was running, or left by threads that got stopped
+		pick_tasks_from_queue(_tasks, out_tasks, cancelled_tasks);
+	}
+}
+
+// Must be called with the queue mutex locked.
+void VoxelThreadPool::sweep_tasks(TaskQueue &queue, uint32_t now, std::vector<IVoxelTask *> &cancelled_tasks) {
+	// Re-prioritizes a slice of the queue, so tasks can rise if they became more important,
+	// and cancelled ones get removed without having to wait until they reach the top.
+	// Items can move while the cursor goes, so this is approximate. It doesn't matter much,
+	// because priority is always checked again when a task is about to be picked.
+	std::vector<TaskItem> &tasks = queue.items;
+
+	for (size_t i = 0; i < MAX_SWEPT_TASKS_PER_PICK && tasks.size() != 0; ++i) {
+		if (queue.sweep_cursor >= tasks.size()) {
+			queue.sweep_cursor = 0;
+		}
+
+		TaskItem &item = tasks[queue.sweep_cursor];
+		CRASH_COND(item.task == nullptr);
+
+		if (now - item.last_priority_update_time > _priority_update_period) {
+			// Calling `get_priority()` first since it can update cancellation
+			// (not clear API tho, might review that in the future)
+			item.cached_priority = item.task->get_priority();
+			item.last_priority_update_time = now;
+
+			if (item.task->is_cancelled()) {
+				cancelled_tasks.push_back(item.task);
+				heap_remove(tasks, queue.sweep_cursor);
+				// Another item took that slot, check it next
+				continue;
+			}
+
+			heap_update(tasks, queue.sweep_cursor);
+		}
+
+		++queue.sweep_cursor;
+	}
+}
+
+// Must be called with the queue mutex locked.
+void VoxelThreadPool::pick_tasks(TaskQueue &queue, uint32_t now, std::vector<TaskItem> &out_tasks,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+
+	std::vector<TaskItem> &tasks = queue.items;
+
+	while (out_tasks.size() < _batch_count && tasks.size() != 0) {
+		TaskItem item = heap_pop(tasks);
+		CRASH_COND(item.task == nullptr);
+
+		if (now - item.last_priority_update_time > _priority_update_period) {
+			// The cached priority is too old to be trusted, refresh it
+			item.cached_priority = item.task->get_priority();
+			item.last_priority_update_time = now;
+
+			if (item.task->is_cancelled()) {
+				cancelled_tasks.push_back(item.task);
+				continue;
+			}
+
+			if (tasks.size() != 0 && item.cached_priority > tasks[0].cached_priority) {
+				// It is no longer the best task, put it back in the queue.
+				// This terminates because refreshed items won't be refreshed again during this call.
+				heap_push(tasks, item);
+				continue;
+			}
+		}
+
+		out_tasks.push_back(item);
+	}
+}
+
+size_t VoxelThreadPool::get_queued_task_count() const {
+	size_t count = 0;
+	{
+		MutexLock lock(_tasks.mutex);
+		count += _tasks.items.size();
+	}
+	for (size_t i = 0; i < _threads.size(); ++i) {
+		const ThreadData &d = *_threads[i];
+		{
+			MutexLock lock(d.local_tasks.mutex);
+			count += d.local_tasks.items.size();
+		}
+		{
+			MutexLock lock(d.pinned_tasks.mutex);
+			count += d.pinned_tasks.items.size();
+		}
+	}
+	return count;
+}
+
 void VoxelThreadPool::wait_for_all_tasks() {
 	const uint32_t suspicious_delay_msec = 10000;
 
@@ -230,11 +535,8 @@ void VoxelThreadPool::wait_for_all_tasks() {
 
 	// Wait until all tasks have been taken
 	while (true) {
-		{
-			MutexLock lock(_tasks_mutex);
-			if (_tasks.size() == 0) {
-				break;
-			}
+		if (get_queued_task_count() == 0) {
+			break;
 		}
 
 		OS::get_singleton()->delay_usec(2000);
@@ -252,8 +554,8 @@ void VoxelThreadPool::wait_for_all_tasks() {
 	bool any_working_thread = true;
 	while (any_working_thread) {
 		any_working_thread = false;
-		for (size_t i = 0; i < _thread_count; ++i) {
-			const ThreadData &t = _threads[i];
+		for (size_t i = 0; i < _threads.size(); ++i) {
+			const ThreadData &t = *_threads[i];
 			if (t.waiting == false) {
 				any_working_thread = true;
 				break;
@@ -274,9 +576,25 @@ void VoxelThreadPool::wait_for_all_tasks() {
 // Thought it wasnt worth locking for debugging.
 
 VoxelThreadPool::State VoxelThreadPool::get_thread_debug_state(uint32_t i) const {
-	return _threads[i].debug_state;
+	return _threads[i]->debug_state;
 }
 
 unsigned int VoxelThreadPool::get_debug_remaining_tasks() const {
-	return _debug_received_tasks - _debug_completed_tasks;
+	unsigned int completed_tasks = _debug_completed_tasks;
+	for (size_t i = 0; i < _threads.size(); ++i) {
+		completed_tasks += _threads[i]->debug_completed_tasks;
+	}
+	return _debug_received_tasks - completed_tasks;
+}
+
+void VoxelThreadPool::get_stats(Stats &stats) const {
+	stats.wait_time.add(_removed_threads_stats.wait_time);
+	stats.run_time.add(_removed_threads_stats.run_time);
+	stats.cancelled_tasks += _removed_threads_stats.cancelled_tasks;
+	for (size_t i = 0; i < _threads.size(); ++i) {
+		const ThreadData &d = *_threads[i];
+		d.wait_time.get_counts(stats.wait_time);
+		d.run_time.get_counts(stats.run_time);
+		stats.cancelled_tasks += d.cancelled_tasks.load(std::memory_order_relaxed);
+	}
 }
@@ -3,7 +3,7 @@
 
 #include "../storage/voxel_buffer.h"
 #include "../util/array_slice.h"
-#include "../util/fixed_array.h"
+#include "../util/latency_histogram.h"
 #include <core/os/mutex.h>
 
 #include <queue>
@@ -11,9 +11,10 @@
 class Mutex;
 class Thread;
 class Semaphore;
+class RWLock;
 
 struct VoxelTaskContext {
-	uint8_t thread_index;
+	uint32_t thread_index;
 };
 
 class IVoxelTask {
@@ -26,13 +27,17 @@ public:
 	virtual int get_priority() { return 0; }
 
 	virtual bool is_cancelled() { return false; }
+
+	// Tasks returning the same non-negative value are always run by the same thread,
+	// as long as the thread count doesn't change. They can't be stolen by other threads.
+	// This is useful when tasks work on resources which are costly to share between threads, like open files.
+	// Evaluated once, when the task is queued.
+	virtual int get_thread_affinity() const { return -1; }
 };
 
 // Generic thread pool that performs batches of tasks based on priority
 class VoxelThreadPool {
 public:
-	static const uint32_t MAX_THREADS = 8;
-
 	enum State {
 		STATE_RUNNING = 0,
 		STATE_PICKING,
@@ -40,13 +45,24 @@ public:
 		STATE_STOPPED
 	};
 
+	// Always-on counters, cheap enough to be gathered in production
+	struct Stats {
+		// Time spent by tasks between being queued and picked by a thread
+		LatencyHistogram::Counts wait_time;
+		// Time spent running tasks. Its total is also the number of tasks that ran.
+		LatencyHistogram::Counts run_time;
+		// Tasks which were not run because they got cancelled while queued
+		uint64_t cancelled_tasks = 0;
+	};
+
 	VoxelThreadPool();
 	~VoxelThreadPool();
 
-	// TODO Add ability to change it while running without skipping tasks
-	// Can't be changed after tasks have been queued
+	// Can be changed while tasks are running. Threads being removed finish their current tasks first,
+	// and tasks they had queued are given back to the remaining threads.
+	// Threads are always indexed from 0 to count - 1, and those which stay keep their index.
 	void set_thread_count(uint32_t count);
-	uint32_t get_thread_count() const { return _thread_count; }
+	uint32_t get_thread_count() const { return _threads.size(); }
 
 	// TODO Add ability to change it while running
 	// Can't be changed after tasks have been queued
@@ -56,6 +72,13 @@ public:
 	// Can't be changed after tasks have been queued
 	void set_priority_update_period(uint32_t milliseconds);
 
+	// When enabled, each thread gets its own task queue, and threads running out of work steal from the others.
+	// This avoids all threads contending on a single queue, which matters when there are many of them.
+	// Priorities are then only respected per thread, instead of across the whole pool.
+	// Can't be changed after tasks have been queued
+	void set_work_stealing_enabled(bool enabled);
+	bool is_work_stealing_enabled() const { return _work_stealing_enabled; }
+
 	// Schedules a task.
 	// Ownership is NOT passed to the pool, so make sure you get them back when completed if you want to delete them.
 	void enqueue(IVoxelTask *task);
@@ -63,7 +86,13 @@ public:
 
 	template <typename F>
 	void dequeue_completed_tasks(F f) {
-		MutexLock lock(_completed_tasks_mutex);
+		// Gather outputs of each thread first, so their locks are held only for a short time
+		for (size_t i = 0; i < _threads.size(); ++i) {
+			ThreadData &d = *_threads[i];
+			MutexLock lock(d.completed_tasks_mutex);
+			_completed_tasks.insert(_completed_tasks.end(), d.completed_tasks.begin(), d.completed_tasks.end());
+			d.completed_tasks.clear();
+		}
 		for (size_t i = 0; i < _completed_tasks.size(); ++i) {
 			IVoxelTask *task = _completed_tasks[i];
 			f(task);
@@ -77,11 +106,25 @@ public:
 	State get_thread_debug_state(uint32_t i) const;
 	unsigned int get_debug_remaining_tasks() const;
 
+	// Adds up counters of all threads, including those that were removed.
+	// Can be called while tasks are running, values may be slightly outdated.
+	void get_stats(Stats &stats) const;
+
 private:
 	struct TaskItem {
 		IVoxelTask *task = nullptr;
 		int cached_priority = 99999;
 		uint32_t last_priority_update_time = 0;
+		int affinity = -1;
+		uint64_t enqueue_time_usec = 0;
+	};
+
+	// Binary heap ordered by cached priority, the best task is always at the front.
+	// Priorities are refreshed lazily, either when tasks reach the top, or by incremental sweeps.
+	struct TaskQueue {
+		std::vector<TaskItem> items;
+		size_t sweep_cursor = 0;
+		Mutex *mutex = nullptr;
 	};
 
 	struct ThreadData {
@@ -90,30 +133,66 @@ private:
 		uint32_t index = 0;
 		bool stop = false;
 		bool waiting = false;
+		// Posted when there are tasks the thread should look for. Each thread has its own,
+		// so tasks pinned to a thread wake up that thread and not another one.
+		Semaphore *semaphore = nullptr;
+		// Set when the semaphore was posted and the thread didn't wake up yet, so it isn't posted many times
+		std::atomic<bool> wake_pending;
 		State debug_state = STATE_STOPPED;
+		// Only used when work stealing is enabled
+		TaskQueue local_tasks;
+		// Tasks with affinity to this thread. They are picked first, and never stolen.
+		TaskQueue pinned_tasks;
+		// Each thread outputs its own completed tasks, so threads don't contend with each other when finishing
+		std::vector<IVoxelTask *> completed_tasks;
+		Mutex *completed_tasks_mutex = nullptr;
+		unsigned int debug_completed_tasks = 0;
+		// Only written by the thread
+		LatencyHistogram wait_time;
+		LatencyHistogram run_time;
+		std::atomic<uint32_t> cancelled_tasks;
 	};
 
 	static void thread_func_static(void *p_data);
 	void thread_func(ThreadData &data);
 
-	void create_thread(ThreadData &d, uint32_t i);
-	void destroy_all_threads();
-
-	FixedArray<ThreadData, MAX_THREADS> _threads;
-	uint32_t _thread_count = 0;
-
-	std::vector<TaskItem> _tasks;
-	Mutex *_tasks_mutex = nullptr; // TODO Optimize this with a less naive design?
-	Semaphore *_tasks_semaphore = nullptr;
-
+	void sweep_tasks(TaskQueue &queue, uint32_t now, std::vector<IVoxelTask *> &cancelled_tasks);
+	void pick_tasks(TaskQueue &queue, uint32_t now, std::vector<TaskItem> &out_tasks,
+			std::vector<IVoxelTask *> &cancelled_tasks);
+	void pick_tasks_from_queue(TaskQueue &queue, std::vector<TaskItem> &out_tasks,
+			std::vector<IVoxelTask *> &cancelled_tasks);
+	void steal_tasks(const ThreadData &thief, std::vector<TaskItem> &out_tasks,
+			std::vector<IVoxelTask *> &cancelled_tasks);
+	void push_task(const TaskItem &item);
+	void post_for_tasks(size_t task_count);
+	void wake_thread(ThreadData &d);
+	size_t get_queued_task_count() const;
+
+	void create_threads(uint32_t count);
+	void destroy_threads(uint32_t count);
+
+	// Threads are allocated individually, so they keep the same address when the list changes.
+	// Only modified by the main thread. Threads read it when stealing, so changes are done under write lock.
+	std::vector<ThreadData *> _threads;
+	RWLock *_threads_lock = nullptr;
+
+	// Shared by all threads when work stealing is disabled.
+	// Otherwise, only used when no threads are running, or as a last resort when threads find no work.
+	TaskQueue _tasks;
+
+	// Only accessed from the main thread
 	std::vector<IVoxelTask *> _completed_tasks;
-	Mutex *_completed_tasks_mutex = nullptr;
 
 	uint32_t _batch_count = 1;
 	uint32_t _priority_update_period = 32;
+	bool _work_stealing_enabled = false;
+	// Round-robin index of the thread receiving the next task, when work stealing is enabled
+	uint32_t _next_thread_index = 0;
 
 	unsigned int _debug_received_tasks = 0;
 	unsigned int _debug_completed_tasks = 0;
+	// Counters of threads that were removed
+	Stats _removed_threads_stats;
 };
 
 #endif // VOXEL_THREAD_TASK_MANAGER_H
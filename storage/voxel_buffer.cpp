@@ -12,6 +12,8 @@
 #include <core/io/marshalls.h>
 #include <core/math/math_funcs.h>
 #include <string.h>
+#include <algorithm>
+#include <vector>
 
 namespace {
 
@@ -31,6 +33,37 @@ inline void free_channel_data(uint8_t *data, uint32_t size) {
 #endif
 }
 
+// Channels in a slab start on a new cache line
+const uint32_t SLAB_ALIGNMENT = 64;
+
+// Allocations don't start on a cache line, so slabs are allocated with extra space to align their data
+inline uint32_t get_slab_allocation_size(uint32_t size_in_bytes) {
+	return size_in_bytes + SLAB_ALIGNMENT - 1;
+}
+
+inline uint8_t *get_aligned_slab_data(uint8_t *allocation) {
+	const uintptr_t address = reinterpret_cast<uintptr_t>(allocation);
+	return reinterpret_cast<uint8_t *>((address + SLAB_ALIGNMENT - 1) & ~static_cast<uintptr_t>(SLAB_ALIGNMENT - 1));
+}
+
+// Compressed data has variable size, so it doesn't go through the memory pool,
+// which would otherwise keep one list of blocks for each size
+inline uint8_t *allocate_compressed_channel_data(uint32_t size) {
+	return (uint8_t *)memalloc(size * sizeof(uint8_t));
+}
+
+void free_sparse_channel_data(uint8_t *data);
+
+inline void free_channel_data(uint8_t *data, uint32_t size, VoxelBuffer::Compression compression) {
+	if (compression == VoxelBuffer::COMPRESSION_NONE) {
+		free_channel_data(data, size);
+	} else if (compression == VoxelBuffer::COMPRESSION_SPARSE) {
+		free_sparse_channel_data(data);
+	} else {
+		memfree(data);
+	}
+}
+
 uint32_t g_depth_bit_counts[] = {
 	8, 16, 32, 64
 };
@@ -59,24 +92,440 @@ inline uint64_t clamp_value_for_depth(uint64_t value, VoxelBuffer::Depth d) {
 	return value;
 }
 
+inline uint64_t read_raw_value(const uint8_t *data, uint32_t i, VoxelBuffer::Depth depth) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return data[i];
+		case VoxelBuffer::DEPTH_16_BIT:
+			return ((const uint16_t *)data)[i];
+		case VoxelBuffer::DEPTH_32_BIT:
+			return ((const uint32_t *)data)[i];
+		case VoxelBuffer::DEPTH_64_BIT:
+			return ((const uint64_t *)data)[i];
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+inline void write_raw_value(uint8_t *data, uint32_t i, VoxelBuffer::Depth depth, uint64_t value) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			data[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			((uint16_t *)data)[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			((uint32_t *)data)[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			((uint64_t *)data)[i] = value;
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+// Compressed channel data starts with two 32-bit integers:
+// - RLE: run count, unused
+// - Palette: palette size, bits per index
+// Then follows an array of values in the depth of the channel (one per run, or the palette), padded to 4 bytes.
+// RLE data ends with the exclusive end index of each run, while palette data ends with packed indices.
+// Indices never straddle bytes, and the first voxel goes in the lowest bits.
+const uint32_t COMPRESSED_HEADER_SIZE = 2 * sizeof(uint32_t);
+const uint32_t MAX_PALETTE_SIZE = 256;
+
+inline uint32_t get_padded_values_size(uint32_t count, uint32_t value_size) {
+	return (count * value_size + 3) & ~3;
+}
+
+inline uint32_t get_palette_index_bits(uint32_t palette_size) {
+	if (palette_size <= 2) {
+		return 1;
+	} else if (palette_size <= 4) {
+		return 2;
+	} else if (palette_size <= 16) {
+		return 4;
+	}
+	return 8;
+}
+
+inline uint32_t get_rle_run_index(const uint8_t *data, uint32_t value_size, uint32_t i) {
+	const uint32_t run_count = ((const uint32_t *)data)[0];
+	const uint32_t *run_ends = (const uint32_t *)(data + COMPRESSED_HEADER_SIZE +
+												  get_padded_values_size(run_count, value_size));
+	// Runs are sorted by end index, find the first one ending after the voxel
+	return std::upper_bound(run_ends, run_ends + run_count, i) - run_ends;
+}
+
+inline uint32_t get_palette_index(const uint8_t *data, uint32_t value_size, uint32_t i) {
+	const uint32_t *header = (const uint32_t *)data;
+	const uint32_t bits = header[1];
+	const uint8_t *indices = data + COMPRESSED_HEADER_SIZE + get_padded_values_size(header[0], value_size);
+	const uint32_t indices_per_byte = 8 / bits;
+	return (indices[i / indices_per_byte] >> ((i % indices_per_byte) * bits)) & ((1 << bits) - 1);
+}
+
+// Sparse channel data is a table of bricks, starting with a header.
+// Bricks are in the same order as voxels in `index()`, and so are voxels inside dense bricks.
+// Dense bricks are allocated separately, so they are owned by the table.
+struct SparseHeader {
+	uint32_t brick_count_x;
+	uint32_t brick_count_y;
+	uint32_t brick_count_z;
+	uint32_t brick_size_in_bytes;
+};
+
+struct SparseBrick {
+	// Null if the brick is uniform
+	uint8_t *data;
+	uint64_t value;
+};
+
+const uint32_t BRICK_SIZE_PO2 = VoxelBuffer::BRICK_SIZE_PO2;
+const uint32_t BRICK_SIZE = VoxelBuffer::BRICK_SIZE;
+const uint32_t BRICK_MASK = BRICK_SIZE - 1;
+const uint32_t BRICK_VOLUME = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+inline const SparseHeader &get_sparse_header(const uint8_t *data) {
+	return *(const SparseHeader *)data;
+}
+
+inline const SparseBrick *get_sparse_bricks(const uint8_t *data) {
+	return (const SparseBrick *)(data + sizeof(SparseHeader));
+}
+
+inline SparseBrick *get_sparse_bricks(uint8_t *data) {
+	return (SparseBrick *)(data + sizeof(SparseHeader));
+}
+
+inline uint32_t get_sparse_brick_count(const SparseHeader &header) {
+	return header.brick_count_x * header.brick_count_y * header.brick_count_z;
+}
+
+inline uint32_t get_sparse_table_size(uint32_t brick_count) {
+	return sizeof(SparseHeader) + brick_count * sizeof(SparseBrick);
+}
+
+inline uint32_t get_sparse_brick_index(const SparseHeader &header, uint32_t x, uint32_t y, uint32_t z) {
+	return (y >> BRICK_SIZE_PO2) + header.brick_count_y * ((x >> BRICK_SIZE_PO2) + header.brick_count_x * (z >> BRICK_SIZE_PO2));
+}
+
+inline uint32_t get_index_in_brick(uint32_t x, uint32_t y, uint32_t z) {
+	return (y & BRICK_MASK) + BRICK_SIZE * ((x & BRICK_MASK) + BRICK_SIZE * (z & BRICK_MASK));
+}
+
+// Allocates a table of uniform bricks. The table itself doesn't come from the pool, its size depends on the buffer.
+uint8_t *allocate_sparse_channel_data(Vector3i size, VoxelBuffer::Depth depth, uint64_t value) {
+	const uint32_t brick_count =
+			(size.x >> BRICK_SIZE_PO2) * (size.y >> BRICK_SIZE_PO2) * (size.z >> BRICK_SIZE_PO2);
+	uint8_t *data = allocate_compressed_channel_data(get_sparse_table_size(brick_count));
+	SparseHeader *header = (SparseHeader *)data;
+	header->brick_count_x = size.x >> BRICK_SIZE_PO2;
+	header->brick_count_y = size.y >> BRICK_SIZE_PO2;
+	header->brick_count_z = size.z >> BRICK_SIZE_PO2;
+	header->brick_size_in_bytes = BRICK_VOLUME * (get_depth_bit_count(depth) >> 3);
+	SparseBrick *bricks = get_sparse_bricks(data);
+	for (uint32_t i = 0; i < brick_count; ++i) {
+		bricks[i].data = nullptr;
+		bricks[i].value = value;
+	}
+	return data;
+}
+
+void free_sparse_channel_data(uint8_t *data) {
+	const SparseHeader &header = get_sparse_header(data);
+	const uint32_t brick_count = get_sparse_brick_count(header);
+	SparseBrick *bricks = get_sparse_bricks(data);
+	for (uint32_t i = 0; i < brick_count; ++i) {
+		if (bricks[i].data != nullptr) {
+			free_channel_data(bricks[i].data, header.brick_size_in_bytes);
+		}
+	}
+	memfree(data);
+}
+
+uint8_t *duplicate_sparse_channel_data(const uint8_t *src) {
+	const SparseHeader &header = get_sparse_header(src);
+	const uint32_t brick_count = get_sparse_brick_count(header);
+	const uint32_t table_size = get_sparse_table_size(brick_count);
+	uint8_t *data = allocate_compressed_channel_data(table_size);
+	memcpy(data, src, table_size);
+	SparseBrick *bricks = get_sparse_bricks(data);
+	for (uint32_t i = 0; i < brick_count; ++i) {
+		if (bricks[i].data != nullptr) {
+			uint8_t *brick_data = allocate_channel_data(header.brick_size_in_bytes);
+			memcpy(brick_data, bricks[i].data, header.brick_size_in_bytes);
+			bricks[i].data = brick_data;
+		}
+	}
+	return data;
+}
+
+// Memory used by the table and dense bricks
+uint32_t get_sparse_channel_memory_usage(const uint8_t *data) {
+	const SparseHeader &header = get_sparse_header(data);
+	const uint32_t brick_count = get_sparse_brick_count(header);
+	const SparseBrick *bricks = get_sparse_bricks(data);
+	uint32_t size = get_sparse_table_size(brick_count);
+	for (uint32_t i = 0; i < brick_count; ++i) {
+		if (bricks[i].data != nullptr) {
+			size += header.brick_size_in_bytes;
+		}
+	}
+	return size;
+}
+
+inline uint64_t get_sparse_value(const uint8_t *data, VoxelBuffer::Depth depth, uint32_t x, uint32_t y, uint32_t z) {
+	const SparseHeader &header = get_sparse_header(data);
+	const SparseBrick &brick = get_sparse_bricks(data)[get_sparse_brick_index(header, x, y, z)];
+	if (brick.data == nullptr) {
+		return brick.value;
+	}
+	return read_raw_value(brick.data, get_index_in_brick(x, y, z), depth);
+}
+
+void set_sparse_value(uint8_t *data, VoxelBuffer::Depth depth, uint32_t x, uint32_t y, uint32_t z, uint64_t value) {
+	const SparseHeader &header = get_sparse_header(data);
+	SparseBrick &brick = get_sparse_bricks(data)[get_sparse_brick_index(header, x, y, z)];
+	if (brick.data == nullptr) {
+		if (brick.value == value) {
+			return;
+		}
+		// First modification of this brick
+		brick.data = allocate_channel_data(header.brick_size_in_bytes);
+		for (uint32_t i = 0; i < BRICK_VOLUME; ++i) {
+			write_raw_value(brick.data, i, depth, brick.value);
+		}
+	}
+	write_raw_value(brick.data, get_index_in_brick(x, y, z), depth, value);
+}
+
+// Writes `count` values starting from index `begin`, walking through bricks one column segment at a time
+void decode_sparse_channel_data(const uint8_t *data, VoxelBuffer::Depth depth,
+		uint32_t begin, uint32_t count, uint8_t *dst) {
+
+	const SparseHeader &header = get_sparse_header(data);
+	const SparseBrick *bricks = get_sparse_bricks(data);
+	const uint32_t value_size = get_depth_bit_count(depth) >> 3;
+	const uint32_t size_x = header.brick_count_x << BRICK_SIZE_PO2;
+	const uint32_t size_y = header.brick_count_y << BRICK_SIZE_PO2;
+
+	const uint32_t column = begin / size_y;
+	uint32_t y = begin % size_y;
+	uint32_t x = column % size_x;
+	uint32_t z = column / size_x;
+	uint32_t i = 0;
+
+	while (i < count) {
+		// Voxels along Y are contiguous until the end of the brick
+		const uint32_t segment = MIN(BRICK_SIZE - (y & BRICK_MASK), count - i);
+		const SparseBrick &brick = bricks[get_sparse_brick_index(header, x, y, z)];
+		if (brick.data == nullptr) {
+			for (uint32_t j = 0; j < segment; ++j) {
+				write_raw_value(dst, i + j, depth, brick.value);
+			}
+		} else {
+			memcpy(dst + i * value_size, brick.data + get_index_in_brick(x, y, z) * value_size, segment * value_size);
+		}
+		i += segment;
+		y += segment;
+		if (y == size_y) {
+			y = 0;
+			++x;
+			if (x == size_x) {
+				x = 0;
+				++z;
+			}
+		}
+	}
+}
+
+// Gets whether voxels of a brick are all the same in raw channel data
+bool is_brick_uniform(const uint8_t *src, VoxelBuffer::Depth depth, Vector3i size, Vector3i brick_origin,
+		uint64_t &out_value) {
+	const uint64_t v0 = read_raw_value(src, brick_origin.y + size.y * (brick_origin.x + size.x * brick_origin.z), depth);
+	for (uint32_t z = 0; z < BRICK_SIZE; ++z) {
+		for (uint32_t x = 0; x < BRICK_SIZE; ++x) {
+			const uint32_t column = brick_origin.y + size.y * ((brick_origin.x + x) + size.x * (brick_origin.z + z));
+			for (uint32_t y = 0; y < BRICK_SIZE; ++y) {
+				if (read_raw_value(src, column + y, depth) != v0) {
+					return false;
+				}
+			}
+		}
+	}
+	out_value = v0;
+	return true;
+}
+
+// Makes sparse channel data from raw data. Bricks having only one value are not allocated.
+uint8_t *encode_sparse_channel_data(const uint8_t *src, VoxelBuffer::Depth depth, Vector3i size) {
+	uint8_t *data = allocate_sparse_channel_data(size, depth, 0);
+	const SparseHeader &header = get_sparse_header(data);
+	SparseBrick *bricks = get_sparse_bricks(data);
+	const uint32_t value_size = get_depth_bit_count(depth) >> 3;
+
+	Vector3i bpos;
+	for (bpos.z = 0; bpos.z < (int)header.brick_count_z; ++bpos.z) {
+		for (bpos.x = 0; bpos.x < (int)header.brick_count_x; ++bpos.x) {
+			for (bpos.y = 0; bpos.y < (int)header.brick_count_y; ++bpos.y) {
+				const Vector3i origin = bpos * BRICK_SIZE;
+				SparseBrick &brick = bricks[bpos.y + header.brick_count_y * (bpos.x + header.brick_count_x * bpos.z)];
+
+				if (is_brick_uniform(src, depth, size, origin, brick.value)) {
+					continue;
+				}
+
+				brick.data = allocate_channel_data(header.brick_size_in_bytes);
+				for (uint32_t z = 0; z < BRICK_SIZE; ++z) {
+					for (uint32_t x = 0; x < BRICK_SIZE; ++x) {
+						const uint32_t src_i = origin.y + size.y * ((origin.x + x) + size.x * (origin.z + z));
+						memcpy(brick.data + get_index_in_brick(x, 0, z) * value_size, src + src_i * value_size,
+								BRICK_SIZE * value_size);
+					}
+				}
+			}
+		}
+	}
+
+	return data;
+}
+
+inline uint64_t hash_combine_64(uint64_t hash, uint64_t v) {
+	return hash ^ (v + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+}
+
+// Hashes voxels as runs of equal values, so the result is the same whether they are uniform, compressed or raw
+struct RunHasher {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint64_t value = 0;
+	uint64_t length = 0;
+
+	inline void push(uint64_t v, uint64_t count = 1) {
+		if (length != 0 && v == value) {
+			length += count;
+		} else {
+			flush();
+			value = v;
+			length = count;
+		}
+	}
+
+	inline void flush() {
+		if (length != 0) {
+			hash = hash_combine_64(hash, value);
+			hash = hash_combine_64(hash, length);
+		}
+	}
+
+	inline uint64_t finish() {
+		flush();
+		length = 0;
+		return hash;
+	}
+};
+
+// Gets the value at the given index, in `index()` order
+uint64_t get_compressed_value(const uint8_t *data, VoxelBuffer::Compression compression,
+		VoxelBuffer::Depth depth, uint32_t i) {
+
+	const uint8_t *values = data + COMPRESSED_HEADER_SIZE;
+	const uint32_t value_size = get_depth_bit_count(depth) >> 3;
+
+	switch (compression) {
+		case VoxelBuffer::COMPRESSION_RLE:
+			return read_raw_value(values, get_rle_run_index(data, value_size, i), depth);
+
+		case VoxelBuffer::COMPRESSION_PALETTE:
+			return read_raw_value(values, get_palette_index(data, value_size, i), depth);
+
+		case VoxelBuffer::COMPRESSION_SPARSE: {
+			const SparseHeader &header = get_sparse_header(data);
+			const uint32_t size_y = header.brick_count_y << BRICK_SIZE_PO2;
+			const uint32_t size_x = header.brick_count_x << BRICK_SIZE_PO2;
+			const uint32_t column = i / size_y;
+			return get_sparse_value(data, depth, column % size_x, i % size_y, column / size_x);
+		}
+
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+// Writes `count` values starting from index `begin`, in raw format
+void decode_channel_data(const uint8_t *data, VoxelBuffer::Compression compression, VoxelBuffer::Depth depth,
+		uint32_t begin, uint32_t count, uint8_t *dst) {
+
+	const uint32_t value_size = get_depth_bit_count(depth) >> 3;
+
+	switch (compression) {
+		case VoxelBuffer::COMPRESSION_NONE:
+			memcpy(dst, data + begin * value_size, count * value_size);
+			break;
+
+		case VoxelBuffer::COMPRESSION_RLE: {
+			const uint32_t run_count = ((const uint32_t *)data)[0];
+			const uint8_t *values = data + COMPRESSED_HEADER_SIZE;
+			const uint32_t *run_ends = (const uint32_t *)(values + get_padded_values_size(run_count, value_size));
+			const uint32_t end = begin + count;
+			uint32_t run_index = get_rle_run_index(data, value_size, begin);
+			uint32_t i = begin;
+			while (i < end) {
+				CRASH_COND(run_index >= run_count);
+				const uint32_t run_end = MIN(run_ends[run_index], end);
+				const uint64_t v = read_raw_value(values, run_index, depth);
+				for (; i < run_end; ++i) {
+					write_raw_value(dst, i - begin, depth, v);
+				}
+				++run_index;
+			}
+		} break;
+
+		case VoxelBuffer::COMPRESSION_PALETTE: {
+			const uint8_t *values = data + COMPRESSED_HEADER_SIZE;
+			for (uint32_t i = 0; i < count; ++i) {
+				write_raw_value(dst, i, depth, read_raw_value(values, get_palette_index(data, value_size, begin + i), depth));
+			}
+		} break;
+
+		case VoxelBuffer::COMPRESSION_SPARSE:
+			decode_sparse_channel_data(data, depth, begin, count, dst);
+			break;
+
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
 static_assert(sizeof(uint32_t) == sizeof(float), "uint32_t and float cannot be marshalled back and forth");
 static_assert(sizeof(uint64_t) == sizeof(double), "uint64_t and double cannot be marshalled back and forth");
 
 inline uint64_t real_to_raw_voxel(real_t value, VoxelBuffer::Depth depth) {
 	switch (depth) {
-		case VoxelBuffer::DEPTH_8_BIT:
-			return clamp(static_cast<int>(128.f * value + 128.f), 0, 0xff);
-		case VoxelBuffer::DEPTH_16_BIT:
-			return clamp(static_cast<int>(0x7fff * value + 0x7fff), 0, 0xffff);
+		case VoxelBuffer::DEPTH_8_BIT: {
+			uint8_t v;
+			VoxelBuffer::real_to_raw(value, v);
+			return v;
+		}
+		case VoxelBuffer::DEPTH_16_BIT: {
+			uint16_t v;
+			VoxelBuffer::real_to_raw(value, v);
+			return v;
+		}
 		case VoxelBuffer::DEPTH_32_BIT: {
-			MarshallFloat m;
-			m.f = value;
-			return m.i;
+			uint32_t v;
+			VoxelBuffer::real_to_raw(value, v);
+			return v;
 		}
 		case VoxelBuffer::DEPTH_64_BIT: {
-			MarshallDouble m;
-			m.d = value;
-			return m.l;
+			uint64_t v;
+			VoxelBuffer::real_to_raw(value, v);
+			return v;
 		}
 		default:
 			CRASH_NOW();
@@ -85,25 +534,192 @@ inline uint64_t real_to_raw_voxel(real_t value, VoxelBuffer::Depth depth) {
 }
 
 inline real_t raw_voxel_to_real(uint64_t value, VoxelBuffer::Depth depth) {
-	// Depths below 32 are normalized between -1 and 1
 	switch (depth) {
 		case VoxelBuffer::DEPTH_8_BIT:
-			return (static_cast<real_t>(value) - 0x7f) / 0x7f;
+			return VoxelBuffer::raw_to_real(static_cast<uint8_t>(value));
 		case VoxelBuffer::DEPTH_16_BIT:
-			return (static_cast<real_t>(value) - 0x7fff) / 0x7fff;
-		case VoxelBuffer::DEPTH_32_BIT: {
-			MarshallFloat m;
-			m.i = value;
-			return m.f;
+			return VoxelBuffer::raw_to_real(static_cast<uint16_t>(value));
+		case VoxelBuffer::DEPTH_32_BIT:
+			return VoxelBuffer::raw_to_real(static_cast<uint32_t>(value));
+		case VoxelBuffer::DEPTH_64_BIT:
+			return VoxelBuffer::raw_to_real(value);
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+
+// Downscale kernels reduce 2x2x2 voxels into one, for a whole column along Y at once.
+// `src` holds the 4 source columns at (x, z), (x + 1, z), (x, z + 1) and (x + 1, z + 1), each `2 * count` long.
+// Loops only involve plain arrays without branching on depth, so compilers can vectorize them.
+
+template <typename T>
+struct DownscaleNearest {
+	static void process(const T *const *src, T *dst, unsigned int count) {
+		const T *s = src[0];
+		for (unsigned int i = 0; i < count; ++i) {
+			dst[i] = s[i << 1];
 		}
-		case VoxelBuffer::DEPTH_64_BIT: {
-			MarshallDouble m;
-			m.l = value;
-			return m.d;
+	}
+};
+
+template <typename T>
+struct DownscaleAverage {
+	static void process(const T *const *src, T *dst, unsigned int count) {
+		const T *s0 = src[0];
+		const T *s1 = src[1];
+		const T *s2 = src[2];
+		const T *s3 = src[3];
+		for (unsigned int i = 0; i < count; ++i) {
+			const unsigned int j = i << 1;
+			const uint32_t sum = static_cast<uint32_t>(s0[j]) + s0[j + 1] + s1[j] + s1[j + 1] +
+								 s2[j] + s2[j + 1] + s3[j] + s3[j + 1];
+			dst[i] = static_cast<T>((sum + 4) >> 3);
+		}
+	}
+};
+
+// 32-bit and 64-bit voxels hold floating point values, which must be averaged as such
+template <typename T>
+struct DownscaleAverageReal {
+	static void process(const T *const *src, T *dst, unsigned int count) {
+		for (unsigned int i = 0; i < count; ++i) {
+			const unsigned int j = i << 1;
+			real_t sum = 0;
+			for (unsigned int c = 0; c < 4; ++c) {
+				sum += VoxelBuffer::raw_to_real(src[c][j]) + VoxelBuffer::raw_to_real(src[c][j + 1]);
+			}
+			VoxelBuffer::real_to_raw(sum * 0.125f, dst[i]);
 		}
+	}
+};
+
+template <>
+struct DownscaleAverage<uint32_t> : DownscaleAverageReal<uint32_t> {};
+template <>
+struct DownscaleAverage<uint64_t> : DownscaleAverageReal<uint64_t> {};
+
+// Picks the most frequent value. On ties, the first one wins, so it stays close to nearest-neighbor.
+template <typename T>
+struct DownscaleMode {
+	static void process(const T *const *src, T *dst, unsigned int count) {
+		T v[8];
+		for (unsigned int i = 0; i < count; ++i) {
+			const unsigned int j = i << 1;
+			for (unsigned int c = 0; c < 4; ++c) {
+				v[c << 1] = src[c][j];
+				v[(c << 1) + 1] = src[c][j + 1];
+			}
+			T best = v[0];
+			unsigned int best_count = 0;
+			for (unsigned int a = 0; a < 8 && best_count <= 4; ++a) {
+				unsigned int n = 0;
+				for (unsigned int b = 0; b < 8; ++b) {
+					n += (v[b] == v[a]);
+				}
+				if (n > best_count) {
+					best_count = n;
+					best = v[a];
+				}
+			}
+			dst[i] = best;
+		}
+	}
+};
+
+// Both channels must have the same depth. The destination must be raw, while the source may be compressed.
+template <typename T, typename Kernel>
+void downscale_channel(
+		const VoxelBuffer &src_buffer, const uint8_t *src_data, VoxelBuffer::Compression src_compression,
+		VoxelBuffer::Depth depth, Vector3i src_min,
+		const VoxelBuffer &dst_buffer, uint8_t *dst_data, Vector3i dst_min, Vector3i dst_max) {
+
+	const unsigned int count = dst_max.y - dst_min.y;
+	const unsigned int src_count = count << 1;
+	const T *src = reinterpret_cast<const T *>(src_data);
+	T *dst = reinterpret_cast<T *>(dst_data);
+
+	// Compressed or tiled columns are gathered first
+	const bool src_linear = src_compression == VoxelBuffer::COMPRESSION_NONE &&
+							src_buffer.get_layout() == VoxelBuffer::LAYOUT_LINEAR;
+	std::vector<T> decoded_columns;
+	if (!src_linear) {
+		decoded_columns.resize(src_count * 4);
+	}
+
+	// Tiled destinations get their columns scattered afterwards
+	const bool dst_linear = dst_buffer.get_layout() == VoxelBuffer::LAYOUT_LINEAR;
+	std::vector<T> dst_column;
+	if (!dst_linear) {
+		dst_column.resize(count);
+	}
+
+	const T *columns[4];
+
+	Vector3i pos;
+	for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
+		for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
+			const int src_x = src_min.x + ((pos.x - dst_min.x) << 1);
+			const int src_z = src_min.z + ((pos.z - dst_min.z) << 1);
+
+			for (unsigned int c = 0; c < 4; ++c) {
+				const int x = src_x + (c & 1);
+				const int z = src_z + (c >> 1);
+
+				if (src_linear) {
+					columns[c] = src + src_buffer.index(x, src_min.y, z);
+
+				} else if (src_compression != VoxelBuffer::COMPRESSION_NONE) {
+					T *column = &decoded_columns[c * src_count];
+					decode_channel_data(src_data, src_compression, depth, src_buffer.index(x, src_min.y, z),
+							src_count, reinterpret_cast<uint8_t *>(column));
+					columns[c] = column;
+
+				} else {
+					T *column = &decoded_columns[c * src_count];
+					for (unsigned int i = 0; i < src_count; ++i) {
+						column[i] = src[src_buffer.data_index(x, src_min.y + i, z)];
+					}
+					columns[c] = column;
+				}
+			}
+
+			if (dst_linear) {
+				Kernel::process(columns, dst + dst_buffer.index(pos.x, dst_min.y, pos.z), count);
+
+			} else {
+				Kernel::process(columns, dst_column.data(), count);
+				for (unsigned int i = 0; i < count; ++i) {
+					dst[dst_buffer.data_index(pos.x, dst_min.y + i, pos.z)] = dst_column[i];
+				}
+			}
+		}
+	}
+}
+
+template <typename T>
+void downscale_channel(VoxelBuffer::DownscaleFilter filter,
+		const VoxelBuffer &src_buffer, const uint8_t *src_data, VoxelBuffer::Compression src_compression,
+		VoxelBuffer::Depth depth, Vector3i src_min,
+		const VoxelBuffer &dst_buffer, uint8_t *dst_data, Vector3i dst_min, Vector3i dst_max) {
+
+	switch (filter) {
+		case VoxelBuffer::DOWNSCALE_NEAREST:
+			downscale_channel<T, DownscaleNearest<T> >(src_buffer, src_data, src_compression, depth, src_min,
+					dst_buffer, dst_data, dst_min, dst_max);
+			break;
+		case VoxelBuffer::DOWNSCALE_AVERAGE:
+			downscale_channel<T, DownscaleAverage<T> >(src_buffer, src_data, src_compression, depth, src_min,
+					dst_buffer, dst_data, dst_min, dst_max);
+			break;
+		case VoxelBuffer::DOWNSCALE_MODE:
+			downscale_channel<T, DownscaleMode<T> >(src_buffer, src_data, src_compression, depth, src_min,
+					dst_buffer, dst_data, dst_min, dst_max);
+			break;
 		default:
 			CRASH_NOW();
-			return 0;
+			break;
 	}
 }
 
@@ -126,9 +742,17 @@ void VoxelBuffer::create(unsigned int sx, unsigned int sy, unsigned int sz) {
 	ERR_FAIL_COND(sx > MAX_SIZE || sy > MAX_SIZE || sz > MAX_SIZE);
 
 	clear_voxel_metadata();
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		mark_channel_modified(i);
+	}
 
 	Vector3i new_size(sx, sy, sz);
 	if (new_size != _size) {
+		// Set first, filling channels depends on it
+		_size = new_size;
+		_tile_counts = (_size + Vector3i(TILE_MASK)) >> TILE_SIZE_PO2;
+		// Slots of the slab were sized for the previous size
+		release_slab_claim();
 		for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
 			Channel &channel = _channels[i];
 			if (channel.data) {
@@ -137,7 +761,6 @@ void VoxelBuffer::create(unsigned int sx, unsigned int sy, unsigned int sz) {
 				create_channel(i, new_size, channel.defval);
 			}
 		}
-		_size = new_size;
 	}
 }
 
@@ -152,17 +775,26 @@ void VoxelBuffer::clear() {
 			delete_channel(i);
 		}
 	}
+	release_slab_claim();
 	_size = Vector3i();
 	clear_voxel_metadata();
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		mark_channel_modified(i);
+	}
 }
 
 void VoxelBuffer::clear_channel(unsigned int channel_index, uint64_t clear_value) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	make_channel_uniform(channel_index, clear_value);
+	mark_channel_modified(channel_index);
+}
+
+void VoxelBuffer::make_channel_uniform(unsigned int channel_index, uint64_t value) {
 	Channel &channel = _channels[channel_index];
 	if (channel.data) {
 		delete_channel(channel_index);
 	}
-	channel.defval = clamp_value_for_depth(clear_value, channel.depth);
+	channel.defval = clamp_value_for_depth(value, channel.depth);
 }
 
 void VoxelBuffer::clear_channel_f(unsigned int channel_index, real_t clear_value) {
@@ -174,6 +806,7 @@ void VoxelBuffer::clear_channel_f(unsigned int channel_index, real_t clear_value
 void VoxelBuffer::set_default_values(FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> values) {
 	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
 		_channels[i].defval = clamp_value_for_depth(values[i], _channels[i].depth);
+		mark_channel_modified(i);
 	}
 }
 
@@ -183,7 +816,15 @@ uint64_t VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index)
 	const Channel &channel = _channels[channel_index];
 
 	if (is_position_valid(x, y, z) && channel.data) {
-		uint32_t i = index(x, y, z);
+		if (channel.compression == COMPRESSION_SPARSE) {
+			return get_sparse_value(channel.data, channel.depth, x, y, z);
+		}
+
+		if (channel.compression != COMPRESSION_NONE) {
+			return get_compressed_value(channel.data, channel.compression, channel.depth, index(x, y, z));
+		}
+
+		const uint32_t i = data_index(x, y, z);
 
 		switch (channel.depth) {
 			case DEPTH_8_BIT:
@@ -203,8 +844,6 @@ uint64_t VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index)
 				return 0;
 		}
 
-		return channel.data[index(x, y, z)];
-
 	} else {
 		return channel.defval;
 	}
@@ -221,15 +860,30 @@ void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int ch
 
 	if (channel.data == nullptr) {
 		if (channel.defval != value) {
-			// Allocate channel with same initial values as defval
-			create_channel(channel_index, _size, channel.defval);
+			if (_sparse_bricks_enabled && can_use_sparse_bricks()) {
+				// Only the brick containing the voxel will be allocated
+				create_sparse_channel(channel_index);
+			} else {
+				// Allocate channel with same initial values as defval
+				create_channel(channel_index, _size, channel.defval);
+			}
 		} else {
 			do_set = false;
 		}
 	}
 
+	if (do_set && (channel.compression == COMPRESSION_SPARSE ||
+						  (channel.compression != COMPRESSION_NONE && _sparse_bricks_enabled && can_use_sparse_bricks()))) {
+		make_sparse_channel_unique(channel_index);
+		set_sparse_value(channel.data, channel.depth, x, y, z, value);
+		mark_channel_modified(channel_index);
+		do_set = false;
+	}
+
 	if (do_set) {
-		uint32_t i = index(x, y, z);
+		mark_channel_modified(channel_index);
+		make_channel_unique(channel_index);
+		const uint32_t i = data_index(x, y, z);
 
 		switch (channel.depth) {
 			case DEPTH_8_BIT:
@@ -280,11 +934,21 @@ void VoxelBuffer::fill(uint64_t defval, unsigned int channel_index) {
 		} else {
 			// Just change default value
 			channel.defval = defval;
+			mark_channel_modified(channel_index);
 			return;
 		}
 	}
 
-	unsigned int volume = get_volume();
+	mark_channel_modified(channel_index);
+
+	if (channel.shared_refs != nullptr || channel.compression != COMPRESSION_NONE) {
+		// Data is going to be overwritten entirely, no need to copy or decompress it
+		delete_channel(channel_index);
+		create_channel_noinit(channel_index, _size);
+	}
+
+	// Tiled channels get their padding filled too
+	unsigned int volume = get_data_volume();
 
 	switch (channel.depth) {
 		case DEPTH_8_BIT:
@@ -339,43 +1003,46 @@ void VoxelBuffer::fill_area(uint64_t defval, Vector3i min, Vector3i max, unsigne
 		}
 	}
 
-	Vector3i pos;
-	unsigned int volume = get_volume();
-	for (pos.z = min.z; pos.z < max.z; ++pos.z) {
-		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
-			unsigned int dst_ri = index(pos.x, pos.y + min.y, pos.z);
-			CRASH_COND(dst_ri >= volume);
-
-			switch (channel.depth) {
-				case DEPTH_8_BIT:
-					// Fill row by row
-					memset(&channel.data[dst_ri], defval, area_size.y * sizeof(uint8_t));
-					break;
+	make_channel_unique(channel_index);
+	mark_channel_modified(channel_index);
 
-				case DEPTH_16_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint16_t *)channel.data)[dst_ri + i] = defval;
-					}
-					break;
+	uint8_t *data = channel.data;
+	const Depth depth = channel.depth;
+	const unsigned int volume = get_data_volume();
 
-				case DEPTH_32_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint32_t *)channel.data)[dst_ri + i] = defval;
-					}
-					break;
+	// Fill run by run
+	for_each_data_run(Rect3i(min, area_size), [data, depth, defval, volume](Vector3i pos, unsigned int dst_ri,
+													   unsigned int count) {
+		CRASH_COND(dst_ri + count > volume);
 
-				case DEPTH_64_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint64_t *)channel.data)[dst_ri + i] = defval;
-					}
-					break;
+		switch (depth) {
+			case DEPTH_8_BIT:
+				memset(&data[dst_ri], defval, count * sizeof(uint8_t));
+				break;
 
-				default:
-					CRASH_NOW();
-					break;
-			}
+			case DEPTH_16_BIT:
+				for (unsigned int i = 0; i < count; ++i) {
+					((uint16_t *)data)[dst_ri + i] = defval;
+				}
+				break;
+
+			case DEPTH_32_BIT:
+				for (unsigned int i = 0; i < count; ++i) {
+					((uint32_t *)data)[dst_ri + i] = defval;
+				}
+				break;
+
+			case DEPTH_64_BIT:
+				for (unsigned int i = 0; i < count; ++i) {
+					((uint64_t *)data)[dst_ri + i] = defval;
+				}
+				break;
+
+			default:
+				CRASH_NOW();
+				break;
 		}
-	}
+	});
 }
 
 void VoxelBuffer::fill_f(real_t value, unsigned int channel) {
@@ -403,8 +1070,13 @@ bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
 		// Channel has been optimized
 		return true;
 	}
+	if (channel.compression != COMPRESSION_NONE) {
+		// Uniform channels are never compressed in other ways
+		return false;
+	}
 
-	unsigned int volume = get_volume();
+	// Padding of tiles is included. It only holds fill values, so it can only make this return false.
+	unsigned int volume = get_data_volume();
 
 	// Channel isn't optimized, so must look at each voxel
 	switch (channel.depth) {
@@ -427,7 +1099,7 @@ bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
 void VoxelBuffer::compress_uniform_channels() {
 	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
 		if (_channels[i].data && is_uniform(i)) {
-			clear_channel(i, _channels[i].data[0]);
+			make_channel_uniform(i, _channels[i].data[0]);
 		}
 	}
 }
@@ -437,7 +1109,11 @@ void VoxelBuffer::decompress_channel(unsigned int channel_index) {
 	Channel &channel = _channels[channel_index];
 	if (channel.data == nullptr) {
 		create_channel(channel_index, _size, channel.defval);
+	} else {
+		make_channel_unique(channel_index);
 	}
+	// This is how callers get to write into channels
+	mark_channel_modified(channel_index);
 }
 
 VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int channel_index) const {
@@ -446,10 +1122,273 @@ VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int chann
 	if (channel.data == nullptr) {
 		return COMPRESSION_UNIFORM;
 	}
-	return COMPRESSION_NONE;
+	return channel.compression;
+}
+
+void VoxelBuffer::compress_channels() {
+	if (_layout != LAYOUT_LINEAR) {
+		// Encodings follow the order of `index()`
+		return;
+	}
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &channel = _channels[i];
+		// Sparse channels may have more uniform bricks since they were made, or be better off in another form
+		if (channel.data != nullptr &&
+				(channel.compression == COMPRESSION_NONE || channel.compression == COMPRESSION_SPARSE)) {
+			compress_channel(i);
+		}
+	}
+}
+
+void VoxelBuffer::compress_channel(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.data == nullptr);
+	CRASH_COND(channel.compression != COMPRESSION_NONE && channel.compression != COMPRESSION_SPARSE);
+
+	const uint32_t volume = get_volume();
+	const Depth depth = channel.depth;
+	const uint32_t value_size = ::get_depth_bit_count(depth) >> 3;
+
+	const uint8_t *src = channel.data;
+	uint32_t current_size = channel.size_in_bytes;
+	std::vector<uint8_t> decoded;
+	if (channel.compression == COMPRESSION_SPARSE) {
+		current_size = get_sparse_channel_memory_usage(channel.data);
+		decoded.resize(get_size_in_bytes_for_volume(_size, depth));
+		decode_channel_data(channel.data, channel.compression, depth, 0, volume, decoded.data());
+		src = decoded.data();
+	}
+
+	// Count runs and distinct values first, to find which encoding is the smallest.
+	// A new value can only appear where a run starts, so values don't have to be looked up for every voxel.
+	uint32_t run_count = 1;
+	std::vector<uint64_t> palette;
+	bool palette_full = false;
+	uint64_t prev_value = read_raw_value(src, 0, depth);
+	palette.push_back(prev_value);
+
+	for (uint32_t i = 1; i < volume; ++i) {
+		const uint64_t v = read_raw_value(src, i, depth);
+		if (v != prev_value) {
+			++run_count;
+			prev_value = v;
+			if (!palette_full) {
+				// Kept sorted so it can be searched quickly
+				std::vector<uint64_t>::iterator it = std::lower_bound(palette.begin(), palette.end(), v);
+				if (it == palette.end() || *it != v) {
+					if (palette.size() == MAX_PALETTE_SIZE) {
+						palette_full = true;
+					} else {
+						palette.insert(it, v);
+					}
+				}
+			}
+		}
+	}
+
+	if (run_count == 1) {
+		make_channel_uniform(channel_index, prev_value);
+		return;
+	}
+
+	const uint32_t rle_size =
+			COMPRESSED_HEADER_SIZE + get_padded_values_size(run_count, value_size) + run_count * sizeof(uint32_t);
+
+	uint32_t palette_bits = 0;
+	uint32_t palette_data_size = 0xffffffff;
+	if (!palette_full) {
+		palette_bits = get_palette_index_bits(palette.size());
+		palette_data_size = COMPRESSED_HEADER_SIZE + get_padded_values_size(palette.size(), value_size) +
+							(volume * palette_bits + 7) / 8;
+	}
+
+	uint32_t sparse_size = 0xffffffff;
+	if (_sparse_bricks_enabled && can_use_sparse_bricks()) {
+		const Vector3i brick_counts = _size >> BRICK_SIZE_PO2;
+		const uint32_t brick_size_in_bytes = BRICK_VOLUME * value_size;
+		sparse_size = get_sparse_table_size(brick_counts.volume());
+		Vector3i bpos;
+		for (bpos.z = 0; bpos.z < brick_counts.z; ++bpos.z) {
+			for (bpos.x = 0; bpos.x < brick_counts.x; ++bpos.x) {
+				for (bpos.y = 0; bpos.y < brick_counts.y; ++bpos.y) {
+					uint64_t v;
+					if (!is_brick_uniform(src, depth, _size, bpos * BRICK_SIZE, v)) {
+						sparse_size += brick_size_in_bytes;
+					}
+				}
+			}
+		}
+	}
+
+	// Sparse bricks win ties, because they don't need to be decompressed when modified
+	Compression compression = palette_data_size < rle_size ? COMPRESSION_PALETTE : COMPRESSION_RLE;
+	uint32_t size_in_bytes = MIN(rle_size, palette_data_size);
+	if (sparse_size <= size_in_bytes) {
+		compression = COMPRESSION_SPARSE;
+		size_in_bytes = sparse_size;
+	}
+	if (size_in_bytes >= current_size) {
+		// Not worth it
+		return;
+	}
+
+	if (compression == COMPRESSION_SPARSE) {
+		uint8_t *data = encode_sparse_channel_data(src, depth, _size);
+		// Data may be shared with snapshots, which keep using the previous version
+		delete_channel(channel_index);
+		channel.data = data;
+		channel.size_in_bytes = get_sparse_table_size(get_sparse_brick_count(get_sparse_header(data)));
+		channel.compression = COMPRESSION_SPARSE;
+		return;
+	}
+
+	uint8_t *data = allocate_compressed_channel_data(size_in_bytes);
+	// Indices are packed with bitwise OR, and padding is better left clean
+	memset(data, 0, size_in_bytes);
+	uint32_t *header = (uint32_t *)data;
+	uint8_t *values = data + COMPRESSED_HEADER_SIZE;
+
+	if (compression == COMPRESSION_RLE) {
+		header[0] = run_count;
+		uint32_t *run_ends = (uint32_t *)(values + get_padded_values_size(run_count, value_size));
+		uint32_t run_index = 0;
+		uint64_t run_value = read_raw_value(src, 0, depth);
+
+		for (uint32_t i = 1; i < volume; ++i) {
+			const uint64_t v = read_raw_value(src, i, depth);
+			if (v != run_value) {
+				write_raw_value(values, run_index, depth, run_value);
+				run_ends[run_index] = i;
+				++run_index;
+				run_value = v;
+			}
+		}
+
+		write_raw_value(values, run_index, depth, run_value);
+		run_ends[run_index] = volume;
+		CRASH_COND(run_index + 1 != run_count);
+
+	} else {
+		header[0] = palette.size();
+		header[1] = palette_bits;
+		for (uint32_t i = 0; i < palette.size(); ++i) {
+			write_raw_value(values, i, depth, palette[i]);
+		}
+
+		uint8_t *indices = values + get_padded_values_size(palette.size(), value_size);
+		const uint32_t indices_per_byte = 8 / palette_bits;
+		uint64_t cached_value = palette[0];
+		uint32_t cached_index = 0;
+
+		for (uint32_t i = 0; i < volume; ++i) {
+			const uint64_t v = read_raw_value(src, i, depth);
+			if (v != cached_value) {
+				cached_index = std::lower_bound(palette.begin(), palette.end(), v) - palette.begin();
+				cached_value = v;
+			}
+			indices[i / indices_per_byte] |= cached_index << ((i % indices_per_byte) * palette_bits);
+		}
+	}
+
+	// Data may be shared with snapshots, which keep using the uncompressed version
+	delete_channel(channel_index);
+	channel.data = data;
+	channel.size_in_bytes = size_in_bytes;
+	channel.compression = compression;
+}
+
+void VoxelBuffer::set_sparse_bricks_enabled(bool enabled) {
+	_sparse_bricks_enabled = enabled;
+}
+
+bool VoxelBuffer::can_use_sparse_bricks() const {
+	// A single brick would not save anything
+	return _layout == LAYOUT_LINEAR && (_size.x & BRICK_MASK) == 0 && (_size.y & BRICK_MASK) == 0 && (_size.z & BRICK_MASK) == 0 &&
+		   get_volume() > BRICK_VOLUME;
+}
+
+void VoxelBuffer::create_sparse_channel(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.data != nullptr);
+	channel.data = allocate_sparse_channel_data(_size, channel.depth, channel.defval);
+	channel.size_in_bytes = get_sparse_table_size(get_sparse_brick_count(get_sparse_header(channel.data)));
+	channel.compression = COMPRESSION_SPARSE;
+}
+
+void VoxelBuffer::make_sparse_channel_unique(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.data == nullptr);
+
+	if (channel.compression == COMPRESSION_SPARSE) {
+		if (channel.shared_refs == nullptr) {
+			return;
+		}
+		if (channel.shared_refs->get() == 1) {
+			// Snapshots were released, the data is ours again
+			memdelete(channel.shared_refs);
+			channel.shared_refs = nullptr;
+			return;
+		}
+		uint8_t *data = duplicate_sparse_channel_data(channel.data);
+		delete_channel(channel_index);
+		channel.data = data;
+		channel.size_in_bytes = get_sparse_table_size(get_sparse_brick_count(get_sparse_header(data)));
+		channel.compression = COMPRESSION_SPARSE;
+		return;
+	}
+
+	// Converting from another form, only bricks having different values get allocated
+	std::vector<uint8_t> decoded;
+	const uint8_t *src = channel.data;
+	if (channel.compression != COMPRESSION_NONE) {
+		decoded.resize(get_size_in_bytes_for_volume(_size, channel.depth));
+		decode_channel_data(channel.data, channel.compression, channel.depth, 0, get_volume(), decoded.data());
+		src = decoded.data();
+	}
+	uint8_t *data = encode_sparse_channel_data(src, channel.depth, _size);
+	delete_channel(channel_index);
+	channel.data = data;
+	channel.size_in_bytes = get_sparse_table_size(get_sparse_brick_count(get_sparse_header(data)));
+	channel.compression = COMPRESSION_SPARSE;
+}
+
+void VoxelBuffer::take_compressed_channels(const VoxelBuffer &snapshot, VoxelBuffer &compressed) {
+	ERR_FAIL_COND(snapshot._size != _size);
+	ERR_FAIL_COND(compressed._size != _size);
+
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &snapshot_channel = snapshot._channels[i];
+		Channel &compressed_channel = compressed._channels[i];
+
+		if (_channels[i].data == nullptr || _channels[i].data != snapshot_channel.data) {
+			// Uniform, or modified since the snapshot was taken.
+			// The snapshot still references its data, so the address can't have been reused in between.
+			continue;
+		}
+
+		if (compressed_channel.data == nullptr) {
+			// Turned out to be uniform
+			make_channel_uniform(i, compressed_channel.defval);
+
+		} else if (compressed_channel.data != snapshot_channel.data) {
+			// Got compressed. Otherwise it was not worth it, or was already compressed, and is still shared.
+			CRASH_COND(compressed_channel.shared_refs != nullptr);
+			delete_channel(i);
+			Channel &channel = _channels[i];
+			channel.data = compressed_channel.data;
+			channel.size_in_bytes = compressed_channel.size_in_bytes;
+			channel.compression = compressed_channel.compression;
+			compressed_channel.data = nullptr;
+			compressed_channel.size_in_bytes = 0;
+			compressed_channel.compression = COMPRESSION_NONE;
+		}
+	}
 }
 
 void VoxelBuffer::copy_from(const VoxelBuffer &other) {
+	if (copy_slab_from(other)) {
+		return;
+	}
 	// Copy all channels, assuming sizes and formats match
 	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
 		copy_from(other, i);
@@ -465,9 +1404,41 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, unsigned int channel_index
 
 	ERR_FAIL_COND(other_channel.depth != channel.depth);
 
-	if (other_channel.data != nullptr) {
+	if (other_channel.data != nullptr && other._layout != _layout) {
+		// Voxels have to be rearranged
+		std::vector<uint8_t> decoded(get_size_in_bytes_for_volume(_size, channel.depth));
+		other.decode_channel_raw(channel_index, ArraySlice<uint8_t>(decoded, 0, decoded.size()));
+		if (channel.data != nullptr) {
+			delete_channel(channel_index);
+		}
+		create_channel_noinit(channel_index, _size);
+		encode_channel_raw(channel_index, decoded.data());
+
+	} else if (other_channel.compression == COMPRESSION_SPARSE) {
+		// Bricks are owned by the table, so they have to be copied too
+		if (channel.data != nullptr) {
+			delete_channel(channel_index);
+		}
+		channel.data = duplicate_sparse_channel_data(other_channel.data);
+		channel.size_in_bytes = other_channel.size_in_bytes;
+		channel.compression = COMPRESSION_SPARSE;
+
+	} else if (other_channel.data != nullptr) {
+		if (channel.data != nullptr &&
+				(channel.shared_refs != nullptr || channel.compression != other_channel.compression ||
+						channel.size_in_bytes != other_channel.size_in_bytes)) {
+			// Data is going to be overwritten entirely, no need to copy it
+			delete_channel(channel_index);
+		}
 		if (channel.data == nullptr) {
-			create_channel_noinit(channel_index, _size);
+			if (other_channel.compression == COMPRESSION_NONE) {
+				create_channel_noinit(channel_index, _size);
+			} else {
+				// Compressed data is copied as is
+				channel.data = allocate_compressed_channel_data(other_channel.size_in_bytes);
+				channel.size_in_bytes = other_channel.size_in_bytes;
+				channel.compression = other_channel.compression;
+			}
 		}
 		CRASH_COND(channel.size_in_bytes != other_channel.size_in_bytes);
 		memcpy(channel.data, other_channel.data, channel.size_in_bytes);
@@ -478,6 +1449,7 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, unsigned int channel_index
 
 	channel.defval = other_channel.defval;
 	channel.depth = other_channel.depth;
+	mark_channel_modified(channel_index);
 }
 
 void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i src_max, Vector3i dst_min, unsigned int channel_index) {
@@ -513,21 +1485,40 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 				create_channel(channel_index, _size, channel.defval);
 			}
 
-			if (channel.depth == DEPTH_8_BIT) {
+			make_channel_unique(channel_index);
+			mark_channel_modified(channel_index);
+
+			if (channel.depth == other_channel.depth) {
 				// Native format
-				// Copy row by row
-				Vector3i pos;
-				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
-					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-						// Row direction is Y
-						unsigned int src_ri = other.index(pos.x + src_min.x, pos.y + src_min.y, pos.z + src_min.z);
-						unsigned int dst_ri = index(pos.x + dst_min.x, pos.y + dst_min.y, pos.z + dst_min.z);
-						memcpy(&channel.data[dst_ri], &other_channel.data[src_ri], area_size.y * sizeof(uint8_t));
-					}
-				}
+				// Copy run by run, along Y
+				const Depth depth = channel.depth;
+				const uint32_t value_size = ::get_depth_bit_count(depth) >> 3;
+				const Vector3i src_offset = src_min - dst_min;
+				uint8_t *dst_data = channel.data;
+
+				for_each_data_run(Rect3i(dst_min, area_size),
+						[&other, &other_channel, src_offset, depth, value_size, dst_data](
+								Vector3i dst_pos, unsigned int dst_ri, unsigned int count) {
+							const Vector3i src_pos = dst_pos + src_offset;
+
+							if (other._layout == LAYOUT_LINEAR) {
+								// Compressed rows are decoded directly into the destination
+								const unsigned int src_ri = other.index(src_pos.x, src_pos.y, src_pos.z);
+								decode_channel_data(other_channel.data, other_channel.compression, depth,
+										src_ri, count, &dst_data[dst_ri * value_size]);
+
+							} else {
+								// Tiles of the source may not line up with the destination
+								for (unsigned int i = 0; i < count; ++i) {
+									const unsigned int src_i = other.data_index(src_pos.x, src_pos.y + i, src_pos.z);
+									write_raw_value(dst_data, dst_ri + i, depth,
+											read_raw_value(other_channel.data, src_i, depth));
+								}
+							}
+						});
 
 			} else {
-				// TODO Optimized versions
+				// Depths differ, values have to be converted one by one
 				Vector3i pos;
 				for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
 					for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
@@ -550,7 +1541,10 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 
 Ref<VoxelBuffer> VoxelBuffer::duplicate(bool include_metadata) const {
 	VoxelBuffer *d = memnew(VoxelBuffer);
+	d->_layout = _layout;
+	d->_slab_channels_mask = _slab_channels_mask;
 	d->create(_size);
+	d->_sparse_bricks_enabled = _sparse_bricks_enabled;
 	for (unsigned int i = 0; i < _channels.size(); ++i) {
 		d->set_channel_depth(i, _channels[i].depth);
 	}
@@ -561,6 +1555,39 @@ Ref<VoxelBuffer> VoxelBuffer::duplicate(bool include_metadata) const {
 	return Ref<VoxelBuffer>(d);
 }
 
+Ref<VoxelBuffer> VoxelBuffer::snapshot(bool include_metadata) {
+	VoxelBuffer *d = memnew(VoxelBuffer);
+	d->_size = _size;
+	d->_sparse_bricks_enabled = _sparse_bricks_enabled;
+	d->_layout = _layout;
+	d->_tile_counts = _tile_counts;
+	// Same contents, so the same generations
+	d->_generation = _generation;
+	for (unsigned int i = 0; i < _channels.size(); ++i) {
+		Channel &channel = _channels[i];
+		Channel &dst_channel = d->_channels[i];
+		dst_channel.depth = channel.depth;
+		dst_channel.defval = channel.defval;
+		dst_channel.generation = channel.generation;
+		if (channel.data != nullptr) {
+			if (channel.shared_refs == nullptr) {
+				channel.shared_refs = memnew(SafeRefCount);
+				channel.shared_refs->init(1);
+			}
+			channel.shared_refs->ref();
+			dst_channel.data = channel.data;
+			dst_channel.size_in_bytes = channel.size_in_bytes;
+			dst_channel.compression = channel.compression;
+			dst_channel.shared_refs = channel.shared_refs;
+			dst_channel.slab = channel.slab;
+		}
+	}
+	if (include_metadata) {
+		d->copy_voxel_metadata(*this);
+	}
+	return Ref<VoxelBuffer>(d);
+}
+
 bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const {
 	const Channel &channel = _channels[channel_index];
 	if (channel.data != nullptr) {
@@ -571,6 +1598,193 @@ bool VoxelBuffer::get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t
 	return false;
 }
 
+void VoxelBuffer::decode_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> dst) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+	ERR_FAIL_COND(dst.size() != get_size_in_bytes_for_volume(_size, channel.depth));
+
+	if (channel.data == nullptr) {
+		const uint32_t volume = get_volume();
+		for (uint32_t i = 0; i < volume; ++i) {
+			write_raw_value(dst.data(), i, channel.depth, channel.defval);
+		}
+
+	} else if (channel.compression == COMPRESSION_NONE && _layout != LAYOUT_LINEAR) {
+		const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+		const uint8_t *src_data = channel.data;
+		uint8_t *dst_data = dst.data();
+		for_each_data_run(Rect3i(Vector3i(), _size),
+				[this, src_data, dst_data, value_size](Vector3i pos, unsigned int i, unsigned int count) {
+					memcpy(dst_data + index(pos.x, pos.y, pos.z) * value_size, src_data + i * value_size,
+							count * value_size);
+				});
+
+	} else {
+		decode_channel_data(channel.data, channel.compression, channel.depth, 0, get_volume(), dst.data());
+	}
+}
+
+void VoxelBuffer::encode_channel_raw(unsigned int channel_index, const uint8_t *src) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.data == nullptr);
+	CRASH_COND(channel.compression != COMPRESSION_NONE || channel.shared_refs != nullptr);
+
+	if (_layout == LAYOUT_LINEAR) {
+		memcpy(channel.data, src, channel.size_in_bytes);
+		return;
+	}
+
+	// Padding of border tiles has no source, don't leave it uninitialized
+	memset(channel.data, 0, channel.size_in_bytes);
+
+	const uint32_t value_size = ::get_depth_bit_count(channel.depth) >> 3;
+	uint8_t *dst_data = channel.data;
+	for_each_data_run(Rect3i(Vector3i(), _size),
+			[this, src, dst_data, value_size](Vector3i pos, unsigned int i, unsigned int count) {
+				memcpy(dst_data + i * value_size, src + index(pos.x, pos.y, pos.z) * value_size, count * value_size);
+			});
+}
+
+void VoxelBuffer::set_slab_channels(uint32_t channels_mask) {
+	channels_mask &= (1 << MAX_CHANNELS) - 1;
+	if (channels_mask == _slab_channels_mask) {
+		return;
+	}
+	// Channels already in the slab stay there, but new ones go to a slab made for the new mask
+	release_slab_claim();
+	_slab_channels_mask = channels_mask;
+}
+
+void VoxelBuffer::create_slab() {
+	CRASH_COND(_slab != nullptr);
+
+	uint32_t size_in_bytes = 0;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		if ((_slab_channels_mask & (1 << i)) != 0) {
+			_slab_offsets[i] = size_in_bytes;
+			size_in_bytes += get_data_size_in_bytes(_size, _channels[i].depth);
+			size_in_bytes = (size_in_bytes + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1);
+		}
+	}
+
+	_slab = memnew(Slab);
+	_slab->allocation = allocate_channel_data(get_slab_allocation_size(size_in_bytes));
+	_slab->data = get_aligned_slab_data(_slab->allocation);
+	_slab->size_in_bytes = size_in_bytes;
+	// Claim of this buffer
+	_slab->refs.init(1);
+	_slab_free_mask = _slab_channels_mask;
+}
+
+void VoxelBuffer::release_slab_claim() {
+	if (_slab != nullptr) {
+		release_slab(_slab);
+		_slab = nullptr;
+	}
+	_slab_free_mask = 0;
+}
+
+void VoxelBuffer::release_slab(Slab *slab) {
+	// Snapshots may release channels from other threads
+	if (slab->refs.unref()) {
+		free_channel_data(slab->allocation, get_slab_allocation_size(slab->size_in_bytes));
+		memdelete(slab);
+	}
+}
+
+void VoxelBuffer::free_channel_memory(uint8_t *data, uint32_t size_in_bytes, Compression compression, Slab *slab) {
+	if (slab != nullptr) {
+		release_slab(slab);
+	} else {
+		free_channel_data(data, size_in_bytes, compression);
+	}
+}
+
+bool VoxelBuffer::copy_slab_from(const VoxelBuffer &other) {
+	if (other._size != _size || other._layout != _layout) {
+		return false;
+	}
+
+	const Slab *other_slab = nullptr;
+	unsigned int channel_count = 0;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &other_channel = other._channels[i];
+		if (other_channel.depth != _channels[i].depth) {
+			return false;
+		}
+		if (other_channel.data != nullptr) {
+			if (other_channel.slab == nullptr || (other_slab != nullptr && other_channel.slab != other_slab)) {
+				return false;
+			}
+			other_slab = other_channel.slab;
+			++channel_count;
+		}
+	}
+
+	if (other_slab == nullptr) {
+		return false;
+	}
+
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		if (_channels[i].data != nullptr) {
+			delete_channel(i);
+		}
+	}
+
+	// Unused slots are copied too, that's still one copy
+	Slab *slab = memnew(Slab);
+	slab->allocation = allocate_channel_data(get_slab_allocation_size(other_slab->size_in_bytes));
+	slab->data = get_aligned_slab_data(slab->allocation);
+	slab->size_in_bytes = other_slab->size_in_bytes;
+	slab->refs.init(channel_count);
+	memcpy(slab->data, other_slab->data, slab->size_in_bytes);
+
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &other_channel = other._channels[i];
+		Channel &channel = _channels[i];
+		channel.defval = other_channel.defval;
+		if (other_channel.data != nullptr) {
+			channel.data = slab->data + (other_channel.data - other_slab->data);
+			channel.size_in_bytes = other_channel.size_in_bytes;
+			channel.compression = COMPRESSION_NONE;
+			channel.slab = slab;
+		}
+		mark_channel_modified(i);
+	}
+
+	return true;
+}
+
+void VoxelBuffer::set_layout(Layout layout) {
+	ERR_FAIL_INDEX(layout, LAYOUT_COUNT);
+	if (layout == _layout) {
+		return;
+	}
+
+	// Voxels are taken out in the order of `index()`, then stored back with the new layout.
+	// Compressed channels end up uncompressed.
+	FixedArray<std::vector<uint8_t>, MAX_CHANNELS> decoded;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &channel = _channels[i];
+		if (channel.data != nullptr) {
+			decoded[i].resize(get_size_in_bytes_for_volume(_size, channel.depth));
+			decode_channel_raw(i, ArraySlice<uint8_t>(decoded[i], 0, decoded[i].size()));
+			delete_channel(i);
+		}
+	}
+
+	_layout = layout;
+	// Slots of the slab were sized for the previous layout
+	release_slab_claim();
+
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		if (decoded[i].size() != 0) {
+			create_channel_noinit(i, _size);
+			encode_channel_raw(i, decoded[i].data());
+		}
+	}
+}
+
 void VoxelBuffer::create_channel(int i, Vector3i size, uint64_t defval) {
 	create_channel_noinit(i, size);
 	fill(defval, i);
@@ -584,10 +1798,36 @@ uint32_t VoxelBuffer::get_size_in_bytes_for_volume(Vector3i size, Depth depth) {
 	return size_in_bytes;
 }
 
+uint32_t VoxelBuffer::get_data_size_in_bytes(Vector3i size, Depth depth) const {
+	if (_layout == LAYOUT_TILED) {
+		// Border tiles are allocated entirely
+		size = ((size + Vector3i(TILE_MASK)) >> TILE_SIZE_PO2) << TILE_SIZE_PO2;
+	}
+	return get_size_in_bytes_for_volume(size, depth);
+}
+
 void VoxelBuffer::create_channel_noinit(int i, Vector3i size) {
 	Channel &channel = _channels[i];
-	uint32_t size_in_bytes = get_size_in_bytes_for_volume(size, channel.depth);
+	uint32_t size_in_bytes = get_data_size_in_bytes(size, channel.depth);
 	CRASH_COND(channel.data != nullptr);
+
+	if ((_slab_channels_mask & (1 << i)) != 0 && size == _size) {
+		if ((_slab_free_mask & (1 << i)) == 0) {
+			// The slot of this channel was used already
+			release_slab_claim();
+			create_slab();
+		}
+		channel.data = _slab->data + _slab_offsets[i];
+		channel.size_in_bytes = size_in_bytes;
+		channel.slab = _slab;
+		_slab->refs.ref();
+		_slab_free_mask &= ~(1 << i);
+		if (_slab_free_mask == 0) {
+			release_slab_claim();
+		}
+		return;
+	}
+
 	channel.data = allocate_channel_data(size_in_bytes);
 	channel.size_in_bytes = size_in_bytes;
 }
@@ -595,12 +1835,84 @@ void VoxelBuffer::create_channel_noinit(int i, Vector3i size) {
 void VoxelBuffer::delete_channel(int i) {
 	Channel &channel = _channels[i];
 	ERR_FAIL_COND(channel.data == nullptr);
-	free_channel_data(channel.data, channel.size_in_bytes);
+	if (channel.shared_refs != nullptr) {
+		// Other buffers may still use the data, the last one frees it
+		if (channel.shared_refs->unref()) {
+			free_channel_memory(channel.data, channel.size_in_bytes, channel.compression, channel.slab);
+			memdelete(channel.shared_refs);
+		}
+		channel.shared_refs = nullptr;
+	} else {
+		free_channel_memory(channel.data, channel.size_in_bytes, channel.compression, channel.slab);
+	}
 	channel.data = nullptr;
+	channel.slab = nullptr;
 	channel.size_in_bytes = 0;
+	channel.compression = COMPRESSION_NONE;
+}
+
+void VoxelBuffer::unshare_channel(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+
+	if (channel.compression != COMPRESSION_NONE) {
+		// Compressed data is read-only, decode it into a new array
+		const uint32_t size_in_bytes = get_size_in_bytes_for_volume(_size, channel.depth);
+		uint8_t *data = allocate_channel_data(size_in_bytes);
+		decode_channel_data(channel.data, channel.compression, channel.depth, 0, get_volume(), data);
+		delete_channel(channel_index);
+		channel.data = data;
+		channel.size_in_bytes = size_in_bytes;
+		return;
+	}
+
+	CRASH_COND(channel.shared_refs == nullptr);
+
+	if (channel.shared_refs->get() == 1) {
+		// Snapshots were released, the data is ours again.
+		// No other buffer can reference it anymore, so this can't race with them.
+		memdelete(channel.shared_refs);
+		channel.shared_refs = nullptr;
+		return;
+	}
+
+	uint8_t *data = allocate_channel_data(channel.size_in_bytes);
+	memcpy(data, channel.data, channel.size_in_bytes);
+
+	if (channel.shared_refs->unref()) {
+		// Snapshots were released while we were copying
+		free_channel_memory(channel.data, channel.size_in_bytes, channel.compression, channel.slab);
+		memdelete(channel.shared_refs);
+	}
+
+	channel.data = data;
+	channel.shared_refs = nullptr;
+	// The copy is a separate allocation
+	channel.slab = nullptr;
+}
+
+VoxelBuffer::DownscaleFilter VoxelBuffer::get_default_downscale_filter(unsigned int channel_index) {
+	switch (channel_index) {
+		case CHANNEL_SDF:
+			return DOWNSCALE_AVERAGE;
+		case CHANNEL_TYPE:
+			return DOWNSCALE_MODE;
+		default:
+			return DOWNSCALE_NEAREST;
+	}
 }
 
 void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const {
+	for (unsigned int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+		downscale_channel_to(dst, channel_index, src_min, src_max, dst_min,
+				get_default_downscale_filter(channel_index));
+	}
+}
+
+void VoxelBuffer::downscale_channel_to(VoxelBuffer &dst, unsigned int channel_index,
+		Vector3i src_min, Vector3i src_max, Vector3i dst_min, DownscaleFilter filter) const {
+
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	ERR_FAIL_INDEX(filter, DOWNSCALE_FILTER_COUNT);
 	// TODO Align input to multiple of two
 
 	src_min.clamp_to(Vector3i(), _size);
@@ -611,38 +1923,55 @@ void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_
 	dst_min.clamp_to(Vector3i(), dst._size);
 	dst_max.clamp_to(Vector3i(), dst._size + Vector3i(1));
 
-	for (int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
-		const Channel &src_channel = _channels[channel_index];
-		const Channel &dst_channel = dst._channels[channel_index];
+	if (dst_max.x <= dst_min.x || dst_max.y <= dst_min.y || dst_max.z <= dst_min.z) {
+		return;
+	}
 
-		if (src_channel.data == nullptr && dst_channel.data == nullptr && src_channel.defval == dst_channel.defval) {
-			// No action needed
-			continue;
-		}
+	const Channel &src_channel = _channels[channel_index];
+	Channel &dst_channel = dst._channels[channel_index];
 
-		// Nearest-neighbor downscaling
+	if (src_channel.data == nullptr) {
+		// Every filter gives the same value. This doesn't allocate if the destination has it already.
+		dst.fill_area(src_channel.defval, dst_min, dst_max, channel_index);
+		return;
+	}
 
+	if (src_channel.depth != dst_channel.depth) {
+		// Values have to be converted one by one
 		Vector3i pos;
 		for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
 			for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
 				for (pos.y = dst_min.y; pos.y < dst_max.y; ++pos.y) {
 					const Vector3i src_pos = src_min + ((pos - dst_min) << 1);
-
-					// TODO Remove check once it works
-					CRASH_COND(!is_position_valid(src_pos.x, src_pos.y, src_pos.z));
-
-					uint64_t v;
-					if (src_channel.data) {
-						// TODO Optimized version?
-						v = get_voxel(src_pos, channel_index);
-					} else {
-						v = src_channel.defval;
-					}
-
-					dst.set_voxel(v, pos, channel_index);
+					dst.set_voxel(get_voxel(src_pos, channel_index), pos, channel_index);
 				}
 			}
 		}
+		return;
+	}
+
+	dst.decompress_channel(channel_index);
+
+	switch (src_channel.depth) {
+		case DEPTH_8_BIT:
+			downscale_channel<uint8_t>(filter, *this, src_channel.data, src_channel.compression, src_channel.depth,
+					src_min, dst, dst_channel.data, dst_min, dst_max);
+			break;
+		case DEPTH_16_BIT:
+			downscale_channel<uint16_t>(filter, *this, src_channel.data, src_channel.compression, src_channel.depth,
+					src_min, dst, dst_channel.data, dst_min, dst_max);
+			break;
+		case DEPTH_32_BIT:
+			downscale_channel<uint32_t>(filter, *this, src_channel.data, src_channel.compression, src_channel.depth,
+					src_min, dst, dst_channel.data, dst_min, dst_max);
+			break;
+		case DEPTH_64_BIT:
+			downscale_channel<uint64_t>(filter, *this, src_channel.data, src_channel.compression, src_channel.depth,
+					src_min, dst, dst_channel.data, dst_min, dst_max);
+			break;
+		default:
+			CRASH_NOW();
+			break;
 	}
 }
 
@@ -656,6 +1985,9 @@ Ref<VoxelTool> VoxelBuffer::get_voxel_tool() {
 bool VoxelBuffer::equals(const VoxelBuffer *p_other) const {
 	CRASH_COND(p_other == nullptr);
 
+	if (p_other == this) {
+		return true;
+	}
 	if (p_other->_size != _size) {
 		return false;
 	}
@@ -678,19 +2010,106 @@ bool VoxelBuffer::equals(const VoxelBuffer *p_other) const {
 				return false;
 			}
 
-		} else {
+		} else if (channel.data == other_channel.data && channel.compression == other_channel.compression &&
+				   _layout == p_other->_layout) {
+			// Shared by copy-on-write or snapshots, no need to look further
+
+		} else if (_layout != LAYOUT_LINEAR || p_other->_layout != LAYOUT_LINEAR) {
+			// Padding of tiles is not compared
+			const uint32_t volume = get_volume();
+			for (uint32_t i = 0; i < volume; ++i) {
+				const Vector3i pos = position_from_index(i);
+				if (get_voxel(pos, channel_index) != p_other->get_voxel(pos, channel_index)) {
+					return false;
+				}
+			}
+
+		} else if (channel.compression == COMPRESSION_NONE && other_channel.compression == COMPRESSION_NONE) {
 			CRASH_COND(channel.size_in_bytes != other_channel.size_in_bytes);
 			for (unsigned int i = 0; i < channel.size_in_bytes; ++i) {
 				if (channel.data[i] != other_channel.data[i]) {
 					return false;
 				}
 			}
+
+		} else {
+			const uint32_t volume = get_volume();
+			for (uint32_t i = 0; i < volume; ++i) {
+				const uint64_t v = channel.compression == COMPRESSION_NONE ?
+										   read_raw_value(channel.data, i, channel.depth) :
+										   get_compressed_value(channel.data, channel.compression, channel.depth, i);
+				const uint64_t other_v = other_channel.compression == COMPRESSION_NONE ?
+												 read_raw_value(other_channel.data, i, other_channel.depth) :
+												 get_compressed_value(other_channel.data, other_channel.compression,
+														 other_channel.depth, i);
+				if (v != other_v) {
+					return false;
+				}
+			}
 		}
 	}
 
 	return true;
 }
 
+size_t VoxelBuffer::get_memory_usage() const {
+	size_t size = 0;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &channel = _channels[i];
+		if (channel.data == nullptr) {
+			continue;
+		}
+		if (channel.compression == COMPRESSION_SPARSE) {
+			size += get_sparse_channel_memory_usage(channel.data);
+		} else {
+			size += channel.size_in_bytes;
+		}
+	}
+	return size;
+}
+
+uint64_t VoxelBuffer::get_channel_generation(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
+	return _channels[channel_index].generation;
+}
+
+uint64_t VoxelBuffer::get_channel_hash(unsigned int channel_index) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, 0);
+	const Channel &channel = _channels[channel_index];
+	const uint32_t volume = get_volume();
+
+	RunHasher hasher;
+
+	if (channel.data == nullptr) {
+		hasher.push(channel.defval, volume);
+		return hasher.finish();
+	}
+
+	const uint8_t *data = channel.data;
+	std::vector<uint8_t> decoded;
+	if (channel.compression != COMPRESSION_NONE || _layout != LAYOUT_LINEAR) {
+		decoded.resize(get_size_in_bytes_for_volume(_size, channel.depth));
+		decode_channel_raw(channel_index, ArraySlice<uint8_t>(decoded, 0, decoded.size()));
+		data = decoded.data();
+	}
+
+	for (uint32_t i = 0; i < volume; ++i) {
+		hasher.push(read_raw_value(data, i, channel.depth));
+	}
+	return hasher.finish();
+}
+
+uint64_t VoxelBuffer::get_hash() const {
+	uint64_t hash = hash_combine_64(0, _size.x);
+	hash = hash_combine_64(hash, _size.y);
+	hash = hash_combine_64(hash, _size.z);
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		hash = hash_combine_64(hash, _channels[i].depth);
+		hash = hash_combine_64(hash, get_channel_hash(i));
+	}
+	return hash;
+}
+
 void VoxelBuffer::set_channel_depth(unsigned int channel_index, Depth new_depth) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	ERR_FAIL_INDEX(new_depth, DEPTH_COUNT);
@@ -703,8 +2122,13 @@ void VoxelBuffer::set_channel_depth(unsigned int channel_index, Depth new_depth)
 		WARN_PRINT("Changing VoxelBuffer depth with present data, this will reset the channel");
 		delete_channel(channel_index);
 	}
+	if ((_slab_free_mask & (1 << channel_index)) != 0) {
+		// The slot was sized for the previous depth
+		release_slab_claim();
+	}
 	channel.defval = clamp_value_for_depth(channel.defval, new_depth);
 	channel.depth = new_depth;
+	mark_channel_modified(channel_index);
 }
 
 VoxelBuffer::Depth VoxelBuffer::get_channel_depth(unsigned int channel_index) const {
@@ -718,13 +2142,14 @@ uint32_t VoxelBuffer::get_depth_bit_count(Depth d) {
 
 void VoxelBuffer::set_block_metadata(Variant meta) {
 	_block_metadata = meta;
+	mark_modified();
 }
 
 Variant VoxelBuffer::get_voxel_metadata(Vector3i pos) const {
 	ERR_FAIL_COND_V(!is_position_valid(pos), Variant());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.find(pos);
-	if (elem != nullptr) {
-		return elem->value();
+	const Variant *v = _voxel_metadata.find(index(pos.x, pos.y, pos.z));
+	if (v != nullptr) {
+		return *v;
 	} else {
 		return Variant();
 	}
@@ -732,20 +2157,55 @@ Variant VoxelBuffer::get_voxel_metadata(Vector3i pos) const {
 
 void VoxelBuffer::set_voxel_metadata(Vector3i pos, Variant meta) {
 	ERR_FAIL_COND(!is_position_valid(pos));
+	const unsigned int i = index(pos.x, pos.y, pos.z);
 	if (meta.get_type() == Variant::NIL) {
-		_voxel_metadata.erase(pos);
+		_voxel_metadata.erase(i);
+	} else {
+		_voxel_metadata.set(i, meta);
+	}
+	mark_modified();
+}
+
+template <typename F>
+void VoxelBuffer::for_each_metadata_range_in_box(Rect3i box, F f) const {
+	box.clip(Rect3i(Vector3i(), _size));
+	if (box.size.x <= 0 || box.size.y <= 0 || box.size.z <= 0) {
+		return;
+	}
+
+	const unsigned int row_count = box.size.x * box.size.z;
+
+	if (row_count > _voxel_metadata.size()) {
+		// There are fewer entries than rows to look up, checking each of them is cheaper
+		for (unsigned int i = 0; i < _voxel_metadata.size(); ++i) {
+			if (box.contains(position_from_index(_voxel_metadata.get_key(i)))) {
+				f(i, i + 1);
+			}
+		}
+
 	} else {
-		_voxel_metadata[pos] = meta;
+		// Entries of a row along Y are contiguous
+		const Vector3i max_pos = box.pos + box.size;
+		for (int z = box.pos.z; z < max_pos.z; ++z) {
+			for (int x = box.pos.x; x < max_pos.x; ++x) {
+				const unsigned int row_begin = index(x, box.pos.y, z);
+				unsigned int begin;
+				unsigned int end;
+				_voxel_metadata.get_range(row_begin, row_begin + box.size.y, begin, end);
+				if (begin != end) {
+					f(begin, end);
+				}
+			}
+		}
 	}
 }
 
 void VoxelBuffer::for_each_voxel_metadata(Ref<FuncRef> callback) const {
 	ERR_FAIL_COND(callback.is_null());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
 
-	while (elem != nullptr) {
-		const Variant key = elem->key().to_vec3();
-		const Variant *args[2] = { &key, &elem->value() };
+	for (unsigned int i = 0; i < _voxel_metadata.size(); ++i) {
+		const Variant key = position_from_index(_voxel_metadata.get_key(i)).to_vec3();
+		const Variant *args[2] = { &key, &_voxel_metadata.get_value(i) };
 		Variant::CallError err;
 		callback->call_func(args, 2, err);
 
@@ -754,80 +2214,90 @@ void VoxelBuffer::for_each_voxel_metadata(Ref<FuncRef> callback) const {
 		// TODO Can't provide detailed error because FuncRef doesn't give us access to the object
 		// ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK, false,
 		// 		Variant::get_call_error_text(callback->get_object(), method_name, nullptr, 0, err));
-
-		elem = elem->next();
 	}
 }
 
 void VoxelBuffer::for_each_voxel_metadata_in_area(Ref<FuncRef> callback, Rect3i box) const {
 	ERR_FAIL_COND(callback.is_null());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
 
-	while (elem != nullptr) {
-		if (box.contains(elem->key())) {
-			const Variant key = elem->key().to_vec3();
-			const Variant *args[2] = { &key, &elem->value() };
-			Variant::CallError err;
-			callback->call_func(args, 2, err);
-
-			ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK,
-					String("FuncRef call failed at {0}").format(varray(key)));
-			// TODO Can't provide detailed error because FuncRef doesn't give us access to the object
-			// ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK, false,
-			// 		Variant::get_call_error_text(callback->get_object(), method_name, nullptr, 0, err));
+	// Entries are gathered first, because the callback could modify metadata
+	std::vector<uint32_t> keys;
+	for_each_metadata_range_in_box(box, [this, &keys](unsigned int begin, unsigned int end) {
+		for (unsigned int i = begin; i < end; ++i) {
+			keys.push_back(_voxel_metadata.get_key(i));
+		}
+	});
 
-			elem = elem->next();
+	for (unsigned int i = 0; i < keys.size(); ++i) {
+		const Variant *value = _voxel_metadata.find(keys[i]);
+		if (value == nullptr) {
+			continue;
 		}
+		const Variant key = position_from_index(keys[i]).to_vec3();
+		const Variant value_copy = *value;
+		const Variant *args[2] = { &key, &value_copy };
+		Variant::CallError err;
+		callback->call_func(args, 2, err);
+
+		ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK,
+				String("FuncRef call failed at {0}").format(varray(key)));
+		// TODO Can't provide detailed error because FuncRef doesn't give us access to the object
+		// ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK, false,
+		// 		Variant::get_call_error_text(callback->get_object(), method_name, nullptr, 0, err));
 	}
 }
 
 void VoxelBuffer::clear_voxel_metadata() {
 	_voxel_metadata.clear();
+	mark_modified();
 }
 
 void VoxelBuffer::clear_voxel_metadata_in_area(Rect3i box) {
-	Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
-	while (elem != nullptr) {
-		if (box.contains(elem->key())) {
-			Map<Vector3i, Variant>::Element *next_elem = elem->next();
-			_voxel_metadata.erase(elem);
-			elem = next_elem;
-		}
+	std::vector<unsigned int> ranges;
+	for_each_metadata_range_in_box(box, [&ranges](unsigned int begin, unsigned int end) {
+		ranges.push_back(begin);
+		ranges.push_back(end);
+	});
+	// Ranges come in increasing order, so erasing from the last keeps others valid
+	for (unsigned int i = ranges.size(); i > 0; i -= 2) {
+		_voxel_metadata.erase_range(ranges[i - 2], ranges[i - 1]);
 	}
+	mark_modified();
 }
 
 void VoxelBuffer::copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Rect3i src_box, Vector3i dst_origin) {
 	ERR_FAIL_COND(src_buffer.is_null());
-	ERR_FAIL_COND(src_buffer->is_box_valid(src_box));
+	ERR_FAIL_COND(!src_buffer->is_box_valid(src_box));
 
 	const Rect3i clipped_src_box = src_box.clipped(Rect3i(src_box.pos - dst_origin, _size));
-	const Vector3i clipped_dst_offset = dst_origin + clipped_src_box.pos - src_box.pos;
-
-	const Map<Vector3i, Variant>::Element *elem = src_buffer->_voxel_metadata.front();
+	const Vector3i dst_offset = dst_origin - src_box.pos;
+
+	const VoxelMetadataMap &src_metadata = src_buffer->_voxel_metadata;
+	const VoxelBuffer &src = **src_buffer;
+
+	// Keys come in increasing order, and keep that order once moved to the destination
+	std::vector<uint32_t> keys;
+	std::vector<Variant> values;
+	src.for_each_metadata_range_in_box(clipped_src_box,
+			[this, &src, &src_metadata, &keys, &values, dst_offset](unsigned int begin, unsigned int end) {
+				for (unsigned int i = begin; i < end; ++i) {
+					const Vector3i dst_pos = src.position_from_index(src_metadata.get_key(i)) + dst_offset;
+					CRASH_COND(!is_position_valid(dst_pos));
+					keys.push_back(index(dst_pos.x, dst_pos.y, dst_pos.z));
+					values.push_back(src_metadata.get_value(i).duplicate());
+				}
+			});
 
-	while (elem != nullptr) {
-		const Vector3i src_pos = elem->key();
-		if (src_box.contains(src_pos)) {
-			const Vector3i dst_pos = src_pos + clipped_dst_offset;
-			CRASH_COND(!is_position_valid(dst_pos));
-			_voxel_metadata[dst_pos] = elem->value().duplicate();
-		}
-		elem = elem->next();
-	}
+	_voxel_metadata.set_sorted(keys, values);
+	mark_modified();
 }
 
 void VoxelBuffer::copy_voxel_metadata(const VoxelBuffer &src_buffer) {
 	ERR_FAIL_COND(src_buffer.get_size() != _size);
 
-	const Map<Vector3i, Variant>::Element *elem = src_buffer._voxel_metadata.front();
-
-	while (elem != nullptr) {
-		const Vector3i pos = elem->key();
-		_voxel_metadata[pos] = elem->value().duplicate();
-		elem = elem->next();
-	}
-
+	_voxel_metadata.copy_from(src_buffer._voxel_metadata);
 	_block_metadata = src_buffer._block_metadata.duplicate();
+	mark_modified();
 }
 
 Ref<Image> VoxelBuffer::debug_print_sdf_to_image_top_down() {
@@ -882,6 +2352,17 @@ void VoxelBuffer::_bind_methods() {
 	// TODO Rename `compress_uniform_channels`
 	ClassDB::bind_method(D_METHOD("optimize"), &VoxelBuffer::compress_uniform_channels);
 	ClassDB::bind_method(D_METHOD("get_channel_compression", "channel"), &VoxelBuffer::get_channel_compression);
+	ClassDB::bind_method(D_METHOD("compress_channels"), &VoxelBuffer::compress_channels);
+	ClassDB::bind_method(D_METHOD("set_sparse_bricks_enabled", "enabled"), &VoxelBuffer::set_sparse_bricks_enabled);
+	ClassDB::bind_method(D_METHOD("is_sparse_bricks_enabled"), &VoxelBuffer::is_sparse_bricks_enabled);
+	ClassDB::bind_method(D_METHOD("set_slab_channels", "channels_mask"), &VoxelBuffer::set_slab_channels);
+	ClassDB::bind_method(D_METHOD("get_slab_channels"), &VoxelBuffer::get_slab_channels);
+	ClassDB::bind_method(D_METHOD("set_layout", "layout"), &VoxelBuffer::set_layout);
+	ClassDB::bind_method(D_METHOD("get_layout"), &VoxelBuffer::get_layout);
+	ClassDB::bind_method(D_METHOD("get_generation"), &VoxelBuffer::get_generation);
+	ClassDB::bind_method(D_METHOD("get_channel_generation", "channel"), &VoxelBuffer::get_channel_generation);
+	ClassDB::bind_method(D_METHOD("get_channel_hash", "channel"), &VoxelBuffer::get_channel_hash);
+	ClassDB::bind_method(D_METHOD("get_hash"), &VoxelBuffer::get_hash);
 
 	ClassDB::bind_method(D_METHOD("get_block_metadata"), &VoxelBuffer::get_block_metadata);
 	ClassDB::bind_method(D_METHOD("set_block_metadata", "meta"), &VoxelBuffer::set_block_metadata);
@@ -913,8 +2394,15 @@ void VoxelBuffer::_bind_methods() {
 
 	BIND_ENUM_CONSTANT(COMPRESSION_NONE);
 	BIND_ENUM_CONSTANT(COMPRESSION_UNIFORM);
+	BIND_ENUM_CONSTANT(COMPRESSION_RLE);
+	BIND_ENUM_CONSTANT(COMPRESSION_PALETTE);
+	BIND_ENUM_CONSTANT(COMPRESSION_SPARSE);
 	BIND_ENUM_CONSTANT(COMPRESSION_COUNT);
 
+	BIND_ENUM_CONSTANT(LAYOUT_LINEAR);
+	BIND_ENUM_CONSTANT(LAYOUT_TILED);
+	BIND_ENUM_CONSTANT(LAYOUT_COUNT);
+
 	BIND_CONSTANT(MAX_SIZE);
 }
 
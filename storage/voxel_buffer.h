@@ -4,11 +4,15 @@
 #include "../math/rect3i.h"
 #include "../util/array_slice.h"
 #include "../util/fixed_array.h"
+#include "voxel_metadata_map.h"
 
-#include <core/map.h>
 #include <core/reference.h>
+#include <core/safe_refcount.h>
 #include <core/vector.h>
 
+#include <core/io/marshalls.h>
+#include <limits>
+
 class VoxelTool;
 class Image;
 class FuncRef;
@@ -40,7 +44,12 @@ public:
 	enum Compression {
 		COMPRESSION_NONE = 0,
 		COMPRESSION_UNIFORM,
-		//COMPRESSION_RLE,
+		// Runs of equal values, in the same order as `index()`
+		COMPRESSION_RLE,
+		// Indices into a small list of distinct values, packed on 1, 2, 4 or 8 bits
+		COMPRESSION_PALETTE,
+		// Split in bricks of `BRICK_SIZE` voxels, each uniform or dense. Can be modified without decompressing.
+		COMPRESSION_SPARSE,
 		COMPRESSION_COUNT
 	};
 
@@ -54,9 +63,40 @@ public:
 
 	static const Depth DEFAULT_CHANNEL_DEPTH = DEPTH_8_BIT;
 
+	// How 2x2x2 voxels are reduced into one when downscaling
+	enum DownscaleFilter {
+		// Takes the voxel with lowest coordinates
+		DOWNSCALE_NEAREST,
+		// Takes the average, suited for SDF
+		DOWNSCALE_AVERAGE,
+		// Takes the most frequent value, suited for types
+		DOWNSCALE_MODE,
+		DOWNSCALE_FILTER_COUNT
+	};
+
+	// How voxels of uncompressed channels are arranged in memory.
+	// Compressed channels and files always use the order of `index()`.
+	enum Layout {
+		// Order [z][x][y], whole columns along Y are contiguous
+		LAYOUT_LINEAR,
+		// Tiles of `TILE_SIZE` voxels, in [z][x][y] order, with voxels in [z][x][y] order inside them.
+		// Neighbors of a voxel are mostly in the same tile, which suits reading cells and gradients.
+		LAYOUT_TILED,
+		LAYOUT_COUNT
+	};
+
 	// Limit was made explicit for serialization reasons, and also because there must be a reasonable one
 	static const uint32_t MAX_SIZE = 65535;
 
+	// Size of the cubic bricks used by sparse channels, in voxels
+	static const unsigned int BRICK_SIZE_PO2 = 3;
+	static const unsigned int BRICK_SIZE = 1 << BRICK_SIZE_PO2;
+
+	// Size of the cubic tiles of `LAYOUT_TILED`, in voxels. 64 voxels of 8 bits fit in a cache line.
+	static const unsigned int TILE_SIZE_PO2 = 2;
+	static const unsigned int TILE_SIZE = 1 << TILE_SIZE_PO2;
+	static const unsigned int TILE_MASK = TILE_SIZE - 1;
+
 	VoxelBuffer();
 	~VoxelBuffer();
 
@@ -89,8 +129,39 @@ public:
 	void decompress_channel(unsigned int channel_index);
 	Compression get_channel_compression(unsigned int channel_index) const;
 
+	// Encodes channels in a more compact form when it saves memory, including uniform ones.
+	// Compressed channels can still be read, and get decompressed the next time they are modified.
+	// This takes time, so it's better done on buffers that are no longer edited, possibly on another thread.
+	void compress_channels();
+
+	// When enabled, channels may be stored as sparse bricks when it saves memory, and modifying a uniform
+	// or compressed channel only allocates the bricks it touches instead of the whole channel.
+	// Useful for buffers receiving scattered edits, like terrain blocks. Requires sizes to be multiples of `BRICK_SIZE`.
+	void set_sparse_bricks_enabled(bool enabled);
+	bool is_sparse_bricks_enabled() const { return _sparse_bricks_enabled; }
+
+	// Channels of the mask get their memory from one allocation, called a slab, instead of one allocation each.
+	// When one of them needs memory, room is made for all of them at once, each starting on a new cache line.
+	// Channels leave the slab when they get compressed or copied on write, and it is freed when none remain in it.
+	// Suits buffers filled with several channels at once, like meshing inputs. Disabled by default.
+	void set_slab_channels(uint32_t channels_mask);
+	uint32_t get_slab_channels() const { return _slab_channels_mask; }
+
+	// Changes how uncompressed voxels are arranged in memory, converting those already present.
+	// Tiled buffers are meant for processing, like meshing: they don't get compressed and don't use sparse bricks.
+	void set_layout(Layout layout);
+	Layout get_layout() const { return _layout; }
+
+	// Takes compressed channels from `compressed`, if the same channels were not modified since `snapshot` was taken.
+	// `compressed` must be a snapshot of `snapshot`, on which `compress_channels` was called.
+	// This allows to compress voxels on another thread while this buffer keeps being used.
+	void take_compressed_channels(const VoxelBuffer &snapshot, VoxelBuffer &compressed);
+
 	static uint32_t get_size_in_bytes_for_volume(Vector3i size, Depth depth);
 
+	// Memory used by voxels of all channels. Metadata is not counted, and data shared with snapshots is counted fully.
+	size_t get_memory_usage() const;
+
 	// Note: these functions don't include metadata on purpose.
 	// If you also want to copy metadata, use the specialized functions.
 	void copy_from(const VoxelBuffer &other);
@@ -99,6 +170,11 @@ public:
 
 	Ref<VoxelBuffer> duplicate(bool include_metadata) const;
 
+	// Creates a copy sharing channel data with this buffer. Data gets copied only when one of them modifies it.
+	// This is cheap, so it can be used to hand over voxels to another thread, which can then read them without locking.
+	// Must be called from the thread modifying this buffer.
+	Ref<VoxelBuffer> snapshot(bool include_metadata);
+
 	_FORCE_INLINE_ bool is_position_valid(unsigned int x, unsigned int y, unsigned int z) const {
 		return x < (unsigned)_size.x && y < (unsigned)_size.y && z < (unsigned)_size.z;
 	}
@@ -115,6 +191,11 @@ public:
 		return y + _size.y * (x + _size.x * z);
 	}
 
+	_FORCE_INLINE_ Vector3i position_from_index(unsigned int i) const {
+		const unsigned int column = i / _size.y;
+		return Vector3i(column % _size.x, i % _size.y, column / _size.x);
+	}
+
 	//	_FORCE_INLINE_ unsigned int row_index(unsigned int x, unsigned int y, unsigned int z) const {
 	//		return _size.y * (x + _size.x * z);
 	//	}
@@ -123,10 +204,48 @@ public:
 		return _size.x * _size.y * _size.z;
 	}
 
+	// Index of a voxel in uncompressed channel data, which depends on the layout
+	_FORCE_INLINE_ unsigned int data_index(unsigned int x, unsigned int y, unsigned int z) const {
+		if (_layout == LAYOUT_LINEAR) {
+			return index(x, y, z);
+		}
+		const unsigned int tile_index = (y >> TILE_SIZE_PO2) +
+										_tile_counts.y * ((x >> TILE_SIZE_PO2) + _tile_counts.x * (z >> TILE_SIZE_PO2));
+		return (tile_index << (3 * TILE_SIZE_PO2)) +
+			   (y & TILE_MASK) + TILE_SIZE * ((x & TILE_MASK) + TILE_SIZE * (z & TILE_MASK));
+	}
+
+	// How many voxels uncompressed channels hold. With `LAYOUT_TILED`, this includes the padding of border tiles.
+	_FORCE_INLINE_ unsigned int get_data_volume() const {
+		if (_layout == LAYOUT_LINEAR) {
+			return get_volume();
+		}
+		return _tile_counts.volume() << (3 * TILE_SIZE_PO2);
+	}
+
+	// Calls `action(Vector3i pos, unsigned int data_index, unsigned int count)` for each run of voxels of the box
+	// which are contiguous in uncompressed channel data, starting at `pos` and going along Y.
+	// Runs are whole columns with `LAYOUT_LINEAR`, and end at tile boundaries with `LAYOUT_TILED`.
+	template <typename F>
+	void for_each_data_run(Rect3i box, F action) const;
+
 	// TODO Have a template version based on channel depth
+	// Data can be shared with snapshots. If you want to write into it, call `decompress_channel` first.
+	// Only gives raw voxels with `COMPRESSION_NONE`. Otherwise, the slice contains encoded data.
+	// Voxels are in the order of `data_index()`, which is only the same as `index()` with `LAYOUT_LINEAR`.
 	bool get_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> &slice) const;
 
+	// Writes voxels of the channel into `dst` in the order of `index()`, whatever the compression and layout.
+	// `dst` must be `get_size_in_bytes_for_volume` large.
+	void decode_channel_raw(unsigned int channel_index, ArraySlice<uint8_t> dst) const;
+
+	// Writes a half-resolution version of the source area into `dst`, for all channels.
+	// Each channel uses the filter given by `get_default_downscale_filter`.
 	void downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const;
+	void downscale_channel_to(VoxelBuffer &dst, unsigned int channel_index,
+			Vector3i src_min, Vector3i src_max, Vector3i dst_min, DownscaleFilter filter) const;
+	static DownscaleFilter get_default_downscale_filter(unsigned int channel_index);
+
 	Ref<VoxelTool> get_voxel_tool();
 
 	bool equals(const VoxelBuffer *p_other) const;
@@ -148,34 +267,106 @@ public:
 	void copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Rect3i src_box, Vector3i dst_origin);
 	void copy_voxel_metadata(const VoxelBuffer &src_buffer);
 
-	const Map<Vector3i, Variant> &get_voxel_metadata() const { return _voxel_metadata; }
+	// Keys are voxel indices, see `index()`
+	const VoxelMetadataMap &get_voxel_metadata() const { return _voxel_metadata; }
+
+	// Content tracking
+
+	// Increases every time voxels or metadata may have changed. Changes of storage, like compression, don't count.
+	// Comparing it to a previous value tells if the buffer needs to be saved again.
+	uint64_t get_generation() const { return _generation; }
+	// Value the generation had when voxels of the channel last changed
+	uint64_t get_channel_generation(unsigned int channel_index) const;
+
+	// Digest of the voxels of a channel, which doesn't depend on how they are stored, so it can be used to find
+	// identical channels. Uniform channels are hashed right away, others are read entirely.
+	uint64_t get_channel_hash(unsigned int channel_index) const;
+	// Combines the size, depths and hashes of all channels. Metadata is not included.
+	uint64_t get_hash() const;
 
 	// Internal synchronization.
 	// This lock is optional, and used internally at the moment, only in multithreaded areas.
 	inline const RWLock *get_lock() const { return _rw_lock; }
 	inline RWLock *get_lock() { return _rw_lock; }
 
-	// TODO Make this work, would be awesome for perf
-	//
-	//	template <typename F>
-	//	void read_write_action(Rect3i box, Vector3i offset, unsigned int channel_index, F f) {
-	//		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
-	//		box.clip(Rect3i(Vector3i(), _size));
-	//		Vector3i min_pos = box.pos;
-	//		Vector3i max_pos = box.pos + box.size;
-	//		Vector3i pos;
-	//		for (pos.z = min_pos.z; pos.z < max_pos.z; ++pos.z) {
-	//			for (pos.x = min_pos.x; pos.x < max_pos.x; ++pos.x) {
-	//				for (pos.y = min_pos.y; pos.y < max_pos.y; ++pos.y) {
-	//					int v0 = get_voxel(pos, channel_index);
-	//					int v1 = f(pos + offset, v0);
-	//					if (v0 != v1) {
-	//						set_voxel(v1, pos, channel_index);
-	//					}
-	//				}
-	//			}
-	//		}
-	//	}
+	// Bulk access
+
+	// Typed access to the voxels of a channel, without any check or conversion.
+	// `T` must have the size of the channel depth. Voxels along Y are contiguous, in the same order as `index()`.
+	template <typename T>
+	struct ChannelView {
+		T *data = nullptr;
+		Vector3i size;
+
+		inline unsigned int index(unsigned int x, unsigned int y, unsigned int z) const {
+			return y + size.y * (x + size.x * z);
+		}
+
+		inline T &operator()(unsigned int x, unsigned int y, unsigned int z) const {
+			return data[index(x, y, z)];
+		}
+
+		// Gets the column of voxels at the given X and Z, which can be iterated along Y
+		inline T *get_column(unsigned int x, unsigned int z) const {
+			return data + index(x, 0, z);
+		}
+	};
+
+	// Gets a view for reading a channel.
+	// Fails if the channel is not stored raw (uniform or compressed) or is tiled, in which case `read_box` can be used.
+	template <typename T>
+	bool get_channel_view(unsigned int channel_index, ChannelView<const T> &out_view) const;
+
+	// Gets a view for writing into a channel. It gets decompressed first, so it is allocated even if uniform.
+	// Only available with `LAYOUT_LINEAR`.
+	template <typename T>
+	bool get_channel_write_view(unsigned int channel_index, ChannelView<T> &out_view);
+
+	// Calls `action(Vector3i pos, uint64_t value)` for each voxel of the box, clipped to the buffer.
+	// Loops are specialized for the depth of the channel, which is faster than calling `get_voxel` each time.
+	template <typename F>
+	void read_box(Rect3i box, unsigned int channel_index, F action) const;
+
+	// Replaces each voxel of the box, clipped to the buffer, by what `action(Vector3i pos, uint64_t value)` returns.
+	// Values are clamped to the depth of the channel, like `set_voxel` does.
+	template <typename F>
+	void write_box(Rect3i box, unsigned int channel_index, F action);
+
+	// Same as `write_box`, with `action(Vector3i pos, real_t value)` using normalized values like `set_voxel_f`.
+	template <typename F>
+	void write_box_f(Rect3i box, unsigned int channel_index, F action);
+
+	// Conversions between raw and normalized values, for each depth.
+	// Depths below 32 bits are normalized between -1 and 1. Others hold a float or a double.
+	static inline real_t raw_to_real(uint8_t v) { return (static_cast<real_t>(v) - 0x7f) / 0x7f; }
+	static inline real_t raw_to_real(uint16_t v) { return (static_cast<real_t>(v) - 0x7fff) / 0x7fff; }
+	static inline real_t raw_to_real(uint32_t v) {
+		MarshallFloat m;
+		m.i = v;
+		return m.f;
+	}
+	static inline real_t raw_to_real(uint64_t v) {
+		MarshallDouble m;
+		m.l = v;
+		return m.d;
+	}
+
+	static inline void real_to_raw(real_t v, uint8_t &out) {
+		out = CLAMP(static_cast<int>(128.f * v + 128.f), 0, 0xff);
+	}
+	static inline void real_to_raw(real_t v, uint16_t &out) {
+		out = CLAMP(static_cast<int>(0x7fff * v + 0x7fff), 0, 0xffff);
+	}
+	static inline void real_to_raw(real_t v, uint32_t &out) {
+		MarshallFloat m;
+		m.f = v;
+		out = m.i;
+	}
+	static inline void real_to_raw(real_t v, uint64_t &out) {
+		MarshallDouble m;
+		m.d = v;
+		out = m.l;
+	}
 
 	// Debugging
 
@@ -185,6 +376,54 @@ private:
 	void create_channel_noinit(int i, Vector3i size);
 	void create_channel(int i, Vector3i size, uint64_t defval);
 	void delete_channel(int i);
+	void unshare_channel(unsigned int channel_index);
+	void compress_channel(unsigned int channel_index);
+	uint32_t get_data_size_in_bytes(Vector3i size, Depth depth) const;
+
+	struct Slab;
+	void create_slab();
+	// Stops placing channels in the current slab
+	void release_slab_claim();
+	static void release_slab(Slab *slab);
+	static void free_channel_memory(uint8_t *data, uint32_t size_in_bytes, Compression compression, Slab *slab);
+	// Copies all channels at once, if those of `other` holding data are all in the same slab
+	bool copy_slab_from(const VoxelBuffer &other);
+	// Stores voxels given in the order of `index()` into an uncompressed channel, according to the layout
+	void encode_channel_raw(unsigned int channel_index, const uint8_t *src);
+
+	bool can_use_sparse_bricks() const;
+	void create_sparse_channel(unsigned int channel_index);
+	// Converts a channel to sparse bricks, or makes sure sparse data is not shared, so it can be modified
+	void make_sparse_channel_unique(unsigned int channel_index);
+
+	template <typename F>
+	void for_each_metadata_range_in_box(Rect3i box, F f) const;
+
+	template <typename T, typename F>
+	void read_box_template(const uint8_t *p_data, Rect3i box, F action) const;
+	template <typename T, typename F>
+	void write_box_template(uint8_t *p_data, Rect3i box, F action);
+	template <typename T, typename F>
+	void write_box_f_template(uint8_t *p_data, Rect3i box, F action);
+
+	// Drops data of a channel, without counting as a change of voxels
+	void make_channel_uniform(unsigned int channel_index, uint64_t value);
+
+	inline void mark_modified() {
+		++_generation;
+	}
+
+	inline void mark_channel_modified(unsigned int channel_index) {
+		_channels[channel_index].generation = ++_generation;
+	}
+
+	// Must be called before modifying channel data. Compressed channels get decompressed.
+	inline void make_channel_unique(unsigned int channel_index) {
+		const Channel &channel = _channels[channel_index];
+		if (channel.shared_refs != nullptr || channel.compression != COMPRESSION_NONE) {
+			unshare_channel(channel_index);
+		}
+	}
 
 	static void _bind_methods();
 
@@ -210,6 +449,15 @@ private:
 	void _b_copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Vector3 src_min_pos, Vector3 src_max_pos, Vector3 dst_pos);
 
 private:
+	struct Slab {
+		// Start of the allocation. Data comes after, at the first cache line boundary.
+		uint8_t *allocation = nullptr;
+		uint8_t *data = nullptr;
+		uint32_t size_in_bytes = 0;
+		// Counts channel data living in the slab, plus one while a buffer can still place channels in it
+		SafeRefCount refs;
+	};
+
 	struct Channel {
 		// Allocated when the channel is populated.
 		// Flat array, in order [z][x][y] because it allows faster vertical-wise access (the engine is Y-up).
@@ -221,6 +469,18 @@ private:
 		Depth depth = DEFAULT_CHANNEL_DEPTH;
 
 		uint32_t size_in_bytes = 0;
+
+		// How data is encoded, when not null. Only `COMPRESSION_NONE` and `COMPRESSION_SPARSE` can be modified.
+		Compression compression = COMPRESSION_NONE;
+
+		// Not null when data is shared with snapshots, counting how many buffers use it.
+		// Shared data is read-only.
+		SafeRefCount *shared_refs = nullptr;
+
+		// Not null when data is part of a slab, which owns the memory
+		Slab *slab = nullptr;
+
+		uint64_t generation = 0;
 	};
 
 	// Each channel can store arbitary data.
@@ -230,14 +490,203 @@ private:
 	// How many voxels are there in the three directions. All populated channels have the same size.
 	Vector3i _size;
 
+	bool _sparse_bricks_enabled = false;
+
+	Layout _layout = LAYOUT_LINEAR;
+	// How many tiles there are in the three directions, with `LAYOUT_TILED`
+	Vector3i _tile_counts;
+
+	uint64_t _generation = 0;
+
+	uint32_t _slab_channels_mask = 0;
+	// Slab in which channels of the mask can still be placed, at their offset, if their bit is in the free mask
+	Slab *_slab = nullptr;
+	uint32_t _slab_free_mask = 0;
+	FixedArray<uint32_t, MAX_CHANNELS> _slab_offsets;
+
 	Variant _block_metadata;
-	Map<Vector3i, Variant> _voxel_metadata;
+	VoxelMetadataMap _voxel_metadata;
 
 	RWLock *_rw_lock;
 };
 
+template <typename T>
+bool VoxelBuffer::get_channel_view(unsigned int channel_index, ChannelView<const T> &out_view) const {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	const Channel &channel = _channels[channel_index];
+	ERR_FAIL_COND_V(get_depth_bit_count(channel.depth) != sizeof(T) * 8, false);
+	if (channel.data == nullptr || channel.compression != COMPRESSION_NONE || _layout != LAYOUT_LINEAR) {
+		return false;
+	}
+	out_view.data = reinterpret_cast<const T *>(channel.data);
+	out_view.size = _size;
+	return true;
+}
+
+template <typename T>
+bool VoxelBuffer::get_channel_write_view(unsigned int channel_index, ChannelView<T> &out_view) {
+	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, false);
+	Channel &channel = _channels[channel_index];
+	ERR_FAIL_COND_V(get_depth_bit_count(channel.depth) != sizeof(T) * 8, false);
+	ERR_FAIL_COND_V(_layout != LAYOUT_LINEAR, false);
+	decompress_channel(channel_index);
+	out_view.data = reinterpret_cast<T *>(channel.data);
+	out_view.size = _size;
+	return true;
+}
+
+template <typename F>
+void VoxelBuffer::read_box(Rect3i box, unsigned int channel_index, F action) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	box.clip(Rect3i(Vector3i(), _size));
+	const Channel &channel = _channels[channel_index];
+
+	if (channel.data == nullptr || channel.compression != COMPRESSION_NONE) {
+		const Vector3i max_pos = box.pos + box.size;
+		Vector3i pos;
+		for (pos.z = box.pos.z; pos.z < max_pos.z; ++pos.z) {
+			for (pos.x = box.pos.x; pos.x < max_pos.x; ++pos.x) {
+				for (pos.y = box.pos.y; pos.y < max_pos.y; ++pos.y) {
+					action(pos, get_voxel(pos, channel_index));
+				}
+			}
+		}
+		return;
+	}
+
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			read_box_template<uint8_t>(channel.data, box, action);
+			break;
+		case DEPTH_16_BIT:
+			read_box_template<uint16_t>(channel.data, box, action);
+			break;
+		case DEPTH_32_BIT:
+			read_box_template<uint32_t>(channel.data, box, action);
+			break;
+		case DEPTH_64_BIT:
+			read_box_template<uint64_t>(channel.data, box, action);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+template <typename F>
+void VoxelBuffer::write_box(Rect3i box, unsigned int channel_index, F action) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	box.clip(Rect3i(Vector3i(), _size));
+	if (box.size.x == 0 || box.size.y == 0 || box.size.z == 0) {
+		return;
+	}
+	decompress_channel(channel_index);
+	Channel &channel = _channels[channel_index];
+
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			write_box_template<uint8_t>(channel.data, box, action);
+			break;
+		case DEPTH_16_BIT:
+			write_box_template<uint16_t>(channel.data, box, action);
+			break;
+		case DEPTH_32_BIT:
+			write_box_template<uint32_t>(channel.data, box, action);
+			break;
+		case DEPTH_64_BIT:
+			write_box_template<uint64_t>(channel.data, box, action);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+template <typename F>
+void VoxelBuffer::write_box_f(Rect3i box, unsigned int channel_index, F action) {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	box.clip(Rect3i(Vector3i(), _size));
+	if (box.size.x == 0 || box.size.y == 0 || box.size.z == 0) {
+		return;
+	}
+	decompress_channel(channel_index);
+	Channel &channel = _channels[channel_index];
+
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			write_box_f_template<uint8_t>(channel.data, box, action);
+			break;
+		case DEPTH_16_BIT:
+			write_box_f_template<uint16_t>(channel.data, box, action);
+			break;
+		case DEPTH_32_BIT:
+			write_box_f_template<uint32_t>(channel.data, box, action);
+			break;
+		case DEPTH_64_BIT:
+			write_box_f_template<uint64_t>(channel.data, box, action);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+template <typename F>
+void VoxelBuffer::for_each_data_run(Rect3i box, F action) const {
+	const Vector3i max_pos = box.pos + box.size;
+	Vector3i pos;
+	for (pos.z = box.pos.z; pos.z < max_pos.z; ++pos.z) {
+		for (pos.x = box.pos.x; pos.x < max_pos.x; ++pos.x) {
+			if (_layout == LAYOUT_LINEAR) {
+				pos.y = box.pos.y;
+				action(pos, index(pos.x, pos.y, pos.z), box.size.y);
+				continue;
+			}
+			pos.y = box.pos.y;
+			while (pos.y < max_pos.y) {
+				const unsigned int count = MIN(TILE_SIZE - (pos.y & TILE_MASK), (unsigned int)(max_pos.y - pos.y));
+				action(pos, data_index(pos.x, pos.y, pos.z), count);
+				pos.y += count;
+			}
+		}
+	}
+}
+
+template <typename T, typename F>
+void VoxelBuffer::read_box_template(const uint8_t *p_data, Rect3i box, F action) const {
+	const T *data = reinterpret_cast<const T *>(p_data);
+	for_each_data_run(box, [data, &action](Vector3i pos, unsigned int i, unsigned int count) {
+		for (const unsigned int end = i + count; i < end; ++i, ++pos.y) {
+			action(pos, static_cast<uint64_t>(data[i]));
+		}
+	});
+}
+
+template <typename T, typename F>
+void VoxelBuffer::write_box_template(uint8_t *p_data, Rect3i box, F action) {
+	T *data = reinterpret_cast<T *>(p_data);
+	const uint64_t max_value = std::numeric_limits<T>::max();
+	for_each_data_run(box, [data, max_value, &action](Vector3i pos, unsigned int i, unsigned int count) {
+		for (const unsigned int end = i + count; i < end; ++i, ++pos.y) {
+			const uint64_t v = action(pos, static_cast<uint64_t>(data[i]));
+			data[i] = static_cast<T>(v > max_value ? max_value : v);
+		}
+	});
+}
+
+template <typename T, typename F>
+void VoxelBuffer::write_box_f_template(uint8_t *p_data, Rect3i box, F action) {
+	T *data = reinterpret_cast<T *>(p_data);
+	for_each_data_run(box, [data, &action](Vector3i pos, unsigned int i, unsigned int count) {
+		for (const unsigned int end = i + count; i < end; ++i, ++pos.y) {
+			real_to_raw(action(pos, raw_to_real(data[i])), data[i]);
+		}
+	});
+}
+
 VARIANT_ENUM_CAST(VoxelBuffer::ChannelId)
 VARIANT_ENUM_CAST(VoxelBuffer::Depth)
 VARIANT_ENUM_CAST(VoxelBuffer::Compression)
+VARIANT_ENUM_CAST(VoxelBuffer::Layout)
 
 #endif // VOXEL_BUFFER_H
@@ -1,12 +1,16 @@
 #include "voxel_memory_pool.h"
 #include "../util/profiling.h"
+#include <core/os/os.h>
 #include <core/print_string.h>
 #include <core/variant.h>
 
 namespace {
 VoxelMemoryPool *g_memory_pool = nullptr;
+uint32_t g_memory_pool_generation = 0;
 } // namespace
 
+thread_local VoxelMemoryPool::ThreadCacheRef VoxelMemoryPool::_thread_cache;
+
 void VoxelMemoryPool::create_singleton() {
 	CRASH_COND(g_memory_pool != nullptr);
 	g_memory_pool = memnew(VoxelMemoryPool);
@@ -26,6 +30,17 @@ VoxelMemoryPool *VoxelMemoryPool::get_singleton() {
 
 VoxelMemoryPool::VoxelMemoryPool() {
 	_mutex = Mutex::create();
+	_generation = ++g_memory_pool_generation;
+	_size_class_count.store(0);
+	_cache_budget.store(0);
+	for (unsigned int i = 0; i < MAX_SIZE_CLASSES; ++i) {
+		SizeClass &sc = _size_classes[i];
+		sc.size.store(0);
+		sc.live_count.store(0);
+		sc.cached_count.store(0);
+		sc.high_water_mark.store(0);
+		sc.trimmed_count.store(0);
+	}
 }
 
 VoxelMemoryPool::~VoxelMemoryPool() {
@@ -38,70 +53,313 @@ VoxelMemoryPool::~VoxelMemoryPool() {
 
 uint8_t *VoxelMemoryPool::allocate(uint32_t size) {
 	VOXEL_PROFILE_SCOPE();
-	MutexLock lock(_mutex);
-	Pool *pool = get_or_create_pool(size);
-	uint8_t *block;
-	if (pool->blocks.size() > 0) {
-		block = pool->blocks.back();
-		pool->blocks.pop_back();
-	} else {
-		block = (uint8_t *)memalloc(size * sizeof(uint8_t));
+
+	const int sci = get_or_create_size_class(size);
+	if (sci == -1) {
+		return (uint8_t *)memalloc(size * sizeof(uint8_t));
+	}
+	SizeClass &sc = _size_classes[sci];
+
+	const uint32_t live_count = sc.live_count.fetch_add(1, std::memory_order_relaxed) + 1;
+	uint32_t high_water_mark = sc.high_water_mark.load(std::memory_order_relaxed);
+	while (live_count > high_water_mark &&
+			!sc.high_water_mark.compare_exchange_weak(high_water_mark, live_count, std::memory_order_relaxed)) {
 	}
-	++_used_blocks;
-	return block;
+
+	Magazine &magazine = get_thread_cache()->magazines[sci];
+	if (magazine.count == 0) {
+		refill_magazine(sc, magazine);
+	}
+	if (magazine.count > 0) {
+		--magazine.count;
+		sc.cached_count.fetch_sub(1, std::memory_order_relaxed);
+		return magazine.blocks[magazine.count];
+	}
+
+	return (uint8_t *)memalloc(size * sizeof(uint8_t));
 }
 
 void VoxelMemoryPool::recycle(uint8_t *block, uint32_t size) {
-	MutexLock lock(_mutex);
-	Pool *pool = _pools[size]; // If not found, entry will be created! It would be an error
-	// Check recycling before having allocated
-	CRASH_COND(pool == nullptr);
-	pool->blocks.push_back(block);
-	--_used_blocks;
+	const int sci = find_size_class(size);
+	if (sci == -1) {
+		// Check recycling before having allocated.
+		// If all size classes are used, the block could have been allocated without pooling.
+		CRASH_COND(_size_class_count.load() < MAX_SIZE_CLASSES);
+		memfree(block);
+		return;
+	}
+	SizeClass &sc = _size_classes[sci];
+
+	sc.live_count.fetch_sub(1, std::memory_order_relaxed);
+	sc.cached_count.fetch_add(1, std::memory_order_relaxed);
+
+	Magazine &magazine = get_thread_cache()->magazines[sci];
+	if (magazine.count == MAGAZINE_CAPACITY) {
+		flush_magazine(sc, magazine, MAGAZINE_CAPACITY / 2);
+	}
+	magazine.blocks[magazine.count] = block;
+	++magazine.count;
+}
+
+void VoxelMemoryPool::refill_magazine(SizeClass &sc, Magazine &magazine) {
+	MutexLock lock(sc.mutex);
+	const unsigned int count = MIN(MAGAZINE_CAPACITY / 2 - magazine.count, sc.blocks.size());
+	const unsigned int begin = sc.blocks.size() - count;
+	for (unsigned int i = 0; i < count; ++i) {
+		magazine.blocks[magazine.count] = sc.blocks[begin + i].ptr;
+		++magazine.count;
+	}
+	sc.blocks.resize(begin);
+}
+
+void VoxelMemoryPool::flush_magazine(SizeClass &sc, Magazine &magazine, unsigned int count) {
+	CRASH_COND(count > magazine.count);
+	{
+		// Oldest blocks go first, recently recycled ones are more likely to be in CPU cache
+		const uint32_t time_msec = OS::get_singleton()->get_ticks_msec();
+		MutexLock lock(sc.mutex);
+		for (unsigned int i = 0; i < count; ++i) {
+			CachedBlock cb;
+			cb.ptr = magazine.blocks[i];
+			cb.time_msec = time_msec;
+			sc.blocks.push_back(cb);
+		}
+	}
+	for (unsigned int i = count; i < magazine.count; ++i) {
+		magazine.blocks[i - count] = magazine.blocks[i];
+	}
+	magazine.count -= count;
+}
+
+void VoxelMemoryPool::set_cache_budget(uint64_t bytes) {
+	_cache_budget.store(bytes);
+}
+
+uint64_t VoxelMemoryPool::get_cache_budget() const {
+	return _cache_budget.load();
+}
+
+void VoxelMemoryPool::trim() {
+	VOXEL_PROFILE_SCOPE();
+
+	const uint64_t budget = _cache_budget.load();
+	const unsigned int size_class_count = _size_class_count.load(std::memory_order_acquire);
+
+	uint64_t cached_bytes = 0;
+	for (unsigned int i = 0; i < size_class_count; ++i) {
+		const SizeClass &sc = _size_classes[i];
+		cached_bytes += static_cast<uint64_t>(sc.cached_count.load(std::memory_order_relaxed)) * sc.size.load();
+	}
+
+	while (cached_bytes > budget) {
+		uint32_t time_msec;
+		uint32_t next_time_msec;
+		const int sci = find_least_recently_used_size_class(time_msec, next_time_msec);
+		if (sci == -1) {
+			// Only thread caches remain
+			break;
+		}
+		SizeClass &sc = _size_classes[sci];
+		const uint32_t size = sc.size.load(std::memory_order_relaxed);
+
+		// Free blocks of this size class until they are no longer the oldest
+		MutexLock lock(sc.mutex);
+		unsigned int count = 0;
+		while (count < sc.blocks.size() && cached_bytes > budget) {
+			const CachedBlock &cb = sc.blocks[count];
+			// Times wrap around after about 50 days
+			if (count > 0 && static_cast<int32_t>(cb.time_msec - next_time_msec) > 0) {
+				break;
+			}
+			memfree(cb.ptr);
+			cached_bytes -= MIN(cached_bytes, static_cast<uint64_t>(size));
+			++count;
+		}
+		sc.blocks.erase(sc.blocks.begin(), sc.blocks.begin() + count);
+		sc.cached_count.fetch_sub(count, std::memory_order_relaxed);
+		sc.trimmed_count.fetch_add(count, std::memory_order_relaxed);
+	}
+}
+
+int VoxelMemoryPool::find_least_recently_used_size_class(uint32_t &out_time_msec, uint32_t &out_next_time_msec) {
+	// Finds the size class having the oldest block, and the time of the oldest block among others
+	const unsigned int size_class_count = _size_class_count.load(std::memory_order_acquire);
+	int found_sci = -1;
+	bool has_next = false;
+
+	for (unsigned int i = 0; i < size_class_count; ++i) {
+		SizeClass &sc = _size_classes[i];
+		uint32_t time_msec;
+		{
+			MutexLock lock(sc.mutex);
+			if (sc.blocks.size() == 0) {
+				continue;
+			}
+			time_msec = sc.blocks[0].time_msec;
+		}
+		if (found_sci == -1 || static_cast<int32_t>(time_msec - out_time_msec) < 0) {
+			if (found_sci != -1) {
+				out_next_time_msec = out_time_msec;
+				has_next = true;
+			}
+			out_time_msec = time_msec;
+			found_sci = i;
+
+		} else if (!has_next || static_cast<int32_t>(time_msec - out_next_time_msec) < 0) {
+			out_next_time_msec = time_msec;
+			has_next = true;
+		}
+	}
+
+	if (found_sci != -1 && !has_next) {
+		// No other size class has free blocks, all of this one can go
+		out_next_time_msec = OS::get_singleton()->get_ticks_msec();
+	}
+	return found_sci;
+}
+
+VoxelMemoryPool::ThreadCache *VoxelMemoryPool::get_thread_cache() {
+	ThreadCacheRef &ref = _thread_cache;
+	if (ref.cache == nullptr || ref.pool_generation != _generation) {
+		// First use from this thread
+		ThreadCache *cache = memnew(ThreadCache);
+		{
+			MutexLock lock(_mutex);
+			_thread_caches.push_back(cache);
+		}
+		ref.cache = cache;
+		ref.pool_generation = _generation;
+	}
+	return ref.cache;
+}
+
+void VoxelMemoryPool::release_thread_cache(ThreadCache *cache) {
+	const unsigned int size_class_count = _size_class_count.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < size_class_count; ++i) {
+		Magazine &magazine = cache->magazines[i];
+		if (magazine.count > 0) {
+			flush_magazine(_size_classes[i], magazine, magazine.count);
+		}
+	}
+	{
+		MutexLock lock(_mutex);
+		for (unsigned int i = 0; i < _thread_caches.size(); ++i) {
+			if (_thread_caches[i] == cache) {
+				_thread_caches[i] = _thread_caches.back();
+				_thread_caches.pop_back();
+				break;
+			}
+		}
+	}
+	memdelete(cache);
+}
+
+VoxelMemoryPool::ThreadCacheRef::~ThreadCacheRef() {
+	// If the pool was destroyed before the thread, it freed the cache already
+	if (cache != nullptr && g_memory_pool != nullptr && g_memory_pool->_generation == pool_generation) {
+		g_memory_pool->release_thread_cache(cache);
+	}
 }
 
 void VoxelMemoryPool::clear() {
+	// Threads using the pool are expected to be stopped at this point
 	MutexLock lock(_mutex);
-	const uint32_t *key = nullptr;
-	while ((key = _pools.next(key))) {
-		Pool *pool = _pools.get(*key);
-		CRASH_COND(pool == nullptr);
-		for (auto it = pool->blocks.begin(); it != pool->blocks.end(); ++it) {
-			uint8_t *ptr = *it;
+	const unsigned int size_class_count = _size_class_count.load();
+
+	for (unsigned int i = 0; i < _thread_caches.size(); ++i) {
+		ThreadCache *cache = _thread_caches[i];
+		for (unsigned int j = 0; j < size_class_count; ++j) {
+			Magazine &magazine = cache->magazines[j];
+			for (unsigned int k = 0; k < magazine.count; ++k) {
+				memfree(magazine.blocks[k]);
+			}
+		}
+		memdelete(cache);
+	}
+	_thread_caches.clear();
+
+	for (unsigned int i = 0; i < size_class_count; ++i) {
+		SizeClass &sc = _size_classes[i];
+		for (auto it = sc.blocks.begin(); it != sc.blocks.end(); ++it) {
+			uint8_t *ptr = it->ptr;
 			CRASH_COND(ptr == nullptr);
 			memfree(ptr);
 		}
+		sc.blocks.clear();
+		memdelete(sc.mutex);
+		sc.mutex = nullptr;
 	}
-	_pools.clear();
+	_size_class_count.store(0);
 }
 
 void VoxelMemoryPool::debug_print() {
-	MutexLock lock(_mutex);
 	print_line("-------- VoxelMemoryPool ----------");
-	const uint32_t *key = nullptr;
-	int i = 0;
-	while ((key = _pools.next(key))) {
-		Pool *pool = _pools.get(*key);
-		print_line(String("Pool {0} for size {1}: {2} blocks").format(varray(i, *key, static_cast<int>(pool->blocks.size()))));
-		++i;
+	std::vector<SizeClassStats> stats;
+	debug_get_stats(stats);
+	for (unsigned int i = 0; i < stats.size(); ++i) {
+		const SizeClassStats &s = stats[i];
+		print_line(String("Pool {0} for size {1}: {2} live, {3} cached, {4} max live, {5} trimmed")
+						   .format(varray(i, s.size, s.live, s.cached, s.high_water_mark, s.trimmed)));
 	}
 }
 
 unsigned int VoxelMemoryPool::debug_get_used_blocks() const {
-	MutexLock lock(_mutex);
-	return _used_blocks;
+	unsigned int used_blocks = 0;
+	const unsigned int size_class_count = _size_class_count.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < size_class_count; ++i) {
+		used_blocks += _size_classes[i].live_count.load(std::memory_order_relaxed);
+	}
+	return used_blocks;
+}
+
+void VoxelMemoryPool::debug_get_stats(std::vector<SizeClassStats> &out_stats) const {
+	const unsigned int size_class_count = _size_class_count.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < size_class_count; ++i) {
+		const SizeClass &sc = _size_classes[i];
+		SizeClassStats s;
+		s.size = sc.size.load(std::memory_order_relaxed);
+		s.live = sc.live_count.load(std::memory_order_relaxed);
+		s.cached = sc.cached_count.load(std::memory_order_relaxed);
+		s.high_water_mark = sc.high_water_mark.load(std::memory_order_relaxed);
+		s.trimmed = sc.trimmed_count.load(std::memory_order_relaxed);
+		out_stats.push_back(s);
+	}
+}
+
+int VoxelMemoryPool::find_size_class(uint32_t size) const {
+	const unsigned int size_class_count = _size_class_count.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < size_class_count; ++i) {
+		if (_size_classes[i].size.load(std::memory_order_relaxed) == size) {
+			return i;
+		}
+	}
+	return -1;
 }
 
-VoxelMemoryPool::Pool *VoxelMemoryPool::get_or_create_pool(uint32_t size) {
-	Pool *pool;
-	Pool **ppool = _pools.getptr(size);
-	if (ppool == nullptr) {
-		pool = memnew(Pool);
-		CRASH_COND(pool == nullptr);
-		_pools.set(size, pool);
-	} else {
-		pool = *ppool;
-		CRASH_COND(pool == nullptr);
+int VoxelMemoryPool::get_or_create_size_class(uint32_t size) {
+	int sci = find_size_class(size);
+	if (sci != -1) {
+		return sci;
+	}
+
+	MutexLock lock(_mutex);
+
+	// Another thread could have created it in the meantime
+	sci = find_size_class(size);
+	if (sci != -1) {
+		return sci;
 	}
-	return pool;
+
+	const unsigned int size_class_count = _size_class_count.load(std::memory_order_relaxed);
+	if (size_class_count == MAX_SIZE_CLASSES) {
+		WARN_PRINT_ONCE("VoxelMemoryPool: too many different block sizes, further ones won't be pooled");
+		return -1;
+	}
+
+	SizeClass &sc = _size_classes[size_class_count];
+	sc.size.store(size, std::memory_order_relaxed);
+	sc.mutex = Mutex::create();
+	// Publish only once the size class is ready
+	_size_class_count.store(size_class_count + 1, std::memory_order_release);
+	return size_class_count;
 }
@@ -1,20 +1,33 @@
 #ifndef VOXEL_MEMORY_POOL_H
 #define VOXEL_MEMORY_POOL_H
 
-#include "core/hash_map.h"
+#include "../util/fixed_array.h"
 #include "core/os/mutex.h"
 
+#include <atomic>
 #include <vector>
 
 // Pool based on a scenario where allocated blocks are often the same size.
-// A pool of blocks is assigned for each size.
+// A pool of blocks is assigned for each size, called a size class.
+// Each thread keeps a small cache of free blocks per size class (a "magazine"),
+// so most allocations and recycles don't synchronize with other threads.
+// Magazines exchange half of their blocks with the shared pool when they get empty or full.
+// Free blocks are kept for reuse until `trim` is called, which gives least recently used ones back to the system
+// so that no more than the cache budget remains.
 class VoxelMemoryPool {
-private:
-	struct Pool {
-		std::vector<uint8_t *> blocks;
+public:
+	struct SizeClassStats {
+		uint32_t size = 0;
+		// Blocks currently handed out
+		uint32_t live = 0;
+		// Free blocks kept for reuse, in the shared pool and in thread caches
+		uint32_t cached = 0;
+		// Highest number of blocks handed out at the same time
+		uint32_t high_water_mark = 0;
+		// Free blocks given back to the system by `trim`
+		uint32_t trimmed = 0;
 	};
 
-public:
 	static void create_singleton();
 	static void destroy_singleton();
 	static VoxelMemoryPool *get_singleton();
@@ -25,16 +38,81 @@ public:
 	uint8_t *allocate(uint32_t size);
 	void recycle(uint8_t *block, uint32_t size);
 
+	// Maximum amount of free memory kept for reuse after trimming, in bytes
+	void set_cache_budget(uint64_t bytes);
+	uint64_t get_cache_budget() const;
+
+	// Frees least recently recycled blocks until cached memory fits in the budget.
+	// Blocks held in thread caches are not freed, they are a small bounded amount.
+	void trim();
+
 	void debug_print();
 	unsigned int debug_get_used_blocks() const;
+	void debug_get_stats(std::vector<SizeClassStats> &out_stats) const;
 
 private:
-	Pool *get_or_create_pool(uint32_t size);
+	// Sizes beyond this count are not pooled. Voxel buffers usually use very few different sizes.
+	static const unsigned int MAX_SIZE_CLASSES = 32;
+	static const unsigned int MAGAZINE_CAPACITY = 32;
+
+	struct CachedBlock {
+		uint8_t *ptr;
+		// When the block went to the shared pool, used to trim least recently used blocks first
+		uint32_t time_msec;
+	};
+
+	struct SizeClass {
+		std::atomic<uint32_t> size;
+		std::atomic<uint32_t> live_count;
+		std::atomic<uint32_t> cached_count;
+		std::atomic<uint32_t> high_water_mark;
+		std::atomic<uint32_t> trimmed_count;
+		// Shared free blocks, only accessed in batches. Oldest come first.
+		std::vector<CachedBlock> blocks;
+		Mutex *mutex = nullptr;
+	};
+
+	struct Magazine {
+		unsigned int count = 0;
+		FixedArray<uint8_t *, MAGAZINE_CAPACITY> blocks;
+	};
+
+	struct ThreadCache {
+		FixedArray<Magazine, MAX_SIZE_CLASSES> magazines;
+	};
+
+	// Gives back cached blocks when a thread exits
+	struct ThreadCacheRef {
+		ThreadCache *cache = nullptr;
+		uint32_t pool_generation = 0;
+
+		~ThreadCacheRef();
+	};
+
+	int find_size_class(uint32_t size) const;
+	int get_or_create_size_class(uint32_t size);
+
+	ThreadCache *get_thread_cache();
+	void release_thread_cache(ThreadCache *cache);
+
+	void refill_magazine(SizeClass &sc, Magazine &magazine);
+	void flush_magazine(SizeClass &sc, Magazine &magazine, unsigned int count);
+
+	int find_least_recently_used_size_class(uint32_t &out_time_msec, uint32_t &out_next_time_msec);
+
 	void clear();
 
-	HashMap<uint32_t, Pool *> _pools;
-	unsigned int _used_blocks = 0;
+	static thread_local ThreadCacheRef _thread_cache;
+
+	FixedArray<SizeClass, MAX_SIZE_CLASSES> _size_classes;
+	std::atomic<unsigned int> _size_class_count;
+	std::atomic<uint64_t> _cache_budget;
+	// Identifies this pool among the ones created over time, so threads can't use a cache from a previous one
+	uint32_t _generation = 0;
+
+	// Protects creation of size classes and the list of thread caches
 	Mutex *_mutex = nullptr;
+	std::vector<ThreadCache *> _thread_caches;
 };
 
 #endif // VOXEL_MEMORY_POOL_H
@@ -0,0 +1,124 @@
+#ifndef VOXEL_METADATA_MAP_H
+#define VOXEL_METADATA_MAP_H
+
+#include <core/variant.h>
+
+#include <algorithm>
+#include <vector>
+
+// Stores metadata of voxels, keyed by their index within a buffer.
+// Keys are kept sorted in a flat array, with values in a parallel array.
+// Lookups are binary searches, voxels of a row along Y are contiguous, and copies don't allocate per entry.
+class VoxelMetadataMap {
+public:
+	inline unsigned int size() const {
+		return _keys.size();
+	}
+
+	inline uint32_t get_key(unsigned int i) const {
+		return _keys[i];
+	}
+
+	inline const Variant &get_value(unsigned int i) const {
+		return _values[i];
+	}
+
+	const Variant *find(uint32_t key) const {
+		const unsigned int i = lower_bound(key);
+		if (i < _keys.size() && _keys[i] == key) {
+			return &_values[i];
+		}
+		return nullptr;
+	}
+
+	void set(uint32_t key, const Variant &value) {
+		const unsigned int i = lower_bound(key);
+		if (i < _keys.size() && _keys[i] == key) {
+			_values[i] = value;
+		} else {
+			// Entries are often added in order, such as when loading, which makes this an append
+			_keys.insert(_keys.begin() + i, key);
+			_values.insert(_values.begin() + i, value);
+		}
+	}
+
+	void erase(uint32_t key) {
+		const unsigned int i = lower_bound(key);
+		if (i < _keys.size() && _keys[i] == key) {
+			erase_range(i, i + 1);
+		}
+	}
+
+	void erase_range(unsigned int begin, unsigned int end) {
+		_keys.erase(_keys.begin() + begin, _keys.begin() + end);
+		_values.erase(_values.begin() + begin, _values.begin() + end);
+	}
+
+	// Gets the range of entries having keys in [begin_key, end_key[
+	inline void get_range(uint32_t begin_key, uint32_t end_key, unsigned int &out_begin, unsigned int &out_end) const {
+		out_begin = lower_bound(begin_key);
+		out_end = out_begin + (std::lower_bound(_keys.begin() + out_begin, _keys.end(), end_key) -
+									  (_keys.begin() + out_begin));
+	}
+
+	void clear() {
+		_keys.clear();
+		_values.clear();
+	}
+
+	// Replaces contents with a deep copy of another map
+	void copy_from(const VoxelMetadataMap &other) {
+		_keys = other._keys;
+		_values.resize(other._values.size());
+		for (unsigned int i = 0; i < _values.size(); ++i) {
+			_values[i] = other._values[i].duplicate();
+		}
+	}
+
+	// Sets many entries at once. Keys must be sorted and unique.
+	// Existing entries with the same keys are replaced.
+	void set_sorted(const std::vector<uint32_t> &keys, const std::vector<Variant> &values) {
+		CRASH_COND(keys.size() != values.size());
+		if (keys.size() == 0) {
+			return;
+		}
+
+		std::vector<uint32_t> merged_keys;
+		std::vector<Variant> merged_values;
+		merged_keys.reserve(_keys.size() + keys.size());
+		merged_values.reserve(_keys.size() + keys.size());
+
+		unsigned int i = 0;
+		unsigned int j = 0;
+		while (i < _keys.size() || j < keys.size()) {
+			if (j == keys.size() || (i < _keys.size() && _keys[i] < keys[j])) {
+				merged_keys.push_back(_keys[i]);
+				merged_values.push_back(_values[i]);
+				++i;
+			} else {
+				if (i < _keys.size() && _keys[i] == keys[j]) {
+					++i;
+				}
+				merged_keys.push_back(keys[j]);
+				merged_values.push_back(values[j]);
+				++j;
+			}
+		}
+
+		_keys.swap(merged_keys);
+		_values.swap(merged_values);
+	}
+
+private:
+	inline unsigned int lower_bound(uint32_t key) const {
+		if (_keys.size() == 0 || _keys.back() < key) {
+			return _keys.size();
+		}
+		return std::lower_bound(_keys.begin(), _keys.end(), key) - _keys.begin();
+	}
+
+	std::vector<uint32_t> _keys;
+	std::vector<Variant> _values;
+};
+
+#endif // VOXEL_METADATA_MAP_H
@@ -3,9 +3,20 @@
 #include "../util/macros.h"
 #include "../util/profiling.h"
 #include "file_utils.h"
+#include <core/io/marshalls.h>
+#include <core/os/dir_access.h>
 #include <core/os/file_access.h>
+#include <core/project_settings.h>
 #include <algorithm>
 
+#if defined(__linux__)
+#define VOXEL_REGION_FILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace {
 const uint8_t FORMAT_VERSION = 3;
 
@@ -72,37 +83,34 @@ Error VoxelRegionFile::open(const String &fpath, bool create_if_not_found) {
 
 	_file_access = f;
 
-	// Precalculate location of sectors and which block they contain.
-	// This will be useful to know when sectors get moved on insertion and removal
+	// Find which sectors are free. Sectors past the last block may be left over from previous versions,
+	// which moved blocks without shortening the file, so they are free as well.
+	const uint32_t data_size = f->get_len() > _blocks_begin_offset ? f->get_len() - _blocks_begin_offset : 0;
+	const uint32_t file_sector_count = data_size == 0 ? 0 : get_sector_count_from_bytes(data_size);
 
-	struct BlockInfoAndIndex {
-		BlockInfo b;
-		unsigned int i;
-	};
+	CRASH_COND(_free_sectors.size() != 0);
+	_free_sectors.resize(file_sector_count, true);
+	_free_sector_count = file_sector_count;
 
-	// Filter only present blocks and keep the index around because it represents the 3D position of the block
-	std::vector<BlockInfoAndIndex> blocks_sorted_by_offset;
 	for (unsigned int i = 0; i < _header.blocks.size(); ++i) {
 		const BlockInfo b = _header.blocks[i];
-		if (b.data != 0) {
-			BlockInfoAndIndex p;
-			p.b = b;
-			p.i = i;
-			blocks_sorted_by_offset.push_back(p);
+		if (b.data == 0) {
+			continue;
 		}
-	}
-
-	std::sort(blocks_sorted_by_offset.begin(), blocks_sorted_by_offset.end(),
-			[](const BlockInfoAndIndex &a, const BlockInfoAndIndex &b) {
-				return a.b.get_sector_index() < b.b.get_sector_index();
-			});
-
-	CRASH_COND(_sectors.size() != 0);
-	for (unsigned int i = 0; i < blocks_sorted_by_offset.size(); ++i) {
-		const BlockInfoAndIndex b = blocks_sorted_by_offset[i];
-		Vector3i bpos = get_block_position_from_index(b.i);
-		for (unsigned int j = 0; j < b.b.get_sector_count(); ++j) {
-			_sectors.push_back(bpos);
+		const uint32_t end_sector = b.get_sector_index() + b.get_sector_count();
+		if (end_sector > _free_sectors.size()) {
+			// File was cut short. The block will fail to load, but its sectors must not be handed out.
+			_free_sector_count += end_sector - _free_sectors.size();
+			_free_sectors.resize(end_sector, true);
+		}
+		for (uint32_t j = b.get_sector_index(); j < end_sector; ++j) {
+			if (_free_sectors[j]) {
+				_free_sectors[j] = false;
+				--_free_sector_count;
+			} else {
+				ERR_PRINT(String("Block {0} overlaps another in region file {1}")
+								  .format(varray(get_block_position_from_index(i).to_vec3(), _file_path)));
+			}
 		}
 	}
 
@@ -124,7 +132,9 @@ Error VoxelRegionFile::close() {
 		memdelete(_file_access);
 		_file_access = nullptr;
 	}
-	_sectors.clear();
+	unmap_file();
+	_free_sectors.clear();
+	_free_sector_count = 0;
 	return err;
 }
 
@@ -164,8 +174,8 @@ const VoxelRegionFile::Format &VoxelRegionFile::get_format() const {
 	return _header.format;
 }
 
-Error VoxelRegionFile::load_block(
-		Vector3i position, Ref<VoxelBuffer> out_block, VoxelBlockSerializerInternal &serializer) {
+Error VoxelRegionFile::load_block(Vector3i position, Ref<VoxelBuffer> out_block,
+		VoxelBlockSerializerInternal &serializer, std::vector<uint8_t> *out_compressed_data) {
 
 	ERR_FAIL_COND_V(out_block.is_null(), ERR_INVALID_PARAMETER);
 	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_READ);
@@ -186,18 +196,117 @@ Error VoxelRegionFile::load_block(
 	}
 
 	const unsigned int sector_index = block_info.get_sector_index();
+	const size_t block_offset = _blocks_begin_offset + sector_index * _header.format.sector_size;
+
+	if (_memory_mapping_enabled) {
+		flush_writes();
+		// The block is followed by padding up to the end of its last sector
+		const size_t block_end = block_offset + block_info.get_sector_count() * _header.format.sector_size;
+		if (ensure_mapped(block_end)) {
+			const uint8_t *block_data = _mapped_data + block_offset;
+			const uint32_t block_data_size = decode_uint32(block_data);
+			ERR_FAIL_COND_V(sizeof(uint32_t) + block_data_size > block_end - block_offset, ERR_PARSE_ERROR);
+
+			if (out_compressed_data != nullptr) {
+				const uint8_t *begin = block_data + sizeof(uint32_t);
+				out_compressed_data->assign(begin, begin + block_data_size);
+			}
+
+			ERR_FAIL_COND_V_MSG(!serializer.decompress_and_deserialize(
+										block_data + sizeof(uint32_t), block_data_size, **out_block),
+					ERR_PARSE_ERROR, String("Failed to read block {0}").format(varray(position.to_vec3())));
+
+			return OK;
+		}
+		// Could not map, read normally
+	}
 
-	f->seek(_blocks_begin_offset + sector_index * _header.format.sector_size);
+	f->seek(block_offset);
 
 	unsigned int block_data_size = f->get_32();
 	CRASH_COND(f->eof_reached());
 
+	if (out_compressed_data != nullptr) {
+		out_compressed_data->resize(block_data_size);
+		const unsigned int read_size = f->get_buffer(out_compressed_data->data(), block_data_size);
+		ERR_FAIL_COND_V(read_size != block_data_size, ERR_FILE_CORRUPT);
+
+		ERR_FAIL_COND_V_MSG(!serializer.decompress_and_deserialize(*out_compressed_data, **out_block),
+				ERR_PARSE_ERROR, String("Failed to read block {0}").format(varray(position.to_vec3())));
+		return OK;
+	}
+
 	ERR_FAIL_COND_V_MSG(!serializer.decompress_and_deserialize(f, block_data_size, **out_block), ERR_PARSE_ERROR,
 			String("Failed to read block {0}").format(varray(position.to_vec3())));
 
 	return OK;
 }
 
+void VoxelRegionFile::prefetch_blocks(const std::vector<Vector3i> &positions) {
+#ifdef VOXEL_REGION_FILE_MMAP
+	VOXEL_PROFILE_SCOPE();
+	if (!_memory_mapping_enabled || _file_access == nullptr) {
+		return;
+	}
+
+	struct Range {
+		size_t begin;
+		size_t end;
+	};
+
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	const uint32_t sector_size = _header.format.sector_size;
+
+	std::vector<Range> ranges;
+	size_t max_end = 0;
+	for (unsigned int i = 0; i < positions.size(); ++i) {
+		const unsigned int lut_index = get_block_index_in_header(positions[i]);
+		ERR_CONTINUE(lut_index >= _header.blocks.size());
+		const BlockInfo block_info = _header.blocks[lut_index];
+		if (block_info.data == 0) {
+			continue;
+		}
+		Range r;
+		r.begin = _blocks_begin_offset + block_info.get_sector_index() * sector_size;
+		r.end = r.begin + block_info.get_sector_count() * sector_size;
+		max_end = MAX(max_end, r.end);
+		// madvise works on whole pages
+		r.begin -= r.begin % page_size;
+		ranges.push_back(r);
+	}
+
+	if (ranges.size() == 0) {
+		return;
+	}
+
+	flush_writes();
+	if (!ensure_mapped(max_end)) {
+		return;
+	}
+
+	// Neighbor blocks are requested together
+	std::sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b) { return a.begin < b.begin; });
+	Range current = ranges[0];
+	for (unsigned int i = 1; i <= ranges.size(); ++i) {
+		if (i < ranges.size() && ranges[i].begin <= current.end) {
+			current.end = MAX(current.end, ranges[i].end);
+			continue;
+		}
+		// Asynchronous, the kernel starts reading and returns
+		madvise(const_cast<uint8_t *>(_mapped_data) + current.begin, current.end - current.begin, MADV_WILLNEED);
+		if (i < ranges.size()) {
+			current = ranges[i];
+		}
+	}
+#endif
+}
+
+uint32_t VoxelRegionFile::get_block_sector_index(Vector3i position) const {
+	const unsigned int lut_index = get_block_index_in_header(position);
+	ERR_FAIL_COND_V(lut_index >= _header.blocks.size(), 0);
+	return _header.blocks[lut_index].get_sector_index();
+}
+
 bool VoxelRegionFile::verify_format(VoxelBuffer &block) {
 	ERR_FAIL_COND_V(block.get_size() != Vector3i(1 << _header.format.block_size_po2), false);
 	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
@@ -206,7 +315,8 @@ bool VoxelRegionFile::verify_format(VoxelBuffer &block) {
 	return true;
 }
 
-Error VoxelRegionFile::save_block(Vector3i position, Ref<VoxelBuffer> block, VoxelBlockSerializerInternal &serializer) {
+Error VoxelRegionFile::save_block(Vector3i position, Ref<VoxelBuffer> block, VoxelBlockSerializerInternal &serializer,
+		std::vector<uint8_t> *out_compressed_data) {
 	ERR_FAIL_COND_V(block.is_null(), ERR_INVALID_PARAMETER);
 	ERR_FAIL_COND_V(verify_format(**block) == false, ERR_INVALID_PARAMETER);
 
@@ -222,187 +332,306 @@ Error VoxelRegionFile::save_block(Vector3i position, Ref<VoxelBuffer> block, Vox
 	ERR_FAIL_COND_V(lut_index >= _header.blocks.size(), ERR_INVALID_PARAMETER);
 	BlockInfo &block_info = _header.blocks[lut_index];
 
-	if (block_info.data == 0) {
-		// The block isn't in the file yet, append at the end
-
-		const unsigned int end_offset = _blocks_begin_offset + _sectors.size() * _header.format.sector_size;
-		f->seek(end_offset);
-		const unsigned int block_offset = f->get_position();
-		// Check position matches the sectors rule
-		CRASH_COND((block_offset - _blocks_begin_offset) % _header.format.sector_size != 0);
+	const std::vector<uint8_t> &data = serializer.serialize_and_compress(**block);
+	const uint32_t written_size = sizeof(int) + data.size();
 
-		const std::vector<uint8_t> &data = serializer.serialize_and_compress(**block);
-		f->store_32(data.size());
-		const unsigned int written_size = sizeof(int) + data.size();
-		f->store_buffer(data.data(), data.size());
+	const uint32_t new_sector_count = get_sector_count_from_bytes(written_size);
+	ERR_FAIL_COND_V_MSG(new_sector_count > BlockInfo::MAX_SECTOR_COUNT, ERR_OUT_OF_MEMORY,
+			String("Block {0} is too large for sectors of {1} bytes")
+					.format(varray(position.to_vec3(), _header.format.sector_size)));
 
-		const unsigned int end_pos = f->get_position();
-		CRASH_COND(written_size != (end_pos - block_offset));
-		pad_to_sector_size(f);
+	uint32_t sector_index;
 
-		block_info.set_sector_index((block_offset - _blocks_begin_offset) / _header.format.sector_size);
-		block_info.set_sector_count(get_sector_count_from_bytes(written_size));
+	if (block_info.data != 0 && new_sector_count <= block_info.get_sector_count()) {
+		// We can write the block at the same spot, sectors it no longer needs become free
+		sector_index = block_info.get_sector_index();
+		const uint32_t old_sector_count = block_info.get_sector_count();
+		if (new_sector_count < old_sector_count) {
+			free_sectors(sector_index + new_sector_count, old_sector_count - new_sector_count);
+		}
 
-		for (unsigned int i = 0; i < block_info.get_sector_count(); ++i) {
-			_sectors.push_back(position);
+	} else {
+		// The block isn't in the file yet, or grew. Move it to free sectors, or at the end of the file.
+		// Other blocks stay where they are.
+		if (block_info.data != 0) {
+			free_sectors(block_info.get_sector_index(), block_info.get_sector_count());
+			block_info.data = 0;
+			_header_modified = true;
 		}
+		ERR_FAIL_COND_V(!allocate_sectors(new_sector_count, sector_index), ERR_FILE_CANT_WRITE);
+	}
 
-		_header_modified = true;
+	const unsigned int block_offset = _blocks_begin_offset + sector_index * _header.format.sector_size;
+	f->seek(block_offset);
 
-		//print_line(String("Block saved flen={0}").format(varray(f->get_len())));
+	f->store_32(data.size());
+	f->store_buffer(data.data(), data.size());
 
-	} else {
-		// The block is already in the file
+	const unsigned int end_pos = f->get_position();
+	CRASH_COND(written_size != (end_pos - block_offset));
+	// Required if the block is at the end of the file, so following blocks still start at sector boundaries
+	pad_to_sector_size(f);
 
-		CRASH_COND(_sectors.size() == 0);
+	_has_unflushed_writes = true;
 
-		const int old_sector_index = block_info.get_sector_index();
-		const int old_sector_count = block_info.get_sector_count();
-		CRASH_COND(old_sector_count < 1);
+	if (block_info.get_sector_index() != sector_index || block_info.get_sector_count() != new_sector_count) {
+		block_info.set_sector_index(sector_index);
+		block_info.set_sector_count(new_sector_count);
+		_header_modified = true;
+	}
 
-		const std::vector<uint8_t> &data = serializer.serialize_and_compress(**block);
-		const int written_size = sizeof(int) + data.size();
+	if (out_compressed_data != nullptr) {
+		*out_compressed_data = data;
+	}
 
-		const int new_sector_count = get_sector_count_from_bytes(written_size);
-		CRASH_COND(new_sector_count < 1);
+	return OK;
+}
 
-		if (new_sector_count <= old_sector_count) {
-			// We can write the block at the same spot
+void VoxelRegionFile::pad_to_sector_size(FileAccess *f) {
+	int rpos = f->get_position() - _blocks_begin_offset;
+	if (rpos == 0) {
+		return;
+	}
+	CRASH_COND(rpos < 0);
+	int pad = _header.format.sector_size - (rpos - 1) % _header.format.sector_size - 1;
+	for (int i = 0; i < pad; ++i) {
+		// Virtual function called many times, hmmmm...
+		f->store_8(0);
+	}
+}
 
-			if (new_sector_count < old_sector_count) {
-				// The block now uses less sectors, we can compact others.
-				remove_sectors_from_block(position, old_sector_count - new_sector_count);
-				_header_modified = true;
+bool VoxelRegionFile::allocate_sectors(uint32_t sector_count, uint32_t &out_sector_index) {
+	CRASH_COND(sector_count == 0);
+
+	// First fit. A free run touching the end of the file can be extended.
+	uint32_t run_begin = 0;
+	uint32_t run_size = 0;
+	if (_free_sector_count > 0) {
+		for (uint32_t i = 0; i < _free_sectors.size(); ++i) {
+			if (_free_sectors[i]) {
+				if (run_size == 0) {
+					run_begin = i;
+				}
+				++run_size;
+				if (run_size == sector_count) {
+					break;
+				}
+			} else {
+				run_size = 0;
 			}
+		}
+	}
+	if (run_size == 0) {
+		run_begin = _free_sectors.size();
+	}
 
-			const int block_offset = _blocks_begin_offset + old_sector_index * _header.format.sector_size;
-			f->seek(block_offset);
+	const uint32_t run_end = run_begin + sector_count;
+	ERR_FAIL_COND_V_MSG(run_end - 1 > BlockInfo::MAX_SECTOR_INDEX, false,
+			String("Region file {0} has no room left").format(varray(_file_path)));
 
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
+	if (run_end > _free_sectors.size()) {
+		_free_sector_count += run_end - _free_sectors.size();
+		_free_sectors.resize(run_end, true);
+	}
+	for (uint32_t i = run_begin; i < run_end; ++i) {
+		CRASH_COND(!_free_sectors[i]);
+		_free_sectors[i] = false;
+	}
+	_free_sector_count -= sector_count;
 
-			int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+	out_sector_index = run_begin;
+	return true;
+}
 
-		} else {
-			// The block now uses more sectors, we have to move others.
-			// Note: we could shift blocks forward, but we can also remove the block entirely and rewrite it at the end.
-			// Need to investigate if it's worth implementing forward shift instead.
+void VoxelRegionFile::free_sectors(uint32_t sector_index, uint32_t sector_count) {
+	CRASH_COND(sector_index + sector_count > _free_sectors.size());
+	for (uint32_t i = sector_index; i < sector_index + sector_count; ++i) {
+		CRASH_COND(_free_sectors[i]);
+		_free_sectors[i] = true;
+	}
+	_free_sector_count += sector_count;
+}
 
-			remove_sectors_from_block(position, old_sector_count);
+void VoxelRegionFile::set_memory_mapping_enabled(bool enabled) {
+	_memory_mapping_enabled = enabled && is_memory_mapping_supported();
+	if (!_memory_mapping_enabled) {
+		unmap_file();
+	}
+}
 
-			const int block_offset = _blocks_begin_offset + _sectors.size() * _header.format.sector_size;
-			f->seek(block_offset);
+bool VoxelRegionFile::is_memory_mapping_enabled() const {
+	return _memory_mapping_enabled;
+}
 
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
+bool VoxelRegionFile::is_memory_mapping_supported() {
+#ifdef VOXEL_REGION_FILE_MMAP
+	return true;
+#else
+	return false;
+#endif
+}
 
-			const int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+// Maps the file so the given range can be read. The mapping is made again if the file grew.
+bool VoxelRegionFile::ensure_mapped(size_t end_offset) {
+#ifdef VOXEL_REGION_FILE_MMAP
+	if (end_offset <= _mapped_size) {
+		return true;
+	}
 
-			pad_to_sector_size(f);
+	if (_mapped_fd == -1) {
+		// FileAccess doesn't expose its file descriptor, so the file is opened a second time, read-only
+		const String path = ProjectSettings::get_singleton()->globalize_path(_file_path);
+		_mapped_fd = ::open(path.utf8().get_data(), O_RDONLY | O_CLOEXEC);
+		if (_mapped_fd == -1) {
+			ERR_PRINT(String("Could not open {0} for memory mapping, using FileAccess instead").format(varray(path)));
+			_memory_mapping_enabled = false;
+			return false;
+		}
+	}
 
-			block_info.set_sector_index(_sectors.size());
-			for (int i = 0; i < new_sector_count; ++i) {
-				_sectors.push_back(Vector3u16(position));
-			}
+	struct stat file_stat;
+	if (fstat(_mapped_fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < end_offset) {
+		// File is shorter than expected, let FileAccess report it
+		return false;
+	}
 
-			_header_modified = true;
-		}
+	if (_mapped_data != nullptr) {
+		munmap(const_cast<uint8_t *>(_mapped_data), _mapped_size);
+		_mapped_data = nullptr;
+		_mapped_size = 0;
+	}
 
-		block_info.set_sector_count(new_sector_count);
+	const size_t file_size = file_stat.st_size;
+	void *p = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, _mapped_fd, 0);
+	if (p == MAP_FAILED) {
+		return false;
 	}
 
-	return OK;
+	_mapped_data = static_cast<const uint8_t *>(p);
+	_mapped_size = file_size;
+	return true;
+#else
+	return false;
+#endif
 }
 
-void VoxelRegionFile::pad_to_sector_size(FileAccess *f) {
-	int rpos = f->get_position() - _blocks_begin_offset;
-	if (rpos == 0) {
-		return;
+void VoxelRegionFile::flush_writes() {
+	if (_has_unflushed_writes) {
+		_file_access->flush();
+		_has_unflushed_writes = false;
 	}
-	CRASH_COND(rpos < 0);
-	int pad = _header.format.sector_size - (rpos - 1) % _header.format.sector_size - 1;
-	for (int i = 0; i < pad; ++i) {
-		// Virtual function called many times, hmmmm...
-		f->store_8(0);
+}
+
+void VoxelRegionFile::unmap_file() {
+#ifdef VOXEL_REGION_FILE_MMAP
+	if (_mapped_data != nullptr) {
+		munmap(const_cast<uint8_t *>(_mapped_data), _mapped_size);
+	}
+	if (_mapped_fd != -1) {
+		::close(_mapped_fd);
 	}
+#endif
+	_mapped_data = nullptr;
+	_mapped_size = 0;
+	_mapped_fd = -1;
+	_has_unflushed_writes = false;
 }
 
-void VoxelRegionFile::remove_sectors_from_block(Vector3i block_pos, unsigned int p_sector_count) {
+Error VoxelRegionFile::compact() {
 	VOXEL_PROFILE_SCOPE();
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
 
-	// Removes sectors from a block, starting from the last ones.
-	// So if a block has 5 sectors and we remove 2, the first 3 will be preserved.
-	// Then all following sectors are moved earlier in the file to fill the gap.
-
-	CRASH_COND(_file_access == nullptr);
-	CRASH_COND(p_sector_count <= 0);
+	if (_header.version != FORMAT_VERSION) {
+		ERR_FAIL_COND_V(migrate_to_latest(_file_access) == false, ERR_UNAVAILABLE);
+	}
 
-	FileAccess *f = _file_access;
-	const unsigned int sector_size = _header.format.sector_size;
-	const unsigned int old_end_offset = _blocks_begin_offset + _sectors.size() * sector_size;
+	if (_free_sector_count == 0) {
+		return OK;
+	}
 
-	const unsigned int block_index = get_block_index_in_header(block_pos);
-	CRASH_COND(block_index >= _header.blocks.size());
-	BlockInfo &block_info = _header.blocks[block_index];
+	// In case compaction fails, the file must stay valid as it is
+	if (_header_modified) {
+		ERR_FAIL_COND_V(!save_header(_file_access), ERR_FILE_CANT_WRITE);
+	}
 
-	unsigned int src_offset = _blocks_begin_offset +
-							  (block_info.get_sector_index() + block_info.get_sector_count()) * sector_size;
+	// Blocks keep their order in the file, without gaps between them
+	std::vector<unsigned int> block_indexes;
+	for (unsigned int i = 0; i < _header.blocks.size(); ++i) {
+		if (_header.blocks[i].data != 0) {
+			block_indexes.push_back(i);
+		}
+	}
+	const std::vector<BlockInfo> &blocks = _header.blocks;
+	std::sort(block_indexes.begin(), block_indexes.end(), [&blocks](unsigned int a, unsigned int b) {
+		return blocks[a].get_sector_index() < blocks[b].get_sector_index();
+	});
+
+	const std::vector<BlockInfo> old_blocks = _header.blocks;
+	uint32_t next_sector_index = 0;
+	for (unsigned int i = 0; i < block_indexes.size(); ++i) {
+		BlockInfo &b = _header.blocks[block_indexes[i]];
+		b.set_sector_index(next_sector_index);
+		next_sector_index += b.get_sector_count();
+	}
 
-	unsigned int dst_offset = src_offset - p_sector_count * sector_size;
+	// FileAccess can't shorten a file, so the compacted version is written next to it and replaces it
+	const String temp_path = _file_path + ".tmp";
+	Error err;
+	FileAccess *dst = FileAccess::open(temp_path, FileAccess::WRITE, &err);
+	if (dst == nullptr) {
+		_header.blocks = old_blocks;
+		ERR_PRINT(String("Could not create {0}, error {1}").format(varray(temp_path, err)));
+		return err;
+	}
 
-	// Note: removing the last block from a region doesn't make the file invalid, but is not a known use case
-	CRASH_COND(_sectors.size() - p_sector_count <= 0);
-	CRASH_COND(src_offset - sector_size < dst_offset);
-	CRASH_COND(block_info.get_sector_index() + p_sector_count > _sectors.size());
-	CRASH_COND(p_sector_count > block_info.get_sector_count());
-	CRASH_COND(dst_offset < _blocks_begin_offset);
+	bool written = save_header(dst);
 
+	FileAccess *src = _file_access;
+	const uint32_t sector_size = _header.format.sector_size;
 	std::vector<uint8_t> temp;
-	temp.resize(sector_size);
-
-	// TODO There might be a faster way to shrink a file
-	// Erase sectors from file
-	while (src_offset < old_end_offset) {
-		f->seek(src_offset);
-		size_t read_bytes = f->get_buffer(temp.data(), sector_size);
-		CRASH_COND(read_bytes != sector_size); // Corrupted file
-
-		f->seek(dst_offset);
-		f->store_buffer(temp.data(), sector_size);
 
-		src_offset += sector_size;
-		dst_offset += sector_size;
+	for (unsigned int i = 0; i < block_indexes.size() && written; ++i) {
+		const BlockInfo old_block = old_blocks[block_indexes[i]];
+		const uint32_t size_in_bytes = old_block.get_sector_count() * sector_size;
+		temp.resize(size_in_bytes);
+		src->seek(_blocks_begin_offset + old_block.get_sector_index() * sector_size);
+		if (src->get_buffer(temp.data(), size_in_bytes) != size_in_bytes) {
+			ERR_PRINT(String("Could not read block {0} from {1}")
+							  .format(varray(get_block_position_from_index(block_indexes[i]).to_vec3(), _file_path)));
+			written = false;
+		} else {
+			dst->store_buffer(temp.data(), size_in_bytes);
+		}
 	}
 
-	// TODO We need to truncate the end of the file since we effectively shortened it,
-	// but FileAccess doesn't have any function to do that... so can't rely on EOF either
+	memdelete(dst);
 
-	// Erase sectors from cache
-	_sectors.erase(
-			_sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count() - p_sector_count),
-			_sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count()));
+	if (!written) {
+		_header.blocks = old_blocks;
+		DirAccess::remove_file_or_error(temp_path);
+		return ERR_FILE_CANT_WRITE;
+	}
 
-	const unsigned int old_sector_index = block_info.get_sector_index();
+	// The header was saved in the new file
+	_header_modified = false;
+	memdelete(_file_access);
+	_file_access = nullptr;
+	unmap_file();
+	_free_sectors.clear();
+	_free_sector_count = 0;
 
-	// Reduce sectors of current block in header.
-	if (block_info.get_sector_count() > p_sector_count) {
-		block_info.set_sector_count(block_info.get_sector_count() - p_sector_count);
-	} else {
-		// Block removed
-		block_info.data = 0;
+	{
+		DirAccessRef da = DirAccess::create_for_path(_file_path.get_base_dir());
+		ERR_FAIL_COND_V(!da, ERR_CANT_CREATE);
+		err = da->rename(temp_path, _file_path);
 	}
-
-	// Shift sector index of following blocks
-	if (old_sector_index < _sectors.size()) {
-		for (unsigned int i = 0; i < _header.blocks.size(); ++i) {
-			BlockInfo &b = _header.blocks[i];
-			if (b.data != 0 && b.get_sector_index() > old_sector_index) {
-				b.set_sector_index(b.get_sector_index() - p_sector_count);
-			}
-		}
+	if (err != OK) {
+		ERR_PRINT(String("Could not replace {0} with its compacted version, error {1}").format(varray(_file_path, err)));
 	}
+
+	// Opening again finds free sectors, which there should be none of
+	const Error open_err = open(_file_path, false);
+	return err != OK ? err : open_err;
 }
 
 bool VoxelRegionFile::save_header(FileAccess *f) {
@@ -595,6 +824,14 @@ bool VoxelRegionFile::has_block(Vector3i position) const {
 	return _header.blocks[bi].data != 0;
 }
 
+unsigned int VoxelRegionFile::get_sector_count() const {
+	return _free_sectors.size();
+}
+
+unsigned int VoxelRegionFile::get_free_sector_count() const {
+	return _free_sector_count;
+}
+
 bool VoxelRegionFile::has_block(unsigned int index) const {
 	ERR_FAIL_COND_V(!is_open(), false);
 	CRASH_COND(index >= _header.blocks.size());
@@ -43,14 +43,38 @@ public:
 	bool set_format(const Format &format);
 	const Format &get_format() const;
 
-	Error load_block(Vector3i position, Ref<VoxelBuffer> out_block, VoxelBlockSerializerInternal &serializer);
-	Error save_block(Vector3i position, Ref<VoxelBuffer> block, VoxelBlockSerializerInternal &serializer);
+	// When enabled, blocks are decompressed straight from a read-only memory mapping of the file,
+	// instead of being copied through FileAccess first. Only Linux supports it, other platforms keep using FileAccess.
+	void set_memory_mapping_enabled(bool enabled);
+	bool is_memory_mapping_enabled() const;
+	static bool is_memory_mapping_supported();
+
+	// If given, `out_compressed_data` receives the block as stored in the file, so it can be kept without
+	// compressing it again. Same for saves.
+	Error load_block(Vector3i position, Ref<VoxelBuffer> out_block, VoxelBlockSerializerInternal &serializer,
+			std::vector<uint8_t> *out_compressed_data = nullptr);
+
+	// Tells the system the given blocks will be loaded soon. Reads of all of them are sent to the device at once,
+	// and can complete while blocks loaded first are being decompressed. Only has an effect with memory mapping.
+	void prefetch_blocks(const std::vector<Vector3i> &positions);
+	// Where the block is stored in the file. Loading blocks in this order makes reads go forward only.
+	uint32_t get_block_sector_index(Vector3i position) const;
+	Error save_block(Vector3i position, Ref<VoxelBuffer> block, VoxelBlockSerializerInternal &serializer,
+			std::vector<uint8_t> *out_compressed_data = nullptr);
+
+	// Rewrites the file so blocks are stored next to each other, giving space of free sectors back to the system.
+	// This can take a while on large files, and must not run while other threads use the region.
+	Error compact();
 
 	unsigned int get_header_block_count() const;
 	bool has_block(Vector3i position) const;
 	bool has_block(unsigned int index) const;
 	Vector3i get_block_position_from_index(uint32_t i) const;
 
+	// Sectors the file spans, and how many of them are not used by any block
+	unsigned int get_sector_count() const;
+	unsigned int get_free_sector_count() const;
+
 private:
 	bool save_header(FileAccess *f);
 	Error load_header(FileAccess *f);
@@ -59,7 +83,11 @@ private:
 	uint32_t get_sector_count_from_bytes(uint32_t size_in_bytes) const;
 
 	void pad_to_sector_size(FileAccess *f);
-	void remove_sectors_from_block(Vector3i block_pos, unsigned int p_sector_count);
+	bool allocate_sectors(uint32_t sector_count, uint32_t &out_sector_index);
+	bool ensure_mapped(size_t end_offset);
+	void flush_writes();
+	void unmap_file();
+	void free_sectors(uint32_t sector_index, uint32_t sector_count);
 
 	bool migrate_to_latest(FileAccess *f);
 	static uint32_t get_header_size_v3(const Format &format);
@@ -109,22 +137,19 @@ private:
 
 	Header _header;
 
-	struct Vector3u16 {
-		uint16_t x;
-		uint16_t y;
-		uint16_t z;
-
-		Vector3u16(Vector3i p) :
-				x(p.x), y(p.y), z(p.z) {}
-	};
-
-	// TODO Is it ever read?
-	// List of sectors in the order they appear in the file,
-	// and which position their block is. The same block can span multiple sectors.
-	// This is essentially a reverse table of `Header::blocks`.
-	std::vector<Vector3u16> _sectors;
+	// Which sectors of the file are not used by any block, rebuilt from the header when the file is opened.
+	// Blocks changing size are moved into free sectors or at the end, so other blocks never have to move.
+	std::vector<bool> _free_sectors;
+	unsigned int _free_sector_count = 0;
 	size_t _blocks_begin_offset;
 	String _file_path;
+
+	bool _memory_mapping_enabled = false;
+	// Writes go through FileAccess, which may buffer them. They must be flushed before reading the mapping.
+	bool _has_unflushed_writes = false;
+	int _mapped_fd = -1;
+	const uint8_t *_mapped_data = nullptr;
+	size_t _mapped_size = 0;
 };
 
 #endif // REGION_FILE_H
@@ -123,6 +123,9 @@ Error VoxelVoxLoader::load_from_file(String fpath, Ref<VoxelBuffer> voxels, Ref<
 	const Error err = vox::load_vox(fpath, _data);
 	ERR_FAIL_COND_V(err != OK, err);
 
+	// Raw voxels are written directly into the channel, in linear order
+	voxels->set_layout(VoxelBuffer::LAYOUT_LINEAR);
+
 	const VoxelBuffer::ChannelId channel = VoxelBuffer::CHANNEL_COLOR;
 
 	const ArraySlice<Color8> src_palette =
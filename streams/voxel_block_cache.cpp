@@ -0,0 +1,234 @@
+#include "voxel_block_cache.h"
+#include "../util/profiling.h"
+#include "voxel_block_serializer.h"
+#include <core/os/mutex.h>
+
+namespace {
+// Serializers have internal buffers, each thread has its own so they can be used outside of the lock
+thread_local VoxelBlockSerializerInternal tls_serializer;
+thread_local std::vector<uint8_t> tls_compressed_data;
+} // namespace
+
+VoxelBlockCache::VoxelBlockCache() :
+		_next_version(1) {
+	_mutex = Mutex::create();
+}
+
+VoxelBlockCache::~VoxelBlockCache() {
+	clear();
+	memdelete(_mutex);
+}
+
+void VoxelBlockCache::set_budget(uint64_t bytes) {
+	MutexLock lock(_mutex);
+	_budget = bytes;
+	trim();
+}
+
+uint64_t VoxelBlockCache::get_budget() const {
+	MutexLock lock(_mutex);
+	return _budget;
+}
+
+void VoxelBlockCache::set_decoded(bool decoded) {
+	{
+		MutexLock lock(_mutex);
+		if (_decoded == decoded) {
+			return;
+		}
+		_decoded = decoded;
+	}
+	// Blocks stored in the previous mode can't be used anymore
+	clear();
+}
+
+bool VoxelBlockCache::is_decoded() const {
+	MutexLock lock(_mutex);
+	return _decoded;
+}
+
+bool VoxelBlockCache::load_block(Vector3i position, int lod, VoxelBuffer &out_buffer) {
+	VOXEL_PROFILE_SCOPE();
+
+	BlockLocation location;
+	location.position = position;
+	location.lod = lod;
+
+	// Copying and decompressing is done outside of the lock, the entry may be dropped meanwhile
+	Ref<VoxelBuffer> voxels;
+	{
+		MutexLock lock(_mutex);
+		Entry **entry_ptr = _entries.getptr(location);
+		if (entry_ptr == nullptr) {
+			++_misses;
+			return false;
+		}
+		++_hits;
+
+		Entry *entry = *entry_ptr;
+		unlink(entry);
+		push_front(entry);
+
+		if (entry->voxels.is_valid()) {
+			voxels = entry->voxels;
+		} else {
+			tls_compressed_data = entry->compressed_data;
+		}
+	}
+
+	if (voxels.is_valid()) {
+		ERR_FAIL_COND_V(voxels->get_size() != out_buffer.get_size(), false);
+		for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+			ERR_FAIL_COND_V(voxels->get_channel_depth(i) != out_buffer.get_channel_depth(i), false);
+		}
+		out_buffer.copy_from(**voxels);
+		out_buffer.copy_voxel_metadata(**voxels);
+		return true;
+	}
+
+	return tls_serializer.decompress_and_deserialize(tls_compressed_data, out_buffer);
+}
+
+uint64_t VoxelBlockCache::create_version() {
+	return _next_version++;
+}
+
+void VoxelBlockCache::store_block(Vector3i position, int lod, VoxelBuffer &buffer,
+		std::vector<uint8_t> &compressed_data, uint64_t version) {
+
+	VOXEL_PROFILE_SCOPE();
+
+	BlockLocation location;
+	location.position = position;
+	location.lod = lod;
+
+	bool decoded;
+	{
+		MutexLock lock(_mutex);
+		if (_budget == 0 || version <= _discarded_version) {
+			return;
+		}
+		decoded = _decoded;
+	}
+
+	Entry *entry = memnew(Entry);
+	entry->location = location;
+	entry->version = version;
+	if (decoded) {
+		// Shares voxels with the buffer, they get copied only if it is modified later
+		entry->voxels = buffer.snapshot(true);
+		entry->size_in_bytes = sizeof(Entry) + sizeof(VoxelBuffer) + entry->voxels->get_memory_usage();
+	} else {
+		if (compressed_data.size() > 0) {
+			entry->compressed_data.swap(compressed_data);
+		} else {
+			entry->compressed_data = tls_serializer.serialize_and_compress(buffer);
+		}
+		entry->size_in_bytes = sizeof(Entry) + entry->compressed_data.size();
+	}
+
+	MutexLock lock(_mutex);
+
+	if (decoded != _decoded || entry->size_in_bytes > _budget || version <= _discarded_version) {
+		// Mode changed or the block got erased meanwhile, or the block would not fit anyways
+		memdelete(entry);
+		return;
+	}
+
+	Entry **existing_entry_ptr = _entries.getptr(location);
+	if (existing_entry_ptr != nullptr) {
+		if ((*existing_entry_ptr)->version > version) {
+			// Another thread stored more recent data meanwhile
+			memdelete(entry);
+			return;
+		}
+		erase_entry(*existing_entry_ptr);
+	}
+
+	_entries.set(location, entry);
+	push_front(entry);
+	_size_in_bytes += entry->size_in_bytes;
+	trim();
+}
+
+void VoxelBlockCache::erase_block(Vector3i position, int lod, uint64_t version) {
+	BlockLocation location;
+	location.position = position;
+	location.lod = lod;
+
+	MutexLock lock(_mutex);
+	// Blocks are not tracked once erased, so older stores still on their way are refused instead
+	_discarded_version = MAX(_discarded_version, version);
+	Entry **entry_ptr = _entries.getptr(location);
+	if (entry_ptr != nullptr && (*entry_ptr)->version <= version) {
+		erase_entry(*entry_ptr);
+	}
+}
+
+void VoxelBlockCache::clear() {
+	MutexLock lock(_mutex);
+	Entry *entry = _most_recent;
+	while (entry != nullptr) {
+		Entry *next = entry->next;
+		memdelete(entry);
+		entry = next;
+	}
+	_entries.clear();
+	_most_recent = nullptr;
+	_least_recent = nullptr;
+	_size_in_bytes = 0;
+	_discarded_version = _next_version - 1;
+}
+
+VoxelBlockCache::Stats VoxelBlockCache::get_stats() const {
+	MutexLock lock(_mutex);
+	Stats stats;
+	stats.hits = _hits;
+	stats.misses = _misses;
+	stats.block_count = _entries.size();
+	stats.size_in_bytes = _size_in_bytes;
+	return stats;
+}
+
+void VoxelBlockCache::unlink(Entry *entry) {
+	if (entry->prev != nullptr) {
+		entry->prev->next = entry->next;
+	} else {
+		_most_recent = entry->next;
+	}
+	if (entry->next != nullptr) {
+		entry->next->prev = entry->prev;
+	} else {
+		_least_recent = entry->prev;
+	}
+	entry->prev = nullptr;
+	entry->next = nullptr;
+}
+
+void VoxelBlockCache::push_front(Entry *entry) {
+	entry->prev = nullptr;
+	entry->next = _most_recent;
+	if (_most_recent != nullptr) {
+		_most_recent->prev = entry;
+	} else {
+		_least_recent = entry;
+	}
+	_most_recent = entry;
+}
+
+void VoxelBlockCache::erase_entry(Entry *entry) {
+	unlink(entry);
+	_entries.erase(entry->location);
+	CRASH_COND(_size_in_bytes < entry->size_in_bytes);
+	_size_in_bytes -= entry->size_in_bytes;
+	memdelete(entry);
+}
+
+// Must be called with the mutex locked
+void VoxelBlockCache::trim() {
+	while (_size_in_bytes > _budget && _least_recent != nullptr) {
+		// An older version of the block could still be on its way, it must not take the place of this one
+		_discarded_version = MAX(_discarded_version, _least_recent->version);
+		erase_entry(_least_recent);
+	}
+}
@@ -0,0 +1,100 @@
+#ifndef VOXEL_BLOCK_CACHE_H
+#define VOXEL_BLOCK_CACHE_H
+
+#include "../math/vector3i.h"
+#include "../storage/voxel_buffer.h"
+#include <core/hash_map.h>
+#include <atomic>
+#include <vector>
+
+class Mutex;
+
+// Keeps recently loaded or saved blocks in memory, so reading them again doesn't need to access files.
+// Blocks are either stored compressed, like in files, or decoded, which takes more memory but skips decompression.
+// Least recently used blocks are dropped when the cache goes over its memory budget.
+// Can be used by multiple threads at once.
+class VoxelBlockCache {
+public:
+	struct Stats {
+		uint32_t hits = 0;
+		uint32_t misses = 0;
+		uint32_t block_count = 0;
+		uint64_t size_in_bytes = 0;
+	};
+
+	VoxelBlockCache();
+	~VoxelBlockCache();
+
+	// Maximum amount of memory used by cached blocks. Zero disables the cache.
+	void set_budget(uint64_t bytes);
+	uint64_t get_budget() const;
+
+	// Changing this clears the cache
+	void set_decoded(bool decoded);
+	bool is_decoded() const;
+
+	// Returns false if the block is not in the cache.
+	// Size and channel depths of `out_buffer` must match those of stored blocks.
+	bool load_block(Vector3i position, int lod, VoxelBuffer &out_buffer);
+
+	// Stores and erases are ordered by versions, so they can be done after the file was unlocked
+	// without older data replacing newer data. Versions must be created while the file is locked.
+	uint64_t create_version();
+	// Stores voxels and metadata of the block, unless it was stored or erased with a more recent version.
+	// `compressed_data` is the block as found in files. The cache takes it in compressed mode,
+	// so the block isn't compressed again. If empty, the block gets compressed here.
+	void store_block(Vector3i position, int lod, VoxelBuffer &buffer, std::vector<uint8_t> &compressed_data,
+			uint64_t version);
+	void erase_block(Vector3i position, int lod, uint64_t version);
+	void clear();
+
+	Stats get_stats() const;
+
+private:
+	struct BlockLocation {
+		Vector3i position;
+		int lod;
+
+		inline bool operator==(const BlockLocation &other) const {
+			return position == other.position && lod == other.lod;
+		}
+	};
+
+	struct BlockLocationHasher {
+		static inline uint32_t hash(const BlockLocation &location) {
+			return hash_djb2_one_32(location.lod, Vector3iHasher::hash(location.position));
+		}
+	};
+
+	struct Entry {
+		BlockLocation location;
+		// One of these is used, depending on the mode
+		Ref<VoxelBuffer> voxels;
+		std::vector<uint8_t> compressed_data;
+		uint32_t size_in_bytes = 0;
+		uint64_t version = 0;
+		// Least recently used list, most recent first
+		Entry *prev = nullptr;
+		Entry *next = nullptr;
+	};
+
+	void unlink(Entry *entry);
+	void push_front(Entry *entry);
+	void erase_entry(Entry *entry);
+	void trim();
+
+	HashMap<BlockLocation, Entry *, BlockLocationHasher> _entries;
+	Entry *_most_recent = nullptr;
+	Entry *_least_recent = nullptr;
+	uint64_t _size_in_bytes = 0;
+	uint64_t _budget = 0;
+	bool _decoded = false;
+	uint32_t _hits = 0;
+	uint32_t _misses = 0;
+	std::atomic<uint64_t> _next_version;
+	// Blocks with this version or older may have been erased, so they are not stored anymore
+	uint64_t _discarded_version = 0;
+	Mutex *_mutex = nullptr;
+};
+
+#endif // VOXEL_BLOCK_CACHE_H
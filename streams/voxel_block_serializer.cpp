@@ -6,6 +6,7 @@
 #include "../util/macros.h"
 #include "../util/profiling.h"
 
+#include <core/io/compression.h>
 #include <core/io/marshalls.h>
 #include <core/io/stream_peer.h>
 //#include <core/map.h>
@@ -18,14 +19,21 @@ namespace {
 const unsigned int BLOCK_TRAILING_MAGIC = 0x900df00d;
 const unsigned int BLOCK_TRAILING_MAGIC_SIZE = 4;
 const unsigned int BLOCK_METADATA_HEADER_SIZE = sizeof(uint32_t);
+
+// Compressed blocks start with their decompressed size. Blocks not compressed with LZ4 have their codec in the
+// highest byte, and their size in the remaining bits. Sizes never go that high,
+// so blocks saved before codecs were introduced are still read as LZ4.
+const uint32_t CODEC_TAG_BASE = 0xc0;
+const uint32_t CODEC_TAG_SHIFT = 24;
+const uint32_t CODEC_TAGGED_SIZE_MASK = 0x00ffffff;
 } // namespace
 
 size_t get_metadata_size_in_bytes(const VoxelBuffer &buffer) {
 	size_t size = 0;
 
-	const Map<Vector3i, Variant>::Element *elem = buffer.get_voxel_metadata().front();
-	while (elem != nullptr) {
-		const Vector3i pos = elem->key();
+	const VoxelMetadataMap &voxel_metadata = buffer.get_voxel_metadata();
+	for (unsigned int i = 0; i < voxel_metadata.size(); ++i) {
+		const Vector3i pos = buffer.position_from_index(voxel_metadata.get_key(i));
 
 		ERR_FAIL_COND_V_MSG(pos.x < 0 || static_cast<uint32_t>(pos.x) >= VoxelBuffer::MAX_SIZE, 0,
 				"Invalid voxel metadata X position");
@@ -37,11 +45,9 @@ size_t get_metadata_size_in_bytes(const VoxelBuffer &buffer) {
 		size += 3 * sizeof(uint16_t); // Positions are stored as 3 unsigned shorts
 
 		int len;
-		const Error err = encode_variant(elem->value(), nullptr, len, false);
+		const Error err = encode_variant(voxel_metadata.get_value(i), nullptr, len, false);
 		ERR_FAIL_COND_V_MSG(err != OK, 0, "Error when trying to encode voxel metadata.");
 		size += len;
-
-		elem = elem->next();
 	}
 
 	// If no metadata is found at all, nothing is serialized, not even null.
@@ -86,23 +92,22 @@ void serialize_metadata(uint8_t *p_dst, const VoxelBuffer &buffer, const size_t
 		CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) > metadata_size, "Wrote block metadata out of expected bounds");
 	}
 
-	const Map<Vector3i, Variant>::Element *elem = buffer.get_voxel_metadata().front();
-	while (elem != nullptr) {
+	// Entries are written in index order, so loading them only appends
+	const VoxelMetadataMap &voxel_metadata = buffer.get_voxel_metadata();
+	for (unsigned int i = 0; i < voxel_metadata.size(); ++i) {
 		// Serializing key as ushort because it's more than enough for a 3D dense array
 		static_assert(VoxelBuffer::MAX_SIZE <= 65535, "Maximum size exceeds serialization support");
-		const Vector3i pos = elem->key();
+		const Vector3i pos = buffer.position_from_index(voxel_metadata.get_key(i));
 		write<uint16_t>(dst, pos.x);
 		write<uint16_t>(dst, pos.y);
 		write<uint16_t>(dst, pos.z);
 
 		int written_length;
-		const Error err = encode_variant(elem->value(), dst, written_length, false);
+		const Error err = encode_variant(voxel_metadata.get_value(i), dst, written_length, false);
 		CRASH_COND_MSG(err != OK, "Error when trying to encode voxel metadata.");
 		dst += written_length;
 
 		CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) > metadata_size, "Wrote voxel metadata out of expected bounds");
-
-		elem = elem->next();
 	}
 
 	CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) != metadata_size,
@@ -156,7 +161,10 @@ size_t get_size_in_bytes(const VoxelBuffer &buffer, size_t &metadata_size) {
 		size += 1;
 
 		switch (compression) {
-			case VoxelBuffer::COMPRESSION_NONE: {
+			case VoxelBuffer::COMPRESSION_NONE:
+			case VoxelBuffer::COMPRESSION_RLE:
+			case VoxelBuffer::COMPRESSION_PALETTE:
+			case VoxelBuffer::COMPRESSION_SPARSE: {
 				size += size_in_voxels.volume() * sizeof(uint8_t);
 			} break;
 
@@ -191,12 +199,24 @@ const std::vector<uint8_t> &VoxelBlockSerializerInternal::serialize(VoxelBuffer
 
 	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
 		VoxelBuffer::Compression compression = voxel_buffer.get_channel_compression(channel_index);
+		if (compression == VoxelBuffer::COMPRESSION_RLE || compression == VoxelBuffer::COMPRESSION_PALETTE ||
+				compression == VoxelBuffer::COMPRESSION_SPARSE) {
+			// These are only used in memory, files store them decoded
+			compression = VoxelBuffer::COMPRESSION_NONE;
+		}
 		f->store_8(static_cast<uint8_t>(compression));
 
 		switch (compression) {
 			case VoxelBuffer::COMPRESSION_NONE: {
 				ArraySlice<uint8_t> data;
-				CRASH_COND(!voxel_buffer.get_channel_raw(channel_index, data));
+				if (!voxel_buffer.get_channel_raw(channel_index, data) ||
+						voxel_buffer.get_channel_compression(channel_index) != VoxelBuffer::COMPRESSION_NONE ||
+						voxel_buffer.get_layout() != VoxelBuffer::LAYOUT_LINEAR) {
+					_channel_tmp.resize(VoxelBuffer::get_size_in_bytes_for_volume(
+							voxel_buffer.get_size(), voxel_buffer.get_channel_depth(channel_index)));
+					data = ArraySlice<uint8_t>(_channel_tmp, 0, _channel_tmp.size());
+					voxel_buffer.decode_channel_raw(channel_index, data);
+				}
 				f->store_buffer(data.data(), data.size());
 			} break;
 
@@ -242,6 +262,9 @@ const std::vector<uint8_t> &VoxelBlockSerializerInternal::serialize(VoxelBuffer
 
 bool VoxelBlockSerializerInternal::deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer) {
 	VOXEL_PROFILE_SCOPE();
+	// Raw voxels are read directly into channels
+	ERR_FAIL_COND_V_MSG(out_voxel_buffer.get_layout() != VoxelBuffer::LAYOUT_LINEAR, false,
+			"Can't deserialize into a buffer not using the linear layout");
 	CRASH_COND(_file_access_memory.open_custom(p_data.data(), p_data.size()) != OK);
 	FileAccessMemory *f = &_file_access_memory;
 
@@ -306,51 +329,117 @@ bool VoxelBlockSerializerInternal::deserialize(const std::vector<uint8_t> &p_dat
 	return true;
 }
 
+void VoxelBlockSerializerInternal::set_codec(Codec codec) {
+	ERR_FAIL_INDEX(codec, CODEC_COUNT);
+	_codec = codec;
+}
+
 const std::vector<uint8_t> &VoxelBlockSerializerInternal::serialize_and_compress(VoxelBuffer &voxel_buffer) {
 	VOXEL_PROFILE_SCOPE();
 	const std::vector<uint8_t> &data = serialize(voxel_buffer);
 
+	Codec codec = _codec;
+	if (data.size() > CODEC_TAGGED_SIZE_MASK) {
+		// Size would not fit next to the codec tag
+		codec = CODEC_LZ4;
+	}
+
 	unsigned int header_size = sizeof(unsigned int);
-	_compressed_data.resize(header_size + LZ4_compressBound(data.size()));
+	int compressed_size = 0;
+	uint32_t header = data.size();
+
+	switch (codec) {
+		case CODEC_LZ4:
+			_compressed_data.resize(header_size + LZ4_compressBound(data.size()));
+			compressed_size = LZ4_compress_default(
+					(const char *)data.data(),
+					(char *)_compressed_data.data() + header_size,
+					data.size(),
+					_compressed_data.size() - header_size);
+			break;
+
+		case CODEC_ZSTD:
+			_compressed_data.resize(header_size +
+									Compression::get_max_compressed_buffer_size(data.size(), Compression::MODE_ZSTD));
+			compressed_size = Compression::compress(
+					_compressed_data.data() + header_size,
+					data.data(),
+					data.size(),
+					Compression::MODE_ZSTD);
+			header |= (CODEC_TAG_BASE + codec) << CODEC_TAG_SHIFT;
+			break;
+
+		default:
+			CRASH_NOW_MSG("Unhandled codec");
+	}
+
+	CRASH_COND(compressed_size < 0);
+	CRASH_COND(compressed_size == 0);
 
 	// Write header
 	CRASH_COND(_file_access_memory.open_custom(_compressed_data.data(), _compressed_data.size()) != OK);
-	_file_access_memory.store_32(data.size());
+	_file_access_memory.store_32(header);
 	_file_access_memory.close();
 
-	int compressed_size = LZ4_compress_default(
-			(const char *)data.data(),
-			(char *)_compressed_data.data() + header_size,
-			data.size(),
-			_compressed_data.size() - header_size);
-
-	CRASH_COND(compressed_size < 0);
-	CRASH_COND(compressed_size == 0);
-
 	_compressed_data.resize(header_size + compressed_size);
 	return _compressed_data;
 }
 
 bool VoxelBlockSerializerInternal::decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer) {
+	return decompress_and_deserialize(p_data.data(), p_data.size(), out_voxel_buffer);
+}
+
+// Data can be read from anywhere, such as a memory-mapped file, without being copied first
+bool VoxelBlockSerializerInternal::decompress_and_deserialize(const uint8_t *p_data, unsigned int size, VoxelBuffer &out_voxel_buffer) {
 	VOXEL_PROFILE_SCOPE();
 	// Read header
 	unsigned int header_size = sizeof(unsigned int);
-	ERR_FAIL_COND_V(_file_access_memory.open_custom(p_data.data(), p_data.size()) != OK, false);
-	unsigned int decompressed_size = _file_access_memory.get_32();
+	ERR_FAIL_COND_V(size < header_size, false);
+	ERR_FAIL_COND_V(_file_access_memory.open_custom(p_data, size) != OK, false);
+	const uint32_t header = _file_access_memory.get_32();
 	_file_access_memory.close();
 
+	unsigned int decompressed_size = header;
+	Codec codec = CODEC_LZ4;
+	const uint32_t tag = header >> CODEC_TAG_SHIFT;
+	if (tag >= CODEC_TAG_BASE) {
+		ERR_FAIL_COND_V_MSG(tag - CODEC_TAG_BASE >= CODEC_COUNT, false,
+				String("Unknown block codec {0}").format(varray(tag - CODEC_TAG_BASE)));
+		codec = static_cast<Codec>(tag - CODEC_TAG_BASE);
+		decompressed_size = header & CODEC_TAGGED_SIZE_MASK;
+	}
+
 	_data.resize(decompressed_size);
 
-	unsigned int actually_decompressed_size = LZ4_decompress_safe(
-			(const char *)p_data.data() + header_size,
-			(char *)_data.data(),
-			p_data.size() - header_size,
-			_data.size());
+	int actually_decompressed_size = -1;
+
+	switch (codec) {
+		case CODEC_LZ4:
+			actually_decompressed_size = LZ4_decompress_safe(
+					(const char *)p_data + header_size,
+					(char *)_data.data(),
+					size - header_size,
+					_data.size());
+			break;
+
+		case CODEC_ZSTD:
+			actually_decompressed_size = Compression::decompress(
+					_data.data(),
+					_data.size(),
+					p_data + header_size,
+					size - header_size,
+					Compression::MODE_ZSTD);
+			break;
+
+		default:
+			ERR_PRINT("Unhandled codec");
+			return false;
+	}
 
 	ERR_FAIL_COND_V_MSG(actually_decompressed_size < 0, false,
-			String("LZ4 decompression error {0}").format(varray(actually_decompressed_size)));
+			String("Block decompression error {0}").format(varray(actually_decompressed_size)));
 
-	ERR_FAIL_COND_V_MSG(actually_decompressed_size != decompressed_size, false,
+	ERR_FAIL_COND_V_MSG(static_cast<unsigned int>(actually_decompressed_size) != decompressed_size, false,
 			String("Expected {0} bytes, obtained {1}").format(varray(decompressed_size, actually_decompressed_size)));
 
 	return deserialize(_data, out_voxel_buffer);
@@ -11,11 +11,26 @@ class StreamPeer;
 class VoxelBlockSerializerInternal {
 	// Had to be named differently to not conflict with the wrapper for Godot script API
 public:
+	// Algorithm used to compress blocks. The one used is stored with each block,
+	// so blocks compressed differently can be read by the same serializer.
+	enum Codec {
+		// Fastest
+		CODEC_LZ4 = 0,
+		// Smaller output, but slower to compress.
+		// Its level is the `compression/formats/zstd/compression_level` project setting.
+		CODEC_ZSTD,
+		CODEC_COUNT
+	};
+
+	void set_codec(Codec codec);
+	inline Codec get_codec() const { return _codec; }
+
 	const std::vector<uint8_t> &serialize(VoxelBuffer &voxel_buffer);
 	bool deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer);
 
 	const std::vector<uint8_t> &serialize_and_compress(VoxelBuffer &voxel_buffer);
 	bool decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer);
+	bool decompress_and_deserialize(const uint8_t *p_data, unsigned int size, VoxelBuffer &out_voxel_buffer);
 	bool decompress_and_deserialize(FileAccess *f, unsigned int size_to_read, VoxelBuffer &out_voxel_buffer);
 
 	int serialize(Ref<StreamPeer> peer, Ref<VoxelBuffer> voxel_buffer, bool compress);
@@ -25,7 +40,9 @@ private:
 	std::vector<uint8_t> _data;
 	std::vector<uint8_t> _compressed_data;
 	std::vector<uint8_t> _metadata_tmp;
+	std::vector<uint8_t> _channel_tmp;
 	FileAccessMemory _file_access_memory;
+	Codec _codec = CODEC_LZ4;
 };
 
 class VoxelBlockSerializer : public Reference {
@@ -36,6 +36,10 @@ bool VoxelStream::is_cloneable() const {
 	return false;
 }
 
+int VoxelStream::get_block_affinity(Vector3i origin_in_voxels, int lod) const {
+	return -1;
+}
+
 void VoxelStream::_emerge_block(Ref<VoxelBuffer> out_buffer, Vector3 origin_in_voxels, int lod) {
 	ERR_FAIL_COND(lod < 0);
 	emerge_block(out_buffer, Vector3i(origin_in_voxels), lod);
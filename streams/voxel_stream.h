@@ -13,6 +13,9 @@ public:
 	struct Stats {
 		int file_openings = 0;
 		int time_spent_opening_files = 0;
+		// Blocks found or not in the memory cache, for streams having one
+		int cache_hits = 0;
+		int cache_misses = 0;
 	};
 
 	VoxelStream();
@@ -44,7 +47,12 @@ public:
 	virtual bool is_thread_safe() const;
 	virtual bool is_cloneable() const;
 
-	Stats get_statistics() const;
+	// Streams may want requests about nearby blocks to be handled by the same thread,
+	// for example to keep using the same open files.
+	// Returns a non-negative value identifying the group of the given block, or -1 if it doesn't matter.
+	virtual int get_block_affinity(Vector3i origin_in_voxels, int lod) const;
+
+	virtual Stats get_statistics() const;
 
 	virtual bool has_script() const;
 
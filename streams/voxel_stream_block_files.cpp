@@ -22,16 +22,24 @@ VoxelStreamBlockFiles::VoxelStreamBlockFiles() {
 // TODO Have configurable block size
 
 void VoxelStreamBlockFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
-	ERR_FAIL_COND(out_buffer.is_null());
+	const EmergeResult result = emerge_block_without_fallback(out_buffer, origin_in_voxels, lod);
+	if (result == EMERGE_OK_FALLBACK) {
+		emerge_block_fallback(out_buffer, origin_in_voxels, lod);
+	}
+}
+
+VoxelStreamFile::EmergeResult VoxelStreamBlockFiles::emerge_block_without_fallback(
+		Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
+
+	ERR_FAIL_COND_V(out_buffer.is_null(), EMERGE_FAILED);
 
 	if (_directory_path.empty()) {
-		emerge_block_fallback(out_buffer, origin_in_voxels, lod);
-		return;
+		return EMERGE_OK_FALLBACK;
 	}
 
 	if (!_meta_loaded) {
 		if (load_meta() != VOXEL_FILE_OK) {
-			return;
+			return EMERGE_FAILED;
 		}
 	}
 
@@ -39,8 +47,8 @@ void VoxelStreamBlockFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i o
 
 	const Vector3i block_size(1 << _meta.block_size_po2);
 
-	ERR_FAIL_COND(lod >= _meta.lod_count);
-	ERR_FAIL_COND(block_size != out_buffer->get_size());
+	ERR_FAIL_COND_V(lod >= _meta.lod_count, EMERGE_FAILED);
+	ERR_FAIL_COND_V(block_size != out_buffer->get_size(), EMERGE_FAILED);
 
 	Vector3i block_pos = get_block_position(origin_in_voxels) >> lod;
 	String file_path = get_block_file_path(block_pos, lod);
@@ -51,18 +59,17 @@ void VoxelStreamBlockFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i o
 		f = open_file(file_path, FileAccess::READ, &err);
 		// Had to add ERR_FILE_CANT_OPEN because that's what Godot actually returns when the file doesn't exist...
 		if (f == nullptr && (err == ERR_FILE_NOT_FOUND || err == ERR_FILE_CANT_OPEN)) {
-			emerge_block_fallback(out_buffer, origin_in_voxels, lod);
-			return;
+			return EMERGE_OK_FALLBACK;
 		}
 	}
 
-	ERR_FAIL_COND(f == nullptr);
+	ERR_FAIL_COND_V(f == nullptr, EMERGE_FAILED);
 
 	{
 		{
 			uint8_t version;
 			VoxelFileResult err = check_magic_and_version(f, FORMAT_VERSION, FORMAT_BLOCK_MAGIC, version);
-			ERR_FAIL_COND_MSG(err != VOXEL_FILE_OK, ::to_string(err));
+			ERR_FAIL_COND_V_MSG(err != VOXEL_FILE_OK, EMERGE_FAILED, ::to_string(err));
 		}
 
 		// Configure depths, as they currently are only specified in the meta file.
@@ -72,11 +79,12 @@ void VoxelStreamBlockFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i o
 		}
 
 		uint32_t size_to_read = f->get_32();
-		ERR_FAIL_COND(!_block_serializer.decompress_and_deserialize(f, size_to_read, **out_buffer));
+		ERR_FAIL_COND_V(!_block_serializer.decompress_and_deserialize(f, size_to_read, **out_buffer), EMERGE_FAILED);
 	}
 
 	f->close();
 	memdelete(f);
+	return EMERGE_OK;
 }
 
 void VoxelStreamBlockFiles::immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod) {
@@ -134,6 +142,7 @@ void VoxelStreamBlockFiles::immerge_block(Ref<VoxelBuffer> buffer, Vector3i orig
 		f->store_buffer((uint8_t *)FORMAT_BLOCK_MAGIC, 4);
 		f->store_8(FORMAT_VERSION);
 
+		_block_serializer.set_codec(static_cast<VoxelBlockSerializerInternal::Codec>(get_codec()));
 		const std::vector<uint8_t> &data = _block_serializer.serialize_and_compress(**buffer);
 		f->store_32(data.size());
 		f->store_buffer(data.data(), data.size());
@@ -16,6 +16,8 @@ public:
 	void emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
 	void immerge_block(Ref<VoxelBuffer> buffer, Vector3i origin_in_voxels, int lod) override;
 
+	EmergeResult emerge_block_without_fallback(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
+
 	String get_directory() const;
 	void set_directory(String dirpath);
 
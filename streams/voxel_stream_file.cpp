@@ -3,6 +3,10 @@
 #include <core/os/file_access.h>
 #include <core/os/os.h>
 
+VoxelStreamFile::VoxelStreamFile() :
+		_codec(CODEC_LZ4) {
+}
+
 void VoxelStreamFile::set_save_fallback_output(bool enabled) {
 	_save_fallback_output = enabled;
 }
@@ -20,6 +24,15 @@ void VoxelStreamFile::set_fallback_stream(Ref<VoxelStream> stream) {
 	_fallback_stream = stream;
 }
 
+void VoxelStreamFile::set_codec(Codec codec) {
+	ERR_FAIL_INDEX(codec, CODEC_COUNT);
+	_codec = codec;
+}
+
+VoxelStreamFile::Codec VoxelStreamFile::get_codec() const {
+	return static_cast<Codec>(_codec.load());
+}
+
 void VoxelStreamFile::emerge_block_fallback(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
 	// This function is just a helper around the true thing, really. I might remove it in the future.
 
@@ -46,6 +59,25 @@ void VoxelStreamFile::emerge_blocks_fallback(Vector<VoxelBlockRequest> &requests
 	}
 }
 
+VoxelStreamFile::EmergeResult VoxelStreamFile::emerge_block_without_fallback(
+		Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
+	ERR_PRINT("Not implemented");
+	return EMERGE_FAILED;
+}
+
+void VoxelStreamFile::emerge_blocks_without_fallback(
+		const Vector<VoxelBlockRequest> &requests, std::vector<EmergeResult> &out_results) {
+	out_results.resize(requests.size());
+	for (int i = 0; i < requests.size(); ++i) {
+		const VoxelBlockRequest &r = requests[i];
+		out_results[i] = emerge_block_without_fallback(r.voxel_buffer, r.origin_in_voxels, r.lod);
+	}
+}
+
+bool VoxelStreamFile::is_thread_safe_without_fallback() const {
+	return false;
+}
+
 int VoxelStreamFile::get_used_channels_mask() const {
 	if (_fallback_stream.is_valid()) {
 		return _fallback_stream->get_used_channels_mask();
@@ -89,8 +121,15 @@ void VoxelStreamFile::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_fallback_stream", "stream"), &VoxelStreamFile::set_fallback_stream);
 	ClassDB::bind_method(D_METHOD("get_fallback_stream"), &VoxelStreamFile::get_fallback_stream);
 
+	ClassDB::bind_method(D_METHOD("set_codec", "codec"), &VoxelStreamFile::set_codec);
+	ClassDB::bind_method(D_METHOD("get_codec"), &VoxelStreamFile::get_codec);
+
 	ClassDB::bind_method(D_METHOD("get_block_size"), &VoxelStreamFile::_get_block_size);
 
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "fallback_stream", PROPERTY_HINT_RESOURCE_TYPE, "VoxelStream"), "set_fallback_stream", "get_fallback_stream");
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "save_fallback_output"), "set_save_fallback_output", "get_save_fallback_output");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "codec", PROPERTY_HINT_ENUM, "LZ4,Zstd"), "set_codec", "get_codec");
+
+	BIND_ENUM_CONSTANT(CODEC_LZ4);
+	BIND_ENUM_CONSTANT(CODEC_ZSTD);
 }
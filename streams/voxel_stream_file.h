@@ -3,6 +3,7 @@
 
 #include "voxel_block_serializer.h"
 #include "voxel_stream.h"
+#include <atomic>
 
 class FileAccess;
 
@@ -13,17 +14,46 @@ class FileAccess;
 class VoxelStreamFile : public VoxelStream {
 	GDCLASS(VoxelStreamFile, VoxelStream)
 public:
+	enum EmergeResult {
+		EMERGE_OK,
+		EMERGE_OK_FALLBACK, // The block was not found in files, the fallback stream should be used
+		EMERGE_FAILED
+	};
+
+	enum Codec {
+		CODEC_LZ4 = VoxelBlockSerializerInternal::CODEC_LZ4,
+		CODEC_ZSTD = VoxelBlockSerializerInternal::CODEC_ZSTD,
+		CODEC_COUNT = VoxelBlockSerializerInternal::CODEC_COUNT
+	};
+
+	VoxelStreamFile();
+
 	void set_save_fallback_output(bool enabled);
 	bool get_save_fallback_output() const;
 
 	Ref<VoxelStream> get_fallback_stream() const;
 	void set_fallback_stream(Ref<VoxelStream> stream);
 
+	// Applies to blocks saved from now on. Blocks already saved with another codec can still be loaded.
+	// Can be changed while other threads save blocks.
+	void set_codec(Codec codec);
+	Codec get_codec() const;
+
 	// File streams are likely to impose a specific block size,
 	// and changing it can be very expensive so the API is usually specific too
 	virtual int get_block_size_po2() const;
 	virtual int get_lod_count() const;
 
+	// Loads a block from files only, without querying the fallback stream when it is not found.
+	// This allows to generate missing blocks somewhere else, so file access doesn't wait for them.
+	virtual EmergeResult emerge_block_without_fallback(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod);
+	// Same for many blocks at once, which lets streams optimize file access. Results are in the order of requests.
+	virtual void emerge_blocks_without_fallback(
+			const Vector<VoxelBlockRequest> &requests, std::vector<EmergeResult> &out_results);
+
+	// Tells if file access alone is thread-safe, which may differ from the fallback stream
+	virtual bool is_thread_safe_without_fallback() const;
+
 	int get_used_channels_mask() const override;
 
 	bool has_script() const override;
@@ -43,6 +73,10 @@ private:
 
 	Ref<VoxelStream> _fallback_stream;
 	bool _save_fallback_output = true;
+	// Not stored in the serializer, which only the saving thread may use
+	std::atomic<int> _codec;
 };
 
+VARIANT_ENUM_CAST(VoxelStreamFile::Codec)
+
 #endif // VOXEL_STREAM_FILE_H
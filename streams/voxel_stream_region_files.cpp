@@ -1,9 +1,11 @@
 #include "voxel_stream_region_files.h"
 #include "../math/rect3i.h"
+#include "../server/voxel_server.h"
 #include "../util/macros.h"
 #include "../util/profiling.h"
 #include "../util/utility.h"
 #include <core/io/json.h>
+#include <core/os/mutex.h>
 #include <core/os/os.h>
 #include <algorithm>
 
@@ -15,6 +17,7 @@ const uint8_t FORMAT_VERSION_LEGACY_2 = 2;
 
 const uint8_t FORMAT_VERSION_LEGACY_1 = 1;
 const char *META_FILE_NAME = "meta.vxrm";
+const int DEFAULT_BLOCK_CACHE_SIZE_MB = 16;
 } // namespace
 
 VoxelStreamRegionFiles::VoxelStreamRegionFiles() {
@@ -24,10 +27,13 @@ VoxelStreamRegionFiles::VoxelStreamRegionFiles() {
 	_meta.sector_size = 512; // next_power_of_2(_meta.block_size.volume() / 10) // based on compression ratios
 	_meta.lod_count = 1;
 	_meta.channel_depths.fill(VoxelBuffer::DEFAULT_CHANNEL_DEPTH);
+	_mutex = Mutex::create();
+	_block_cache.set_budget(static_cast<uint64_t>(DEFAULT_BLOCK_CACHE_SIZE_MB) << 20);
 }
 
 VoxelStreamRegionFiles::~VoxelStreamRegionFiles() {
 	close_all_regions();
+	memdelete(_mutex);
 }
 
 void VoxelStreamRegionFiles::emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
@@ -53,27 +59,75 @@ void VoxelStreamRegionFiles::immerge_block(Ref<VoxelBuffer> buffer, Vector3i ori
 void VoxelStreamRegionFiles::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
 	VOXEL_PROFILE_SCOPE();
 
-	// In order to minimize opening/closing files, requests are grouped according to their region.
+	std::vector<EmergeResult> results;
+	emerge_blocks_without_fallback(p_blocks, results);
 
-	// Had to copy input to sort it, as some areas in the module break if they get responses in different order
-	Vector<VoxelBlockRequest> sorted_blocks;
-	sorted_blocks.append_array(p_blocks);
+	Vector<VoxelBlockRequest> fallback_requests;
+	for (int i = 0; i < p_blocks.size(); ++i) {
+		if (results[i] == EMERGE_OK_FALLBACK) {
+			fallback_requests.push_back(p_blocks[i]);
+		}
+	}
 
-	SortArray<VoxelBlockRequest, BlockRequestComparator> sorter;
-	sorter.compare.self = this;
-	sorter.sort(sorted_blocks.ptrw(), sorted_blocks.size());
+	emerge_blocks_fallback(fallback_requests);
+}
 
-	Vector<VoxelBlockRequest> fallback_requests;
+void VoxelStreamRegionFiles::emerge_blocks_without_fallback(
+		const Vector<VoxelBlockRequest> &requests, std::vector<EmergeResult> &out_results) {
 
-	for (int i = 0; i < sorted_blocks.size(); ++i) {
-		VoxelBlockRequest &r = sorted_blocks.write[i];
-		EmergeResult result = _emerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod);
-		if (result == EMERGE_OK_FALLBACK) {
-			fallback_requests.push_back(r);
+	VOXEL_PROFILE_SCOPE();
+
+	out_results.resize(requests.size());
+
+	if (!_directory_path.empty()) {
+		// Sorting and grouping by region needs the format
+		MutexLock lock(_mutex);
+		if (!ensure_meta_loaded_for_emerge()) {
+			std::fill(out_results.begin(), out_results.end(), EMERGE_FAILED);
+			return;
 		}
 	}
 
-	emerge_blocks_fallback(fallback_requests);
+	// In order to minimize opening/closing files, requests are grouped according to their region.
+	// Requests are sorted through their indexes, because results must be in the order of requests.
+	std::vector<unsigned int> order;
+	order.resize(requests.size());
+	for (unsigned int i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	BlockRequestComparator compare;
+	compare.self = this;
+	std::sort(order.begin(), order.end(), [&requests, &compare](unsigned int a, unsigned int b) {
+		return compare(requests[a], requests[b]);
+	});
+
+	std::vector<VoxelBlockRequest> sorted_blocks;
+	sorted_blocks.resize(requests.size());
+	for (unsigned int i = 0; i < order.size(); ++i) {
+		sorted_blocks[i] = requests[order[i]];
+	}
+
+	std::vector<EmergeResult> results;
+
+	// Blocks of the same region are loaded together, so their reads can be sent to the device at once
+	unsigned int group_begin = 0;
+	while (group_begin < sorted_blocks.size()) {
+		unsigned int group_end = group_begin + 1;
+		while (group_end < sorted_blocks.size() &&
+				is_same_region(sorted_blocks[group_begin], sorted_blocks[group_end])) {
+			++group_end;
+		}
+
+		const unsigned int count = group_end - group_begin;
+		results.resize(count);
+		_emerge_blocks_in_region(&sorted_blocks[group_begin], results.data(), count);
+
+		for (unsigned int i = 0; i < count; ++i) {
+			out_results[order[group_begin + i]] = results[i];
+		}
+
+		group_begin = group_end;
+	}
 }
 
 void VoxelStreamRegionFiles::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) {
@@ -93,16 +147,39 @@ void VoxelStreamRegionFiles::immerge_blocks(Vector<VoxelBlockRequest> &p_blocks)
 	}
 }
 
-VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(
+VoxelStreamFile::EmergeResult VoxelStreamRegionFiles::emerge_block_without_fallback(
 		Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
+	return _emerge_block(out_buffer, origin_in_voxels, lod);
+}
 
-	VOXEL_PROFILE_SCOPE();
-	ERR_FAIL_COND_V(out_buffer.is_null(), EMERGE_FAILED);
+VoxelStream::Stats VoxelStreamRegionFiles::get_statistics() const {
+	Stats stats = VoxelStreamFile::get_statistics();
+	const VoxelBlockCache::Stats cache_stats = _block_cache.get_stats();
+	stats.cache_hits = cache_stats.hits;
+	stats.cache_misses = cache_stats.misses;
+	return stats;
+}
 
-	if (_directory_path.empty()) {
-		return EMERGE_OK_FALLBACK;
-	}
+bool VoxelStreamRegionFiles::is_thread_safe() const {
+	// Generating missing blocks is done outside of locks
+	Ref<VoxelStream> fallback_stream = get_fallback_stream();
+	return fallback_stream.is_null() || fallback_stream->is_thread_safe();
+}
+
+bool VoxelStreamRegionFiles::is_thread_safe_without_fallback() const {
+	return true;
+}
+
+int VoxelStreamRegionFiles::get_block_affinity(Vector3i origin_in_voxels, int lod) const {
+	// Meta is not locked here, the worst that can happen is a request going to another thread
+	const Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
+	const Vector3i region_pos = get_region_position_from_blocks(block_pos);
+	const uint32_t h = hash_djb2_one_32(lod, Vector3iHasher::hash(region_pos));
+	return h & 0x7fffffff;
+}
 
+// Must be called with the stream mutex locked
+bool VoxelStreamRegionFiles::ensure_meta_loaded_for_emerge() {
 	if (!_meta_loaded) {
 		VoxelFileResult load_res = load_meta();
 		if (load_res != VOXEL_FILE_OK) {
@@ -110,46 +187,219 @@ VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(
 				// TODO Is it a good idea to save on read?
 				// New data folder, save it for first time
 				VoxelFileResult save_res = save_meta();
-				ERR_FAIL_COND_V(save_res != VOXEL_FILE_OK, EMERGE_FAILED);
+				ERR_FAIL_COND_V(save_res != VOXEL_FILE_OK, false);
 			} else {
-				return EMERGE_FAILED;
+				return false;
 			}
 		}
 	}
+	return true;
+}
+
+// Must be called with the stream mutex locked
+bool VoxelStreamRegionFiles::ensure_meta_saved_for_immerge(const VoxelBuffer &voxel_buffer) {
+	if (!_meta_loaded) {
+		// If it's not loaded, always try to load meta file first if it exists already,
+		// because we could want to save blocks without reading any
+		VoxelFileResult load_res = load_meta();
+		if (load_res != VOXEL_FILE_OK && load_res != VOXEL_FILE_CANT_OPEN) {
+			// The file is present but there is a problem with it
+			String meta_path = _directory_path.plus_file(META_FILE_NAME);
+			ERR_PRINT(String("Could not read {0}: error {1}").format(varray(meta_path, ::to_string(load_res))));
+			return false;
+		}
+	}
+
+	if (!_meta_saved) {
+		// First time we save the meta file, initialize it from the first block format
+		for (unsigned int i = 0; i < _meta.channel_depths.size(); ++i) {
+			_meta.channel_depths[i] = voxel_buffer.get_channel_depth(i);
+		}
+		VoxelFileResult err = save_meta();
+		ERR_FAIL_COND_V(err != VOXEL_FILE_OK, false);
+	}
+
+	return true;
+}
+
+VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(
+		Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) {
+
+	VoxelBlockRequest r;
+	r.voxel_buffer = out_buffer;
+	r.origin_in_voxels = origin_in_voxels;
+	r.lod = lod;
+	EmergeResult result;
+	_emerge_blocks_in_region(&r, &result, 1);
+	return result;
+}
+
+bool VoxelStreamRegionFiles::is_same_region(const VoxelBlockRequest &a, const VoxelBlockRequest &b) const {
+	if (a.lod != b.lod) {
+		return false;
+	}
+	const Vector3i block_pos_a = get_block_position_from_voxels(a.origin_in_voxels) >> a.lod;
+	const Vector3i block_pos_b = get_block_position_from_voxels(b.origin_in_voxels) >> b.lod;
+	return get_region_position_from_blocks(block_pos_a) == get_region_position_from_blocks(block_pos_b);
+}
 
-	const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
-	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+// All requests must be in the same region
+void VoxelStreamRegionFiles::_emerge_blocks_in_region(
+		const VoxelBlockRequest *requests, EmergeResult *out_results, unsigned int count) {
 
-	CRASH_COND(!_meta_loaded);
-	ERR_FAIL_COND_V(lod >= _meta.lod_count, EMERGE_FAILED);
-	ERR_FAIL_COND_V(block_size != out_buffer->get_size(), EMERGE_FAILED);
+	VOXEL_PROFILE_SCOPE();
+	CRASH_COND(count == 0);
 
-	// Configure depths, as they currently are only specified in the meta file.
-	// Regions are expected to contain such depths, and use those in the buffer to know how much data to read.
-	for (unsigned int channel_index = 0; channel_index < _meta.channel_depths.size(); ++channel_index) {
-		out_buffer->set_channel_depth(channel_index, _meta.channel_depths[channel_index]);
+	if (_directory_path.empty()) {
+		for (unsigned int i = 0; i < count; ++i) {
+			out_results[i] = EMERGE_OK_FALLBACK;
+		}
+		return;
 	}
 
-	const Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
-	const Vector3i region_pos = get_region_position_from_blocks(block_pos);
+	for (unsigned int i = 0; i < count; ++i) {
+		out_results[i] = EMERGE_FAILED;
+	}
+
+	struct BlockToLoad {
+		Vector3i position;
+		Vector3i rpos;
+		uint32_t sector_index;
+		unsigned int request_index;
+		uint64_t cache_version;
+		// Kept for the block cache
+		std::vector<uint8_t> compressed_data;
+	};
 
-	CachedRegion *cache = open_region(region_pos, lod, false);
-	if (cache == nullptr || !cache->file_exists) {
-		return EMERGE_OK_FALLBACK;
+	const int lod = requests[0].lod;
+	Vector3i region_pos;
+	std::vector<BlockToLoad> blocks_to_load;
+	blocks_to_load.reserve(count);
+	{
+		MutexLock lock(_mutex);
+
+		if (!ensure_meta_loaded_for_emerge()) {
+			return;
+		}
+
+		const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
+		const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+
+		CRASH_COND(!_meta_loaded);
+		ERR_FAIL_COND(lod >= _meta.lod_count);
+
+		region_pos = get_region_position_from_blocks(get_block_position_from_voxels(requests[0].origin_in_voxels) >> lod);
+
+		for (unsigned int i = 0; i < count; ++i) {
+			const VoxelBlockRequest &r = requests[i];
+			ERR_CONTINUE(r.voxel_buffer.is_null());
+			ERR_CONTINUE(block_size != r.voxel_buffer->get_size());
+			ERR_CONTINUE(r.lod != lod);
+
+			// Configure depths, as they currently are only specified in the meta file.
+			// Regions are expected to contain such depths, and use those in the buffer to know how much data to read.
+			for (unsigned int channel_index = 0; channel_index < _meta.channel_depths.size(); ++channel_index) {
+				r.voxel_buffer->set_channel_depth(channel_index, _meta.channel_depths[channel_index]);
+			}
+
+			const Vector3i block_pos = get_block_position_from_voxels(r.origin_in_voxels) >> lod;
+			ERR_CONTINUE(get_region_position_from_blocks(block_pos) != region_pos);
+
+			BlockToLoad b;
+			b.position = block_pos;
+			b.rpos = block_pos.wrap(region_size);
+			b.sector_index = 0;
+			b.request_index = i;
+			blocks_to_load.push_back(b);
+		}
+	}
+
+	// Blocks found in memory don't need their region to be opened
+	for (unsigned int i = 0; i < blocks_to_load.size();) {
+		const BlockToLoad &b = blocks_to_load[i];
+		if (_block_cache.load_block(b.position, lod, **requests[b.request_index].voxel_buffer)) {
+			out_results[b.request_index] = EMERGE_OK;
+			blocks_to_load[i] = blocks_to_load.back();
+			blocks_to_load.pop_back();
+		} else {
+			++i;
+		}
+	}
+
+	if (blocks_to_load.size() == 0) {
+		return;
 	}
 
-	const Vector3i block_rpos = block_pos.wrap(region_size);
+	// Only compressed blocks are worth copying for the cache
+	const bool keep_compressed_data = _block_cache.get_budget() > 0 && !_block_cache.is_decoded();
+
+	CachedRegion *cache = nullptr;
+	{
+		MutexLock lock(_mutex);
+
+		cache = open_region(region_pos, lod, false);
+		if (cache == nullptr || !cache->file_exists) {
+			for (unsigned int i = 0; i < blocks_to_load.size(); ++i) {
+				out_results[blocks_to_load[i].request_index] = EMERGE_OK_FALLBACK;
+			}
+			return;
+		}
+		++cache->users;
+	}
+
+	{
+		// Other regions can be accessed by other threads meanwhile
+		MutexLock lock(cache->mutex);
+
+		if (blocks_to_load.size() > 1) {
+			std::vector<Vector3i> positions;
+			positions.resize(blocks_to_load.size());
+			for (unsigned int i = 0; i < blocks_to_load.size(); ++i) {
+				BlockToLoad &b = blocks_to_load[i];
+				positions[i] = b.rpos;
+				b.sector_index = cache->region.get_block_sector_index(b.rpos);
+			}
+
+			// Reads of the whole batch are queued first, and the next blocks keep loading while one gets decompressed
+			cache->region.prefetch_blocks(positions);
+
+			std::sort(blocks_to_load.begin(), blocks_to_load.end(), [](const BlockToLoad &a, const BlockToLoad &b) {
+				return a.sector_index < b.sector_index;
+			});
+		}
 
-	Error err = cache->region.load_block(block_rpos, out_buffer, _block_serializer);
-	switch (err) {
-		case OK:
-			return EMERGE_OK;
+		for (unsigned int i = 0; i < blocks_to_load.size(); ++i) {
+			BlockToLoad &b = blocks_to_load[i];
+			Ref<VoxelBuffer> voxels = requests[b.request_index].voxel_buffer;
+			// Taken under the region lock, so the cache can tell which data is the most recent
+			b.cache_version = _block_cache.create_version();
+			const Error err = cache->region.load_block(
+					b.rpos, voxels, cache->block_serializer, keep_compressed_data ? &b.compressed_data : nullptr);
+
+			switch (err) {
+				case OK:
+					out_results[b.request_index] = EMERGE_OK;
+					break;
 
-		case ERR_DOES_NOT_EXIST:
-			return EMERGE_OK_FALLBACK;
+				case ERR_DOES_NOT_EXIST:
+					out_results[b.request_index] = EMERGE_OK_FALLBACK;
+					break;
 
-		default:
-			return EMERGE_FAILED;
+				default:
+					out_results[b.request_index] = EMERGE_FAILED;
+					break;
+			}
+		}
+	}
+	release_region(cache);
+
+	// Done once the region is unlocked, other threads can use it meanwhile
+	for (unsigned int i = 0; i < blocks_to_load.size(); ++i) {
+		BlockToLoad &b = blocks_to_load[i];
+		if (out_results[b.request_index] == EMERGE_OK) {
+			_block_cache.store_block(
+					b.position, lod, **requests[b.request_index].voxel_buffer, b.compressed_data, b.cache_version);
+		}
 	}
 }
 
@@ -159,43 +409,66 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 	ERR_FAIL_COND(_directory_path.empty());
 	ERR_FAIL_COND(voxel_buffer.is_null());
 
-	if (!_meta_loaded) {
-		// If it's not loaded, always try to load meta file first if it exists already,
-		// because we could want to save blocks without reading any
-		VoxelFileResult load_res = load_meta();
-		if (load_res != VOXEL_FILE_OK && load_res != VOXEL_FILE_CANT_OPEN) {
-			// The file is present but there is a problem with it
-			String meta_path = _directory_path.plus_file(META_FILE_NAME);
-			ERR_PRINT(String("Could not read {0}: error {1}").format(varray(meta_path, ::to_string(load_res))));
+	CachedRegion *cache = nullptr;
+	Vector3i block_pos;
+	Vector3i block_rpos;
+	VoxelBlockSerializerInternal::Codec codec;
+	{
+		MutexLock lock(_mutex);
+
+		if (!ensure_meta_saved_for_immerge(**voxel_buffer)) {
 			return;
 		}
-	}
 
-	if (!_meta_saved) {
-		// First time we save the meta file, initialize it from the first block format
-		for (unsigned int i = 0; i < _meta.channel_depths.size(); ++i) {
-			_meta.channel_depths[i] = voxel_buffer->get_channel_depth(i);
+		// Verify format
+		const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
+		ERR_FAIL_COND(voxel_buffer->get_size() != block_size);
+		for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+			ERR_FAIL_COND(voxel_buffer->get_channel_depth(i) != _meta.channel_depths[i]);
 		}
-		VoxelFileResult err = save_meta();
-		ERR_FAIL_COND(err != VOXEL_FILE_OK);
+
+		const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+		block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
+		Vector3i region_pos = get_region_position_from_blocks(block_pos);
+		block_rpos = block_pos.wrap(region_size);
+		//print_line(String("Immerging block {0} r {1}").format(varray(block_pos.to_vec3(), region_pos.to_vec3())));
+
+		cache = open_region(region_pos, lod, true);
+		ERR_FAIL_COND_MSG(cache == nullptr, "Could not save region file data");
+		++cache->users;
+		codec = static_cast<VoxelBlockSerializerInternal::Codec>(get_codec());
+	}
+
+	// Only compressed blocks are worth copying for the cache
+	const bool keep_compressed_data = _block_cache.get_budget() > 0 && !_block_cache.is_decoded();
+	std::vector<uint8_t> compressed_data;
+
+	Error err;
+	uint64_t cache_version;
+	{
+		MutexLock lock(cache->mutex);
+		// Regions have their own serializer, the codec may have changed since they were opened
+		cache->block_serializer.set_codec(codec);
+		// Taken under the region lock, so an older version loaded from the file can't replace this one in the cache
+		cache_version = _block_cache.create_version();
+		err = cache->region.save_block(
+				block_rpos, voxel_buffer, cache->block_serializer, keep_compressed_data ? &compressed_data : nullptr);
 	}
+	release_region(cache);
 
-	// Verify format
-	const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
-	ERR_FAIL_COND(voxel_buffer->get_size() != block_size);
-	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
-		ERR_FAIL_COND(voxel_buffer->get_channel_depth(i) != _meta.channel_depths[i]);
+	if (err == OK) {
+		_block_cache.store_block(block_pos, lod, **voxel_buffer, compressed_data, cache_version);
+	} else {
+		_block_cache.erase_block(block_pos, lod, cache_version);
 	}
 
-	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
-	Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
-	Vector3i region_pos = get_region_position_from_blocks(block_pos);
-	Vector3i block_rpos = block_pos.wrap(region_size);
-	//print_line(String("Immerging block {0} r {1}").format(varray(block_pos.to_vec3(), region_pos.to_vec3())));
+	ERR_FAIL_COND(err != OK);
+}
 
-	CachedRegion *cache = open_region(region_pos, lod, true);
-	ERR_FAIL_COND_MSG(cache == nullptr, "Could not save region file data");
-	ERR_FAIL_COND(cache->region.save_block(block_rpos, voxel_buffer, _block_serializer) != OK);
+void VoxelStreamRegionFiles::release_region(CachedRegion *cache) {
+	MutexLock lock(_mutex);
+	CRASH_COND(cache->users == 0);
+	--cache->users;
 }
 
 String VoxelStreamRegionFiles::get_directory() const {
@@ -207,6 +480,7 @@ void VoxelStreamRegionFiles::set_directory(String dirpath) {
 		_directory_path = dirpath.strip_edges();
 		_meta_loaded = false;
 		_meta_saved = false;
+		_block_cache.clear();
 		load_meta();
 		_change_notify();
 	}
@@ -420,13 +694,17 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(
 	}
 
 	while (_region_cache.size() > _max_open_regions - 1) {
-		close_oldest_region();
+		if (!close_oldest_region()) {
+			break;
+		}
 	}
-	// Not in cache, we'll have to open or create it
+	// Not in cache, we'll have to open or create it.
+	// Regions in use can't be closed, so there may temporarily be more open regions than the limit.
 
 	String fpath = get_region_file_path(region_pos, lod);
 
 	cached_region = memnew(CachedRegion);
+	cached_region->mutex = Mutex::create();
 
 	// Configure format because we might have to create the file, and some old file versions don't embed format
 	{
@@ -439,6 +717,7 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(
 		format.sector_size = _meta.sector_size;
 
 		cached_region->region.set_format(format);
+		cached_region->region.set_memory_mapping_enabled(_memory_mapping_enabled);
 		cached_region->position = region_pos;
 		cached_region->lod = lod;
 	}
@@ -451,6 +730,7 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(
 	//   we assume no other process will modify region files
 
 	if (err != OK) {
+		close_region(cached_region);
 		memdelete(cached_region);
 		if (create_if_not_found) {
 			// Could not create it apparently
@@ -471,6 +751,7 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(
 				format.sector_size != _meta.sector_size) {
 
 			ERR_PRINT("Region file has unexpected format");
+			close_region(cached_region);
 			memdelete(cached_region);
 			return nullptr;
 		}
@@ -488,32 +769,42 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(
 // TODO Get rid of to simplify?
 void VoxelStreamRegionFiles::close_region(CachedRegion *region) {
 	region->region.close();
+	if (region->mutex != nullptr) {
+		memdelete(region->mutex);
+		region->mutex = nullptr;
+	}
 }
 
-void VoxelStreamRegionFiles::close_oldest_region() {
+// Returns false if no region could be closed
+bool VoxelStreamRegionFiles::close_oldest_region() {
 	// Close region assumed to be the least recently used
 
-	if (_region_cache.size() == 0) {
-		return;
-	}
-
 	int oldest_index = -1;
 	uint64_t oldest_time = 0;
 	const uint64_t now = OS::get_singleton()->get_ticks_usec();
 
 	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
 		const CachedRegion *r = _region_cache[i];
+		if (r->users > 0) {
+			continue;
+		}
 		const uint64_t time = now - r->last_opened;
 		if (time >= oldest_time) {
+			oldest_time = time;
 			oldest_index = i;
 		}
 	}
 
+	if (oldest_index == -1) {
+		return false;
+	}
+
 	CachedRegion *region = _region_cache[oldest_index];
 	_region_cache.erase(_region_cache.begin() + oldest_index);
 
 	close_region(region);
 	memdelete(region);
+	return true;
 }
 
 static inline int convert_block_coordinate(int p_x, int old_size, int new_size) {
@@ -527,6 +818,7 @@ static Vector3i convert_block_coordinates(Vector3i pos, Vector3i old_size, Vecto
 			convert_block_coordinate(pos.z, old_size.z, new_size.z));
 }
 
+// This must not run while the stream is used by other threads.
 void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 	// TODO Converting across different block sizes is untested.
 	// I wrote it because it would be too bad to loose large voxel worlds because of a setting change, so one day we may need it
@@ -538,6 +830,8 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 	ERR_FAIL_COND(!_meta_loaded);
 
 	close_all_regions();
+	// Blocks will be saved again in the new format
+	_block_cache.clear();
 
 	Ref<VoxelStreamRegionFiles> old_stream;
 	old_stream.instance();
@@ -571,55 +865,13 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 		PRINT_VERBOSE("Data backed up as " + old_dir);
 	}
 
-	struct PositionAndLod {
-		Vector3i position;
-		int lod;
-	};
-
 	ERR_FAIL_COND(old_stream->load_meta() != VOXEL_FILE_OK);
 
-	std::vector<PositionAndLod> old_region_list;
+	std::vector<RegionPositionAndLod> old_region_list;
 	Meta old_meta = old_stream->_meta;
 
 	// Get list of all regions from the old stream
-	{
-		for (int lod = 0; lod < old_meta.lod_count; ++lod) {
-
-			const String lod_folder =
-					old_stream->_directory_path.plus_file("regions").plus_file("lod") + String::num_int64(lod);
-			const String ext = String(".") + VoxelRegionFile::FILE_EXTENSION;
-
-			DirAccessRef da = DirAccess::open(lod_folder);
-			if (!da) {
-				continue;
-			}
-
-			da->list_dir_begin();
-
-			while (true) {
-				String fname = da->get_next();
-				if (fname == "") {
-					break;
-				}
-				if (da->current_is_dir()) {
-					continue;
-				}
-				if (fname.ends_with(ext)) {
-					Vector<String> parts = fname.split(".");
-					// r.x.y.z.ext
-					ERR_FAIL_COND_MSG(parts.size() < 4, String("Found invalid region file: '{0}'").format(varray(fname)));
-					PositionAndLod p;
-					p.position.x = parts[1].to_int();
-					p.position.y = parts[2].to_int();
-					p.position.z = parts[3].to_int();
-					p.lod = lod;
-					old_region_list.push_back(p);
-				}
-			}
-
-			da->list_dir_end();
-		}
-	}
+	ERR_FAIL_COND(!old_stream->get_region_list(old_region_list));
 
 	_meta = new_meta;
 	ERR_FAIL_COND(save_meta() != VOXEL_FILE_OK);
@@ -632,7 +884,7 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 	// Read all blocks from the old stream and write them into the new one
 
 	for (unsigned int i = 0; i < old_region_list.size(); ++i) {
-		PositionAndLod region_info = old_region_list[i];
+		const RegionPositionAndLod region_info = old_region_list[i];
 
 		const CachedRegion *old_region = old_stream->open_region(region_info.position, region_info.lod, false);
 		if (old_region == nullptr) {
@@ -718,6 +970,130 @@ void VoxelStreamRegionFiles::_convert_files(Meta new_meta) {
 	print_line("Done converting region files");
 }
 
+bool VoxelStreamRegionFiles::get_region_list(std::vector<RegionPositionAndLod> &out_regions) const {
+	for (int lod = 0; lod < _meta.lod_count; ++lod) {
+		const String lod_folder = _directory_path.plus_file("regions").plus_file("lod") + String::num_int64(lod);
+		const String ext = String(".") + VoxelRegionFile::FILE_EXTENSION;
+
+		DirAccessRef da = DirAccess::open(lod_folder);
+		if (!da) {
+			continue;
+		}
+
+		da->list_dir_begin();
+
+		while (true) {
+			String fname = da->get_next();
+			if (fname == "") {
+				break;
+			}
+			if (da->current_is_dir()) {
+				continue;
+			}
+			if (fname.ends_with(ext)) {
+				Vector<String> parts = fname.split(".");
+				// r.x.y.z.ext
+				ERR_FAIL_COND_V_MSG(parts.size() < 4, false,
+						String("Found invalid region file: '{0}'").format(varray(fname)));
+				RegionPositionAndLod p;
+				p.position.x = parts[1].to_int();
+				p.position.y = parts[2].to_int();
+				p.position.z = parts[3].to_int();
+				p.lod = lod;
+				out_regions.push_back(p);
+			}
+		}
+
+		da->list_dir_end();
+	}
+	return true;
+}
+
+// Other threads wait while files get compacted. Fails if they are in the middle of using regions.
+// Must be called from the main thread.
+Error VoxelStreamRegionFiles::compact_files() {
+	PRINT_VERBOSE("Compacting region files");
+
+	// Terrains stream from their own copy of this stream, which keeps regions open and has its own view of them.
+	// Files replaced under it would lose everything it saves afterward.
+	ERR_FAIL_COND_V_MSG(VoxelServer::get_singleton()->is_stream_used_by_volumes(this), ERR_BUSY,
+			"Can't compact region files while the stream is used by a terrain");
+
+	MutexLock lock(_mutex);
+
+	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
+		ERR_FAIL_COND_V_MSG(_region_cache[i]->users > 0, ERR_BUSY,
+				"Can't compact region files while they are being used");
+	}
+
+	if (!_meta_loaded) {
+		if (load_meta() != VOXEL_FILE_OK) {
+			// No files yet
+			return OK;
+		}
+	}
+
+	close_all_regions();
+
+	std::vector<RegionPositionAndLod> regions;
+	ERR_FAIL_COND_V(!get_region_list(regions), ERR_CANT_OPEN);
+
+	Error result = OK;
+
+	for (unsigned int i = 0; i < regions.size(); ++i) {
+		const RegionPositionAndLod region_info = regions[i];
+
+		CachedRegion *cache = open_region(region_info.position, region_info.lod, false);
+		if (cache == nullptr) {
+			continue;
+		}
+
+		const unsigned int free_sector_count = cache->region.get_free_sector_count();
+		if (free_sector_count > 0) {
+			PRINT_VERBOSE(String("Compacting region lod{0}/{1}, {2} free sectors out of {3}")
+								  .format(varray(region_info.lod, region_info.position.to_vec3(), free_sector_count,
+										  cache->region.get_sector_count())));
+			const Error err = cache->region.compact();
+			if (err != OK) {
+				ERR_PRINT(String("Failed to compact region lod{0}/{1}, error {2}")
+								  .format(varray(region_info.lod, region_info.position.to_vec3(), err)));
+				result = err;
+			}
+		}
+
+		// Regions are visited only once, no need to keep them open
+		close_all_regions();
+	}
+
+	return result;
+}
+
+void VoxelStreamRegionFiles::set_block_cache_size_mb(int size_mb) {
+	ERR_FAIL_COND(size_mb < 0);
+	_block_cache.set_budget(static_cast<uint64_t>(size_mb) << 20);
+}
+
+int VoxelStreamRegionFiles::get_block_cache_size_mb() const {
+	return _block_cache.get_budget() >> 20;
+}
+
+void VoxelStreamRegionFiles::set_block_cache_decoded(bool decoded) {
+	_block_cache.set_decoded(decoded);
+}
+
+bool VoxelStreamRegionFiles::is_block_cache_decoded() const {
+	return _block_cache.is_decoded();
+}
+
+void VoxelStreamRegionFiles::set_memory_mapping_enabled(bool enabled) {
+	MutexLock lock(_mutex);
+	_memory_mapping_enabled = enabled;
+}
+
+bool VoxelStreamRegionFiles::is_memory_mapping_enabled() const {
+	return _memory_mapping_enabled;
+}
+
 Vector3i VoxelStreamRegionFiles::get_region_size() const {
 	return Vector3i(1 << _meta.region_size_po2);
 }
@@ -836,12 +1212,32 @@ void VoxelStreamRegionFiles::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_sector_size"), &VoxelStreamRegionFiles::set_sector_size);
 
 	ClassDB::bind_method(D_METHOD("convert_files", "new_settings"), &VoxelStreamRegionFiles::convert_files);
+	ClassDB::bind_method(D_METHOD("compact_files"), &VoxelStreamRegionFiles::compact_files);
+
+	ClassDB::bind_method(D_METHOD("set_memory_mapping_enabled", "enabled"),
+			&VoxelStreamRegionFiles::set_memory_mapping_enabled);
+	ClassDB::bind_method(D_METHOD("is_memory_mapping_enabled"), &VoxelStreamRegionFiles::is_memory_mapping_enabled);
+
+	ClassDB::bind_method(D_METHOD("set_block_cache_size_mb", "size_mb"),
+			&VoxelStreamRegionFiles::set_block_cache_size_mb);
+	ClassDB::bind_method(D_METHOD("get_block_cache_size_mb"), &VoxelStreamRegionFiles::get_block_cache_size_mb);
+	ClassDB::bind_method(D_METHOD("set_block_cache_decoded", "decoded"),
+			&VoxelStreamRegionFiles::set_block_cache_decoded);
+	ClassDB::bind_method(D_METHOD("is_block_cache_decoded"), &VoxelStreamRegionFiles::is_block_cache_decoded);
 
 	ADD_PROPERTY(PropertyInfo(Variant::STRING, "directory", PROPERTY_HINT_DIR), "set_directory", "get_directory");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "memory_mapping_enabled"), "set_memory_mapping_enabled",
+			"is_memory_mapping_enabled");
 
 	ADD_GROUP("Dimensions", "");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "lod_count"), "set_lod_count", "get_lod_count");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "region_size_po2"), "set_region_size_po2", "get_region_size_po2");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "block_size_po2"), "set_block_size_po2", "get_region_size_po2");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "sector_size"), "set_sector_size", "get_sector_size");
+
+	ADD_GROUP("Cache", "");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "block_cache_size_mb", PROPERTY_HINT_RANGE, "0,1024,1"),
+			"set_block_cache_size_mb", "get_block_cache_size_mb");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "block_cache_decoded"), "set_block_cache_decoded",
+			"is_block_cache_decoded");
 }
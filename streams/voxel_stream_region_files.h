@@ -4,6 +4,7 @@
 #include "../util/fixed_array.h"
 #include "file_utils.h"
 #include "region_file.h"
+#include "voxel_block_cache.h"
 #include "voxel_stream_file.h"
 
 class FileAccess;
@@ -15,6 +16,10 @@ class FileAccess;
 // because it allows to keep using the same file handles and avoid switching.
 // Inspired by https://www.seedofandromeda.com/blogs/1-creating-a-region-file-system-for-a-voxel-game
 //
+// Can be used by multiple threads at once, as long as its fallback stream is thread-safe too.
+// Each region can be read or written by only one thread at a time,
+// so requests should rather be grouped by region, which is what the block affinity is for.
+//
 class VoxelStreamRegionFiles : public VoxelStreamFile {
 	GDCLASS(VoxelStreamRegionFiles, VoxelStreamFile)
 public:
@@ -27,6 +32,16 @@ public:
 	void emerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
 	void immerge_blocks(Vector<VoxelBlockRequest> &p_blocks) override;
 
+	EmergeResult emerge_block_without_fallback(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod) override;
+	void emerge_blocks_without_fallback(
+			const Vector<VoxelBlockRequest> &requests, std::vector<EmergeResult> &out_results) override;
+
+	Stats get_statistics() const override;
+
+	bool is_thread_safe() const override;
+	bool is_thread_safe_without_fallback() const override;
+	int get_block_affinity(Vector3i origin_in_voxels, int lod) const override;
+
 	String get_directory() const;
 	void set_directory(String dirpath);
 
@@ -44,7 +59,22 @@ public:
 	void set_sector_size(int p_sector_size);
 	void set_lod_count(int p_lod_count);
 
+	// Recently loaded and saved blocks are kept in memory up to this size, so reading them again doesn't access files
+	void set_block_cache_size_mb(int size_mb);
+	int get_block_cache_size_mb() const;
+
+	// Keeps cached blocks decoded instead of compressed. Uses more memory, but loading them is faster.
+	void set_block_cache_decoded(bool decoded);
+	bool is_block_cache_decoded() const;
+
+	// Reads blocks from memory-mapped files where the platform supports it
+	void set_memory_mapping_enabled(bool enabled);
+	bool is_memory_mapping_enabled() const;
+
 	void convert_files(Dictionary d);
+	// Rewrites region files which have free space left by blocks that changed size.
+	// Returns ERR_BUSY if other threads are using regions.
+	Error compact_files();
 
 protected:
 	static void _bind_methods();
@@ -53,13 +83,9 @@ private:
 	struct CachedRegion;
 	struct RegionHeader;
 
-	enum EmergeResult {
-		EMERGE_OK,
-		EMERGE_OK_FALLBACK,
-		EMERGE_FAILED
-	};
-
 	EmergeResult _emerge_block(Ref<VoxelBuffer> out_buffer, Vector3i origin_in_voxels, int lod);
+	void _emerge_blocks_in_region(const VoxelBlockRequest *requests, EmergeResult *out_results, unsigned int count);
+	bool is_same_region(const VoxelBlockRequest &a, const VoxelBlockRequest &b) const;
 	void _immerge_block(Ref<VoxelBuffer> voxel_buffer, Vector3i origin_in_voxels, int lod);
 
 	VoxelFileResult save_meta();
@@ -72,7 +98,10 @@ private:
 	void close_region(CachedRegion *cache);
 	CachedRegion *get_region_from_cache(const Vector3i pos, int lod) const;
 	int get_sectors_count(const RegionHeader &header) const;
-	void close_oldest_region();
+	bool close_oldest_region();
+	void release_region(CachedRegion *cache);
+	bool ensure_meta_loaded_for_emerge();
+	bool ensure_meta_saved_for_immerge(const VoxelBuffer &voxel_buffer);
 
 	struct Meta {
 		uint8_t version = -1;
@@ -86,6 +115,13 @@ private:
 	static bool check_meta(const Meta &meta);
 	void _convert_files(Meta new_meta);
 
+	struct RegionPositionAndLod {
+		Vector3i position;
+		int lod;
+	};
+
+	bool get_region_list(std::vector<RegionPositionAndLod> &out_regions) const;
+
 	// Orders block requests so those querying the same regions get grouped together
 	struct BlockRequestComparator {
 		VoxelStreamRegionFiles *self = nullptr;
@@ -97,8 +133,9 @@ private:
 			} else if (a.lod > b.lod) {
 				return false;
 			}
-			Vector3i bpos_a = self->get_block_position_from_voxels(a.origin_in_voxels);
-			Vector3i bpos_b = self->get_block_position_from_voxels(b.origin_in_voxels);
+			// Same as `is_same_region`, so requests of a region end up next to each other
+			Vector3i bpos_a = self->get_block_position_from_voxels(a.origin_in_voxels) >> a.lod;
+			Vector3i bpos_b = self->get_block_position_from_voxels(b.origin_in_voxels) >> b.lod;
 			Vector3i rpos_a = self->get_region_position_from_blocks(bpos_a);
 			Vector3i rpos_b = self->get_region_position_from_blocks(bpos_b);
 			return rpos_a < rpos_b;
@@ -112,6 +149,12 @@ private:
 		VoxelRegionFile region;
 		uint64_t last_opened = 0;
 		//uint64_t last_accessed;
+		// Held while the region file is read or written
+		Mutex *mutex = nullptr;
+		// How many threads are using the region. It can't be closed until they are done.
+		unsigned int users = 0;
+		// Serializers have internal buffers, so each region has its own, used under the region lock
+		VoxelBlockSerializerInternal block_serializer;
 	};
 
 	String _directory_path;
@@ -119,8 +162,13 @@ private:
 	bool _meta_loaded = false;
 	bool _meta_saved = false;
 	std::vector<CachedRegion *> _region_cache;
-	// TODO Add memory caches to increase capacity.
+	// Blocks are looked up here before opening regions. It has its own lock.
+	VoxelBlockCache _block_cache;
 	unsigned int _max_open_regions = MIN(8, FOPEN_MAX);
+	// Applies to regions opened afterwards
+	bool _memory_mapping_enabled = false;
+	// Protects meta, the region cache and stats
+	Mutex *_mutex = nullptr;
 };
 
 #endif // VOXEL_STREAM_REGION_H
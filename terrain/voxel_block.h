@@ -28,6 +28,12 @@ public:
 	unsigned int lod_index = 0;
 	bool pending_transition_update = false;
 	VoxelViewerRefCount viewers;
+	// When voxels were last loaded or modified, to find blocks which are no longer being edited
+	uint32_t last_edit_time_msec = 0;
+	// If true, the block has an entry in the terrain's compression queue
+	bool pending_compression = false;
+	// Generation of voxels when they were last loaded or saved. If it didn't change, there is nothing new to save.
+	uint64_t saved_voxels_generation = 0;
 
 	static VoxelBlock *create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned int size, unsigned int p_lod_index);
 
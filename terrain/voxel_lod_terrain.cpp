@@ -1322,12 +1322,17 @@ struct ScheduleSaveAction {
 
 		// TODO Don't ask for save if the stream doesn't support it!
 		if (block->is_modified()) {
+			const uint64_t generation = block->voxels->get_generation();
+			if (generation == block->saved_voxels_generation) {
+				// Flagged as modified, but voxels were not written since they were last loaded or saved
+				block->set_modified(false);
+				return;
+			}
 			//print_line(String("Scheduling save for block {0}").format(varray(block->position.to_vec3())));
 			VoxelLodTerrain::BlockToSave b;
 
 			if (with_copy) {
-				RWLockRead lock(block->voxels->get_lock());
-				b.voxels = block->voxels->duplicate(true);
+				b.voxels = block->voxels->snapshot(true);
 			} else {
 				b.voxels = block->voxels;
 			}
@@ -1336,6 +1341,7 @@ struct ScheduleSaveAction {
 			b.lod = block->lod_index;
 			blocks_to_save.push_back(b);
 			block->set_modified(false);
+			block->saved_voxels_generation = generation;
 		}
 	}
 };
@@ -62,6 +62,8 @@ VoxelBlock *VoxelMap::get_or_create_block_at_voxel_pos(Vector3i pos) {
 		Ref<VoxelBuffer> buffer(memnew(VoxelBuffer));
 		buffer->create(_block_size, _block_size, _block_size);
 		buffer->set_default_values(_default_voxel);
+		// Blocks of a map are edited in place a lot, bricks avoid decompressing them entirely
+		buffer->set_sparse_bricks_enabled(true);
 
 		block = VoxelBlock::create(bpos, buffer, _block_size, _lod_index);
 
@@ -173,12 +175,14 @@ void VoxelMap::remove_block_internal(Vector3i bpos, unsigned int index) {
 
 VoxelBlock *VoxelMap::set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> buffer) {
 	ERR_FAIL_COND_V(buffer.is_null(), nullptr);
+	buffer->set_sparse_bricks_enabled(true);
 	VoxelBlock *block = get_block(bpos);
 	if (block == nullptr) {
 		block = VoxelBlock::create(bpos, *buffer, _block_size, _lod_index);
 		set_block(bpos, block);
 	} else {
 		block->voxels = buffer;
+		block->saved_voxels_generation = buffer->get_generation();
 	}
 	return block;
 }
@@ -232,10 +232,25 @@ void VoxelTerrain::make_block_dirty(Vector3i bpos) {
 	make_block_dirty(block);
 }
 
+void VoxelTerrain::schedule_block_compression(VoxelBlock *block) {
+	const uint32_t now = OS::get_singleton()->get_ticks_msec();
+	block->last_edit_time_msec = now;
+	if (block->pending_compression) {
+		// Edits can happen many times per frame, the existing entry will see the new time
+		return;
+	}
+	block->pending_compression = true;
+	BlockToCompress b;
+	b.position = block->position;
+	b.time_msec = now;
+	_blocks_pending_compression.push_back(b);
+}
+
 void VoxelTerrain::make_block_dirty(VoxelBlock *block) {
 	// TODO Immediate update viewer distance?
 	CRASH_COND(block == nullptr);
 	block->set_modified(true);
+	schedule_block_compression(block);
 	try_schedule_block_update(block);
 
 	//OS::get_singleton()->print("Dirty (%i, %i, %i)", bpos.x, bpos.y, bpos.z);
@@ -374,17 +389,23 @@ struct ScheduleSaveAction {
 	void operator()(VoxelBlock *block) {
 		// TODO Don't ask for save if the stream doesn't support it!
 		if (block->is_modified()) {
+			const uint64_t generation = block->voxels->get_generation();
+			if (generation == block->saved_voxels_generation) {
+				// Flagged as modified, but voxels were not written since they were last loaded or saved
+				block->set_modified(false);
+				return;
+			}
 			//print_line(String("Scheduling save for block {0}").format(varray(block->position.to_vec3())));
 			VoxelTerrain::BlockToSave b;
 			if (with_copy) {
-				RWLockRead lock(block->voxels->get_lock());
-				b.voxels = block->voxels->duplicate(true);
+				b.voxels = block->voxels->snapshot(true);
 			} else {
 				b.voxels = block->voxels;
 			}
 			b.position = block->position;
 			blocks_to_save.push_back(b);
 			block->set_modified(false);
+			block->saved_voxels_generation = generation;
 		}
 	}
 };
@@ -512,6 +533,7 @@ void VoxelTerrain::reset_map() {
 	_blocks_pending_load.clear();
 	_blocks_pending_update.clear();
 	_blocks_to_save.clear();
+	_blocks_pending_compression.clear();
 
 	// No need to care about refcounts, we drop everything anyways. Will pair it back on next process.
 	_paired_viewers.clear();
@@ -1032,6 +1054,7 @@ void VoxelTerrain::_process() {
 			const bool was_not_loaded = block == nullptr;
 			block = _map.set_block_buffer(block_pos, ob.voxels);
 			block->set_world(get_world());
+			schedule_block_compression(block);
 
 			if (was_not_loaded) {
 				// Set viewers count that are currently expecting the block
@@ -1085,6 +1108,37 @@ void VoxelTerrain::_process() {
 		}
 	}
 
+	// Compress blocks which are no longer being edited.
+	// The server does it in the background, so they can still be used and modified meanwhile.
+	{
+		const uint32_t now = OS::get_singleton()->get_ticks_msec();
+		while (_blocks_pending_compression.size() > 0) {
+			const BlockToCompress b = _blocks_pending_compression.front();
+			if (now - b.time_msec < VoxelConstants::BLOCK_COMPRESSION_DELAY_MS) {
+				break;
+			}
+			_blocks_pending_compression.pop_front();
+
+			VoxelBlock *block = _map.get_block(b.position);
+			// The entry may be left by a block which was unloaded since
+			if (block == nullptr || !block->pending_compression) {
+				continue;
+			}
+
+			if (now - block->last_edit_time_msec < VoxelConstants::BLOCK_COMPRESSION_DELAY_MS) {
+				// Edited again meanwhile, wait from the last edit
+				BlockToCompress requeued;
+				requeued.position = b.position;
+				requeued.time_msec = block->last_edit_time_msec;
+				_blocks_pending_compression.push_back(requeued);
+				continue;
+			}
+
+			block->pending_compression = false;
+			VoxelServer::get_singleton()->request_block_compression(_volume_id, block->voxels);
+		}
+	}
+
 	_stats.time_process_load_responses = profiling_clock.restart();
 
 	// Send mesh updates
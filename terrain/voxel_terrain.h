@@ -6,6 +6,8 @@
 
 #include <scene/3d/spatial.h>
 
+#include <deque>
+
 class VoxelTool;
 
 // Infinite paged terrain made of voxel blocks all with the same level of detail.
@@ -99,6 +101,7 @@ private:
 	void immerge_block(Vector3i bpos);
 	void make_block_dirty(Vector3i bpos);
 	void make_block_dirty(VoxelBlock *block);
+	void schedule_block_compression(VoxelBlock *block);
 	void try_schedule_block_update(VoxelBlock *block);
 
 	void save_all_modified_blocks(bool with_copy);
@@ -164,6 +167,15 @@ private:
 	std::vector<Vector3i> _blocks_pending_update;
 	std::vector<BlockToSave> _blocks_to_save;
 
+	struct BlockToCompress {
+		Vector3i position;
+		uint32_t time_msec;
+	};
+
+	// Blocks get compressed once they were left unchanged for a while. Ordered by time.
+	// There is one entry per block, blocks edited again get queued again when their entry comes up.
+	std::deque<BlockToCompress> _blocks_pending_compression;
+
 	Ref<VoxelStream> _stream;
 
 	Ref<VoxelLibrary> _library;
@@ -0,0 +1,82 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include "fixed_array.h"
+#include <atomic>
+
+// Counts durations in power-of-two buckets of microseconds.
+// Recording is a single relaxed atomic increment, so it is cheap enough to stay enabled in release builds.
+// Meant to be written by one thread, while others may read it at any time (values can be slightly outdated).
+class LatencyHistogram {
+public:
+	// Last bucket also counts everything above 2^31 microseconds (about 35 minutes)
+	static const unsigned int BUCKET_COUNT = 32;
+
+	// Plain copy of the counts, which can be summed up and queried
+	struct Counts {
+		FixedArray<uint64_t, BUCKET_COUNT> buckets;
+		uint64_t total = 0;
+
+		Counts() {
+			buckets.fill(0);
+		}
+
+		void add(const Counts &other) {
+			for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+				buckets[i] += other.buckets[i];
+			}
+			total += other.total;
+		}
+
+		// Returns the upper bound of the bucket containing the given percentile, in range [0..1].
+		// Precision is within a factor of two, which is enough to see trends.
+		uint64_t get_percentile_usec(float p) const {
+			if (total == 0) {
+				return 0;
+			}
+			const uint64_t threshold = static_cast<uint64_t>(p * static_cast<float>(total));
+			uint64_t sum = 0;
+			for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+				sum += buckets[i];
+				if (sum > threshold || sum == total) {
+					return uint64_t(1) << (i + 1);
+				}
+			}
+			return uint64_t(1) << BUCKET_COUNT;
+		}
+	};
+
+	LatencyHistogram() {
+		for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+			_buckets[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	inline void record(uint64_t usec) {
+		_buckets[get_bucket_index(usec)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Adds current counts to the given ones
+	void get_counts(Counts &counts) const {
+		for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+			const uint32_t v = _buckets[i].load(std::memory_order_relaxed);
+			counts.buckets[i] += v;
+			counts.total += v;
+		}
+	}
+
+private:
+	// Bucket 0 is [0..2[, bucket i is [2^i..2^(i+1)[
+	static inline unsigned int get_bucket_index(uint64_t usec) {
+		unsigned int i = 0;
+		while (usec > 1 && i < BUCKET_COUNT - 1) {
+			usec >>= 1;
+			++i;
+		}
+		return i;
+	}
+
+	std::atomic<uint32_t> _buckets[BUCKET_COUNT];
+};
+
+#endif // LATENCY_HISTOGRAM_H
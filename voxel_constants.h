@@ -9,6 +9,8 @@ static const unsigned int MAX_LOD = 32;
 static const unsigned int MAX_VOLUME_EXTENT = 0x1fffffff;
 static const unsigned int MAX_VOLUME_SIZE = 2 * MAX_VOLUME_EXTENT; // 1,073,741,822 voxels
 static const unsigned int MAIN_THREAD_MESHING_BUDGET_MS = 8;
+// Blocks left unchanged for this long get their voxels compressed in memory
+static const unsigned int BLOCK_COMPRESSION_DELAY_MS = 5000;
 
 } // namespace VoxelConstants
 